@@ -0,0 +1,2 @@
+uint32_t crc32(uint32_t crc, uint8_t *data, uint16_t n);
+uint16_t crc16(uint16_t crc, uint8_t *data, uint16_t n);
@@ -1,9 +1,74 @@
 #include "avr.h"
+#include <avr/interrupt.h>
 #include "spi.h"
 #include "serial.h"
+#include "timer.h"
+#include "rle.h"
+#include "crc.h"
 
-#define DAT_SIZE 512 /* max data length, buffer size is 2 more */
+#define DAT_SIZE 512 /* max data length, buffer size is 4 more */
 #define HDR_SIZE  5
+#define HDR2_SIZE 7
+#define CHECK_SIZE 2 /* crc16 of a version 3 frame */
+
+#define ACK 0x06
+#define NAK 0x15
+#define SOH 0x01
+#define STX 0x02
+#define ETX 0x03
+#define DC1 0x11 /* start of a version 2 frame */
+#define SYN 0x16 /* version negotiation */
+
+#define PROTO_VER 3
+#define WINDOW    4        /* frames the host may keep in flight */
+/* frames in flight beyond the one being worked on wait in the rx ring */
+#define RX_BUF    RX_RING
+
+/* programmer operations carried by version 2 frames */
+#define OP_SPI  0x00       /* plain spi transfer, same as version 1 */
+#define OP_PROG 0x01       /* program pages, data is 24 bit address + payload */
+#define OP_WAIT 0x02       /* poll until ready, data is timeout in ms */
+#define OP_BAUD 0x03       /* switch baud rate, data is a list of rates */
+#define OP_RDZ  0x04       /* spi transfer with run length encoded answer */
+#define OP_PROGZ 0x05      /* OP_PROG with run length encoded payload */
+#define OP_CRC  0x06       /* crc32 of flash blocks */
+#define OP_PROG4 0x07      /* OP_PROG, data is opcode + 32 bit address + payload */
+#define OP_PROGZ4 0x08     /* OP_PROGZ with opcode and 32 bit address */
+#define OP_CRC4 0x09       /* OP_CRC with opcode and 32 bit address */
+#define OP_CS   0x0A       /* select the chips writes go to */
+#define OP_WREN 0x0B       /* write enable, checked on each selected chip */
+#define OP_MAX  0x0C
+
+/* status byte returned by OP_PROG, OP_PROGZ and OP_WAIT */
+#define ST_OK      0x00
+#define ST_WREN    0x01    /* write enable latch not set */
+#define ST_TIMEOUT 0x02    /* write in progress did not clear */
+#define ST_ARG     0x03    /* frame too short */
+
+#define PAGE_SIZE 0x100
+#define PP_TIMEOUT 10      /* ms */
+#define TRIAL_TIME 1000    /* ms to confirm a new baud rate */
+#define CRC_CHUNK 64       /* bytes read from spi per crc update */
+
+/* baud rate change states */
+#define BAUD_IDLE    0
+#define BAUD_PENDING 1     /* switch once the answer is sent */
+#define BAUD_TRIAL   2     /* switched, waiting for a good packet */
+
+static uint8_t baud = BAUD_IDLE, new_u2x;
+static uint16_t new_ubrr;
+/* version negotiated last, frames carry crcs from version 3 on */
+static uint8_t link_ver = 2;
+/* chips dropped from cs_mask since the last OP_CS */
+static uint8_t cs_failed;
+
+/* where a program or crc op works. 3 byte ops use the usual opcode,
+ * 4 byte ops carry their own in front of the address */
+typedef struct {
+	uint8_t cmd;
+	uint8_t len;       /* address bytes */
+	uint32_t addr;
+} target;
 
 
 /* convert a single byte to 2 ascii codes, only for debugging */
@@ -26,56 +91,550 @@ void byte2hex(uint8_t c, uint8_t *hex)
 
 
 
-/* write wn bytes, read rn bytes and write to serial port */
+/* write wn bytes, read rn bytes and write to serial port.
+ * the next spi transfer runs while the last byte is queued for
+ * the uart, so the uart never waits on spi.
+ * writes go to all selected chips, reads to the lowest one */
 void spi2serial(uint8_t *wbuf, uint16_t wn, uint16_t rn)
 {
-	CS_LOW;
-	spi_rw(wbuf, wn, NULL, 0, 0);
-	uint16_t i;
 	uint8_t temp;
-	for(i = 0; i < rn; i++){
-		spi_rw(NULL, 0, &temp, 1, 0);
+	CS_SEL(rn ? CS_ONE : cs_mask);
+	spi_write(wbuf, wn);
+	if(rn){
+		SPDR = 0;
+		while(--rn){
+			while( !(SPSR & _BV(SPIF)) )
+				;
+			temp = SPDR;
+			SPDR = 0;
+			serial_write(&temp, 1);
+		}
+		while( !(SPSR & _BV(SPIF)) )
+			;
+		temp = SPDR;
 		serial_write(&temp, 1);
 	}
 	CS_HIGH;
 }
 
+/* write wn bytes, read rn bytes and send them run length encoded,
+ * overlapped the same way as spi2serial */
+void spi2rle(uint8_t *wbuf, uint16_t wn, uint16_t rn)
+{
+	uint8_t temp;
+	CS_SEL(CS_ONE);
+	spi_write(wbuf, wn);
+	rle_start();
+	if(rn){
+		SPDR = 0;
+		while(--rn){
+			while( !(SPSR & _BV(SPIF)) )
+				;
+			temp = SPDR;
+			SPDR = 0;
+			rle_put(temp);
+		}
+		while( !(SPSR & _BV(SPIF)) )
+			;
+		rle_put(SPDR);
+	}
+	rle_end();
+	CS_HIGH;
+}
+
+/* send a single control byte */
+static void reply(uint8_t c)
+{
+	serial_write(&c, 1);
+}
+
+/* read flash status register of one chip, a single bit of a chip mask */
+static uint8_t rdsr(uint8_t chip)
+{
+	uint8_t cmd = 0x05, status;
+	spi_rw(&cmd, 1, &status, 1, chip);
+	return status;
+}
+
+/* stop writing to the chips in failed, the others go on without them.
+ * return 1 if no chip would be left, the selection is kept then */
+static uint8_t drop(uint8_t failed)
+{
+	if(failed == cs_mask)
+		return 1;
+	cs_failed |= failed;
+	cs_mask &= ~failed;
+	return 0;
+}
+
+/* poll status register of each selected chip until write in progress
+ * clears or timeout ms have passed, elapsed time is stored in elapsed
+ * if not NULL.
+ * return mask of the chips still busy, 0 when all are ready */
+static uint8_t wait_ready(uint16_t timeout, uint16_t *elapsed)
+{
+	uint16_t t0 = timer_ms(), t;
+	uint8_t busy = cs_mask, chip;
+	do{
+		for(chip = 0x01; chip; chip <<= 1)
+			if((busy & chip) && !(rdsr(chip) & 0x01))
+				busy &= ~chip;
+		t = timer_ms() - t0;
+	}while(busy && t < timeout);
+	if(elapsed)
+		*elapsed = t;
+	return busy;
+}
+
+/* poll until ready, data is timeout in ms, little endian.
+ * answer is status and elapsed ms, little endian */
+static void op_wait(uint8_t *data, uint16_t n)
+{
+	uint16_t elapsed = 0;
+	uint8_t status = ST_ARG;
+	if(n == 2)
+		status = wait_ready(data[0] + (data[1] << 8), &elapsed) ?
+		         ST_TIMEOUT : ST_OK;
+	reply(status);
+	reply(elapsed & 0xFF);
+	reply(elapsed >> 8);
+}
+
+/* set write enable latch of the selected chips and check each one,
+ * chips that did not take it are dropped.
+ * return 0 on success, 1 on failure */
+static uint8_t wren()
+{
+	uint8_t cmd = 0x06, chip, failed = 0;
+	spi_rw(&cmd, 1, NULL, 0, cs_mask);
+	for(chip = 0x01; chip; chip <<= 1)
+		if((cs_mask & chip) && !(rdsr(chip) & 0x02))
+			failed |= chip;
+	return failed && drop(failed);
+}
+
+/* 24 bit big endian value */
+static uint32_t get24(uint8_t *data)
+{
+	return ((uint32_t)data[0] << 16) | ((uint16_t)data[1] << 8) | data[2];
+}
+
+/* read the head of a frame into t, the 24 bit address for 3 byte ops,
+ * or opcode and 32 bit address if wide. cmd is the opcode of 3 byte ops.
+ * return length of the head */
+static uint8_t get_target(uint8_t *data, uint8_t wide, uint8_t cmd, target *t)
+{
+	if(!wide){
+		t->cmd = cmd;
+		t->len = 3;
+		t->addr = get24(data);
+		return 3;
+	}
+	t->cmd = data[0];
+	t->len = 4;
+	t->addr = ((uint32_t)data[1] << 24) | get24(data + 2);
+	return 5;
+}
+
+/* send opcode and address of t, CS must be low */
+static void send_target(target *t)
+{
+	uint8_t cmd[5], i;
+	cmd[0] = t->cmd;
+	for(i = 0; i < t->len; i++)
+		cmd[1 + i] = (t->addr >> ((t->len - 1 - i) * 8)) & 0xFF;
+	spi_write(cmd, 1 + t->len);
+}
+
+/* program len bytes at t, must not cross a page boundary
+ * return ST_* status */
+static uint8_t program_page(target *t, uint8_t *data, uint16_t len)
+{
+	uint8_t busy;
+	if(wren())
+		return ST_WREN;
+	CS_LOW;
+	send_target(t);
+	spi_write(data, len);
+	CS_HIGH;
+	busy = wait_ready(PP_TIMEOUT, NULL);
+	return busy && drop(busy) ? ST_TIMEOUT : ST_OK;
+}
+
+/* program n bytes of data, starting with the address head, see get_target().
+ * data may span several pages, each is enabled, programmed and polled.
+ * return ST_* status */
+static uint8_t program(uint8_t *data, uint16_t n, uint8_t wide)
+{
+	uint16_t len;
+	uint8_t status;
+	target t;
+	if(n < (wide ? 5 : 3))
+		return ST_ARG;
+	len = get_target(data, wide, 0x02, &t);
+	data += len;
+	n -= len;
+	while(n){
+		len = PAGE_SIZE - (t.addr & (PAGE_SIZE - 1));
+		if(len > n)
+			len = n;
+		status = program_page(&t, data, len);
+		if(status != ST_OK)
+			return status;
+		t.addr += len;
+		data += len;
+		n -= len;
+	}
+	return ST_OK;
+}
+
+/* same as program(), but the payload after the address is run length
+ * encoded. it is expanded one page at a time, blank pages are skipped.
+ * return ST_* status */
+static uint8_t program_rle(uint8_t *data, uint16_t n, uint8_t wide)
+{
+	uint8_t page[PAGE_SIZE];
+	uint8_t c, b = 0, literal, blank = 1, status;
+	uint16_t run, fill = 0;
+	target t;
+	if(n < (wide ? 5 : 3))
+		return ST_ARG;
+	c = get_target(data, wide, 0x02, &t);
+	data += c;
+	n -= c;
+	while(n){
+		c = *data++;
+		n--;
+		literal = c < 0x80;
+		if(literal)
+			run = c + 1;
+		else{
+			if(!n)
+				return ST_ARG;
+			if(c < 0xC0){
+				run = (c & 0x3F) + 3;
+				b = *data;
+			}
+			else{
+				run = (((uint16_t)c & 0x1F) << 8 | *data) + 1;
+				b = c < 0xE0 ? 0xFF : 0x00;
+			}
+			data++;
+			n--;
+		}
+		if(literal && run > n)
+			return ST_ARG;
+		while(run--){
+			if(literal){
+				b = *data++;
+				n--;
+			}
+			page[fill++] = b;
+			blank &= b == 0xFF;
+			/* page boundary reached */
+			if(!((t.addr + fill) & (PAGE_SIZE - 1))){
+				status = blank ? ST_OK : program_page(&t, page, fill);
+				if(status != ST_OK)
+					return status;
+				t.addr += fill;
+				fill = 0;
+				blank = 1;
+			}
+		}
+	}
+	if(fill && !blank)
+		return program_page(&t, page, fill);
+	return ST_OK;
+}
+
+/* crc32 of len bytes from addr, in blocks of block bytes, the last one
+ * may be shorter. data is the address head, see get_target(), then len
+ * and block, 3 bytes big endian each.
+ * answer is one crc per block, 4 bytes little endian */
+static void op_crc(uint8_t *data, uint8_t wide)
+{
+	uint32_t len, block, left, crc;
+	uint16_t part;
+	uint8_t chunk[CRC_CHUNK], i;
+	target t;
+	data += get_target(data, wide, 0x03, &t);
+	len = get24(data);
+	block = get24(data + 3);
+	CS_SEL(CS_ONE);
+	send_target(&t);
+	while(len){
+		left = block < len ? block : len;
+		len -= left;
+		crc = 0;
+		while(left){
+			part = left < CRC_CHUNK ? left : CRC_CHUNK;
+			spi_read(chunk, part);
+			crc = crc32(crc, chunk, part);
+			left -= part;
+		}
+		for(i = 0; i < 4; i++)
+			reply((crc >> (i * 8)) & 0xFF);
+	}
+	CS_HIGH;
+}
+
+/* select the chips of the mask in data for writes, see spi.h. reads and
+ * crcs go to the lowest one. lines not wired are ignored, a mask
+ * without any changes nothing.
+ * answer is the chips dropped since the last OP_CS, then those selected */
+static void op_cs(uint8_t *data)
+{
+	uint8_t mask = data[0] & CS_ALL;
+	reply(cs_failed);
+	cs_failed = 0;
+	if(mask)
+		cs_mask = mask;
+	reply(cs_mask);
+}
+
+/* check that Onum matches what op answers for data.
+ * return 1 if valid, 0 otherwise */
+static uint8_t op_valid(uint8_t op, uint8_t *data, uint16_t Inum, uint16_t Onum)
+{
+	uint32_t len, block;
+	switch(op){
+		case OP_PROG:
+		case OP_PROGZ:
+		case OP_PROG4:
+		case OP_PROGZ4:
+			return Onum == 1;
+		case OP_WAIT:
+			return Onum == 3;
+		case OP_BAUD:
+			return Onum == 4;
+		case OP_CS:
+			return Inum == 1 && Onum == 2;
+		case OP_WREN:
+			return Inum == 0 && Onum == 1;
+		case OP_CRC:
+		case OP_CRC4:
+			if(op == OP_CRC4){
+				if(Inum != 11)
+					return 0;
+				data += 2;
+			}
+			else if(Inum != 9)
+				return 0;
+			len = get24(data + 3);
+			block = get24(data + 6);
+			return block && Onum == (len + block - 1) / block * 4;
+	}
+	return 1;
+}
+
+/* pick the fastest of the proposed rates, 4 bytes little endian each.
+ * answer is the chosen rate, 0 if none is within tolerance.
+ * the switch happens after the answer is sent */
+static void op_baud(uint8_t *data, uint16_t n)
+{
+	uint32_t rate, best = 0;
+	uint16_t i, ubrr;
+	uint8_t u2x;
+	for(i = 0; i + 4 <= n; i += 4){
+		rate = data[i] | ((uint32_t)data[i+1] << 8) |
+		       ((uint32_t)data[i+2] << 16) | ((uint32_t)data[i+3] << 24);
+		if(rate > best && serial_calc(rate, &ubrr, &u2x)){
+			best = rate;
+			new_ubrr = ubrr;
+			new_u2x = u2x;
+		}
+	}
+	if(best)
+		baud = BAUD_PENDING;
+	for(i = 0; i < 4; i++)
+		reply((best >> (i * 8)) & 0xFF);
+}
+
+/* version 1 packet, SOH already received.
+ * return 0 on success, 1 on error */
+static uint8_t packet_v1(uint8_t *buffer)
+{
+	uint8_t header[HDR_SIZE - 1];
+	uint16_t n, Inum, Onum;
+	n = serial_read(header, HDR_SIZE - 1, 0);
+	if(n < HDR_SIZE - 1)
+		return 1;
+	Inum = header[0] + (header[1] << 8);
+	Onum = header[2] + (header[3] << 8);
+	if(Inum > DAT_SIZE)
+		return 1;
+	reply(ACK);
+
+	/* read data */
+	n = serial_read(buffer, Inum + 2, 0);
+	if(n < (Inum + 2) || buffer[0] != STX || buffer[Inum+1] != ETX)
+		return 1;
+	reply(ACK);
+	/* spi rw, directly send data to serial port, so size limit is 64k */
+	reply(STX);
+	spi2serial(buffer+1, Inum, Onum);
+	reply(ETX);
+	return 0;
+}
+
+/* version 2 frame, DC1 already received. The whole frame is sent at once
+ * and answered with ACK seq STX data ETX, or NAK seq on error.
+ * on version 3 the frame ends with a crc16 before ETX and the answer
+ * data is sent in crc checked blocks.
+ * return 0 on success, 1 on error */
+static uint8_t frame_v2(uint8_t *buffer)
+{
+	uint8_t header[HDR2_SIZE - 1];
+	uint16_t n, Inum, Onum, crc;
+	uint8_t seq, op, check = link_ver >= 3 ? CHECK_SIZE : 0;
+	n = serial_read(header, HDR2_SIZE - 1, 0);
+	if(n < HDR2_SIZE - 1){
+		reply(NAK);
+		reply(0);
+		return 1;
+	}
+	seq = header[0];
+	op = header[1];
+	Inum = header[2] + (header[3] << 8);
+	Onum = header[4] + (header[5] << 8);
+	if(Inum > DAT_SIZE || op >= OP_MAX){
+		reply(NAK);
+		reply(seq);
+		return 1;
+	}
+	n = serial_read(buffer, Inum + 2 + check, 0);
+	if(n < (Inum + 2 + check) || buffer[0] != STX || buffer[Inum+1+check] != ETX ||
+	   !op_valid(op, buffer+1, Inum, Onum)){
+		reply(NAK);
+		reply(seq);
+		return 1;
+	}
+	if(check){
+		crc = crc16(crc16(0xFFFF, header, HDR2_SIZE - 1), buffer+1, Inum);
+		if(buffer[Inum+1] != (crc & 0xFF) || buffer[Inum+2] != crc >> 8){
+			reply(NAK);
+			reply(seq);
+			return 1;
+		}
+	}
+	reply(ACK);
+	reply(seq);
+	reply(STX);
+	if(check)
+		serial_blocks(1);
+	switch(op){
+		case OP_SPI:
+			spi2serial(buffer+1, Inum, Onum);
+			break;
+		case OP_PROG:
+		case OP_PROG4:
+			reply(program(buffer+1, Inum, op == OP_PROG4));
+			break;
+		case OP_WAIT:
+			op_wait(buffer+1, Inum);
+			break;
+		case OP_BAUD:
+			op_baud(buffer+1, Inum);
+			break;
+		case OP_RDZ:
+			spi2rle(buffer+1, Inum, Onum);
+			break;
+		case OP_PROGZ:
+		case OP_PROGZ4:
+			reply(program_rle(buffer+1, Inum, op == OP_PROGZ4));
+			break;
+		case OP_CRC:
+		case OP_CRC4:
+			op_crc(buffer+1, op == OP_CRC4);
+			break;
+		case OP_CS:
+			op_cs(buffer+1);
+			break;
+		case OP_WREN:
+			reply(wren() ? ST_WREN : ST_OK);
+			break;
+	}
+	serial_blocks(0);
+	reply(ETX);
+	return 0;
+}
+
+/* version negotiation, SYN already received, followed by the highest
+ * version the host speaks and 3 reserved bytes, so that version 1
+ * firmware sees a bad header and answers NAK.
+ * reply: ACK version window rx_buf(2) ops
+ * return 0 on success, 1 on error */
+static uint8_t negotiate()
+{
+	uint8_t header[HDR_SIZE - 1];
+	uint8_t ver;
+	if(serial_read(header, HDR_SIZE - 1, 0) < HDR_SIZE - 1){
+		reply(NAK);
+		return 1;
+	}
+	ver = header[0] < PROTO_VER ? header[0] : PROTO_VER;
+	link_ver = ver;
+	reply(ACK);
+	reply(ver);
+	reply(WINDOW);
+	reply(RX_BUF & 0xFF);
+	reply(RX_BUF >> 8);
+	reply(OP_MAX);
+	return 0;
+}
+
 int main()
 {
 	serial_init();
 	spi_init();
-	uint8_t header[HDR_SIZE];
-	uint8_t buffer[DAT_SIZE + 2];
-	uint16_t n, Inum, Onum;
-	uint8_t ACK = 0x06, NAK = 0x15;
-	uint8_t SOH = 0x01, STX = 0x02, ETX = 0x03;
+	timer_init();
+	sei();
+	uint8_t c, flush = 1, error;
+	uint8_t buffer[DAT_SIZE + 2 + CHECK_SIZE];
 	for(;;){
-		rx_flush();
-		/* read header, no timeout */
-		n = serial_read(header, HDR_SIZE, 1);
-		if(n < HDR_SIZE || header[0] != SOH){
-			serial_write(&NAK, 1);
-			continue;
+		if(baud == BAUD_PENDING){
+			serial_baud(new_ubrr, new_u2x);
+			baud = BAUD_TRIAL;
+			flush = 1;
 		}
-		Inum = header[1] + (header[2] << 8);
-		Onum = header[3] + (header[4] << 8);
-		if(Inum > DAT_SIZE){
-			serial_write(&NAK, 1);
+		/* version 2 frames may already be queued behind the last one,
+		 * the ring is only dropped after errors and version 1 packets */
+		if(flush)
+			rx_flush();
+		/* the host has TRIAL_TIME to get a packet through at a new rate */
+		if(baud == BAUD_TRIAL && !serial_wait(TRIAL_TIME)){
+			serial_default();
+			baud = BAUD_IDLE;
 			continue;
 		}
-		serial_write(&ACK, 1);
-
-		/* read data */
-		n = serial_read(buffer, Inum + 2, 0);
-		if(n < (Inum + 2) || buffer[0] != STX || buffer[Inum+1] != ETX){
-			serial_write(&NAK, 1);
-			continue;
+		/* wait for start of packet, no timeout */
+		if(serial_read(&c, 1, 1) < 1){
+			reply(NAK);
+			error = flush = 1;
+		}
+		else switch(c){
+			case SOH:
+				error = packet_v1(buffer);
+				if(error)
+					reply(NAK);
+				flush = 1;
+				break;
+			case DC1:
+				error = flush = frame_v2(buffer);
+				break;
+			case SYN:
+				error = negotiate();
+				flush = 1;
+				break;
+			default:
+				reply(NAK);
+				error = flush = 1;
+		}
+		if(baud == BAUD_TRIAL){
+			if(error)
+				serial_default();
+			baud = BAUD_IDLE;
 		}
-		serial_write(&ACK, 1);
-		/* spi rw, directly send data to serial port, so size limit is 64k */
-		serial_write(&STX, 1);
-		spi2serial(buffer+1, Inum, Onum);
-		serial_write(&ETX, 1);
 	}
 	return 0;
 }
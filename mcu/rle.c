@@ -0,0 +1,82 @@
+/* Run length encoder writing to serial port, format in protocol.md.
+ * Bytes are buffered until they can be classified as literal or run. */
+#include "avr.h"
+#include "serial.h"
+#include "rle.h"
+
+#define LIT_MAX  128       /* literal bytes per code */
+#define REP_MAX  66        /* repeated byte per code */
+#define FILL_MAX 8192      /* 0xFF or 0x00 per code */
+
+static uint8_t lit[LIT_MAX], nlit, rbyte;
+static uint16_t rlen;
+
+static void put(uint8_t c)
+{
+	serial_write(&c, 1);
+}
+
+static void flush_lit()
+{
+	if(!nlit)
+		return;
+	put(nlit - 1);
+	serial_write(lit, nlit);
+	nlit = 0;
+}
+
+static void add_lit(uint8_t b)
+{
+	lit[nlit++] = b;
+	if(nlit == LIT_MAX)
+		flush_lit();
+}
+
+/* emit the pending run, runs too short to pay off become literals */
+static void flush_run()
+{
+	uint8_t fill = rbyte == 0xFF || rbyte == 0x00;
+	uint16_t i;
+	if(rlen >= 3 || (fill && rlen >= 2)){
+		flush_lit();
+		if(fill){
+			put((rbyte ? 0xC0 : 0xE0) | ((rlen - 1) >> 8));
+			put((rlen - 1) & 0xFF);
+		}
+		else{
+			put(0x80 | (rlen - 3));
+			put(rbyte);
+		}
+	}
+	else{
+		for(i = 0; i < rlen; i++)
+			add_lit(rbyte);
+	}
+	rlen = 0;
+}
+
+void rle_start()
+{
+	nlit = 0;
+	rlen = 0;
+}
+
+void rle_put(uint8_t b)
+{
+	if(rlen && b == rbyte){
+		rlen++;
+		if(rlen == ((b == 0xFF || b == 0x00) ? FILL_MAX : REP_MAX))
+			flush_run();
+		return;
+	}
+	flush_run();
+	rbyte = b;
+	rlen = 1;
+}
+
+/* flush everything buffered */
+void rle_end()
+{
+	flush_run();
+	flush_lit();
+}
@@ -0,0 +1,3 @@
+void rle_start();
+void rle_put(uint8_t b);
+void rle_end();
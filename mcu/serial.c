@@ -1,65 +1,213 @@
 #include "avr.h"
-#define READ_TIMEOUT 0xFFFFFUL
+#include <avr/interrupt.h>
+#include <util/crc16.h>
+#include "serial.h"
+#include "timer.h"
+#define READ_TIMEOUT 100   /* ms between bytes once a read has started */
+#define BAUD_TOL 20        /* max baud rate error in 1/1000 */
 
-/* init UART0 for transfer by polling */
+/* ring buffers filled and drained by the UART interrupts.
+ * head and tail run freely, sizes must be powers of 2 */
+static volatile uint8_t rx_ring[RX_RING], tx_ring[TX_RING];
+static volatile uint16_t rx_head, rx_tail;
+static volatile uint8_t tx_head, tx_tail;
+/* a byte was lost to a line error or a full ring */
+static volatile uint8_t rx_error;
+/* while blocks is set, data written is sent in blocks of SUB_BLOCK
+ * bytes, each followed by its crc16 */
+static uint8_t blocks, block_sent;
+static uint16_t block_len, block_crc;
+
+ISR(USART0_RX_vect)
+{
+	uint8_t error = UCSR0A & ( _BV(FE0) | _BV(DOR0) | _BV(UPE0) );
+	uint8_t c = UDR0;
+	if(error || (uint16_t)(rx_head - rx_tail) >= RX_RING){
+		rx_error = 1;
+		return;
+	}
+	rx_ring[rx_head & (RX_RING - 1)] = c;
+	rx_head++;
+}
+
+ISR(USART0_UDRE_vect)
+{
+	if(tx_head == tx_tail){
+		UCSR0B &= ~_BV(UDRIE0);
+		return;
+	}
+	UDR0 = tx_ring[tx_tail & (TX_RING - 1)];
+	tx_tail++;
+}
+
+/* bytes waiting in the receive ring */
+static uint16_t rx_count()
+{
+	uint16_t n;
+	uint8_t sreg = SREG;
+	cli();
+	n = rx_head - rx_tail;
+	SREG = sreg;
+	return n;
+}
+
+/* init UART0, transfer is interrupt driven once interrupts are enabled */
 void serial_init()
 {
 	/* baud rate */
 	//#include <util/setbaud.h>
 	//UBRR0H = UBRRH_VALUE;
 	//UBRR0L = UBRRL_VALUE;
-	/* 115200 */
-	UBRR0H = 0;
-	UBRR0L = 8;
+	serial_default();
 
 	/* 8N1 frame */
 	UCSR0C = _BV(UCSZ00) | _BV(UCSZ01);
 
 
-	/* enable tx */
-	UCSR0B |= _BV(TXEN0) | _BV(RXEN0);
+	/* enable tx and rx */
+	UCSR0B |= _BV(TXEN0) | _BV(RXEN0) | _BV(RXCIE0);
 
 }
 
+/* queue a byte for sending, blocks only while the ring is full */
+static void tx_put(uint8_t c)
+{
+	while((uint8_t)(tx_head - tx_tail) >= TX_RING)
+		;
+	tx_ring[tx_head & (TX_RING - 1)] = c;
+	tx_head++;
+	UCSR0B |= _BV(UDRIE0);
+}
+
+/* close the current block with its crc, little endian */
+static void block_end()
+{
+	tx_put(block_crc & 0xFF);
+	tx_put(block_crc >> 8);
+	block_crc = 0xFFFF;
+	block_len = 0;
+	block_sent = 1;
+}
+
+/* queue n bytes for sending, blocks only while the ring is full */
 void serial_write(uint8_t *c, uint16_t n)
 {
 	uint16_t i;
 	for(i = 0; i < n; i++) {
-		while( !(UCSR0A & _BV(UDRE0)) )
-			;
-		UDR0 = *(c + i);
+		tx_put(c[i]);
+		if(blocks){
+			block_crc = _crc_xmodem_update(block_crc, c[i]);
+			if(++block_len == SUB_BLOCK)
+				block_end();
+		}
 	}
 }
 
+/* start (on = 1) or stop sending in crc checked blocks. the last
+ * block is closed on stop, an empty answer is one empty block */
+void serial_blocks(uint8_t on)
+{
+	if(!on && blocks && (block_len || !block_sent))
+		block_end();
+	blocks = on;
+	block_crc = 0xFFFF;
+	block_len = 0;
+	block_sent = 0;
+}
+
 /* read n bytes from serial, return bytes actually read */
 uint16_t serial_read(uint8_t *c, uint16_t n, uint8_t no_timeout)
 {
-	uint16_t i;
-	uint32_t j;
-	uint8_t error;
+	uint16_t i, t0;
+	uint8_t sreg;
 	for(i = 0; i < n; i++) {
 		/* Wait for new data, if has received some, enable timeout */
-		for(j = 0;
-			!(UCSR0A & _BV(RXC0)) && ((no_timeout && !i) || j < READ_TIMEOUT) ;
-		    j++)
-			;
-
-		if((!no_timeout || i) && j == READ_TIMEOUT ){
-			break;
+		t0 = timer_ms();
+		while(!rx_count() && !rx_error){
+			if((!no_timeout || i) &&
+			   (uint16_t)(timer_ms() - t0) >= READ_TIMEOUT)
+				return i;
 		}
-		error = UCSR0A & ( _BV(FE0) | _BV(DOR0) | _BV(UPE0) );
-		if(error)
+		if(rx_error){
+			rx_error = 0;
 			break;
-		*(c + i) = UDR0;
+		}
+		*(c + i) = rx_ring[rx_tail & (RX_RING - 1)];
+		sreg = SREG;
+		cli();
+		rx_tail++;
+		SREG = sreg;
 	}
 	return i;
 }
 
-/* flush UART0 rx buffer */
+/* discard received bytes not read yet */
 void rx_flush()
 {
-	UCSR0B &= ~_BV(RXEN0) ;
-	UCSR0B |= _BV(RXEN0) ;
+	uint8_t sreg = SREG;
+	cli();
+	rx_tail = rx_head;
+	rx_error = 0;
+	SREG = sreg;
+}
+
+
+
+/* boot baud rate, 115200 */
+void serial_default()
+{
+	serial_baud(8, 0);
+}
+
+/* wait for the last byte to leave, then change baud rate.
+ * needs the timer running once tx is enabled */
+void serial_baud(uint16_t ubrr, uint8_t u2x)
+{
+	uint16_t t0;
+	if(UCSR0B & _BV(TXEN0)){
+		while(tx_head != tx_tail || !(UCSR0A & _BV(UDRE0)) )
+			;
+		/* one more byte may be in the shift register, 1-2ms is plenty */
+		t0 = timer_ms();
+		while((uint16_t)(timer_ms() - t0) < 2)
+			;
+	}
+	UBRR0H = ubrr >> 8;
+	UBRR0L = ubrr & 0xFF;
+	if(u2x)
+		UCSR0A |= _BV(U2X0);
+	else
+		UCSR0A &= ~_BV(U2X0);
 }
 
+/* find ubrr and u2x for baud within BAUD_TOL, double speed preferred.
+ * return 1 if found, 0 otherwise */
+uint8_t serial_calc(uint32_t baud, uint16_t *ubrr, uint8_t *u2x)
+{
+	uint8_t div;
+	uint32_t ub, actual, diff;
+	for(div = 8; div <= 16; div += 8){
+		ub = (F_CPU / div + baud / 2) / baud;
+		if(ub < 1 || ub > 4096)
+			continue;
+		actual = F_CPU / div / ub;
+		diff = actual > baud ? actual - baud : baud - actual;
+		if(diff * 1000 / baud <= BAUD_TOL){
+			*ubrr = ub - 1;
+			*u2x = div == 8;
+			return 1;
+		}
+	}
+	return 0;
+}
 
+/* wait up to timeout ms for incoming data
+ * return 1 if data is available, 0 otherwise */
+uint8_t serial_wait(uint16_t timeout)
+{
+	uint16_t t0 = timer_ms();
+	while(!rx_count())
+		if((uint16_t)(timer_ms() - t0) >= timeout)
+			return 0;
+	return 1;
+}
@@ -1,5 +1,14 @@
 
+#define RX_RING 1024       /* receive ring size, power of 2 */
+#define TX_RING 128        /* transmit ring size, power of 2 up to 128 */
+#define SUB_BLOCK 256      /* answer bytes per crc16 on version 3 links */
+
 void serial_init();
 void serial_write(uint8_t *c, uint16_t n);
+void serial_blocks(uint8_t on);
 uint16_t serial_read(uint8_t *c, uint16_t n, uint8_t no_timeout);
 void rx_flush();
+void serial_default();
+void serial_baud(uint16_t ubrr, uint8_t u2x);
+uint8_t serial_calc(uint32_t baud, uint16_t *ubrr, uint8_t *u2x);
+uint8_t serial_wait(uint16_t timeout);
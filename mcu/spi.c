@@ -1,33 +1,58 @@
 #include "avr.h"
 #include "spi.h"
+
+uint8_t cs_mask = 0x01;
+
 /* initialize SPI with CPOL=CPHA=0, MSB first, double speed */
 void spi_init()
 {
-	/* set output, PB0 as CS# */
+	/* set output, PB0 as CS#, further chips on PORT_CS */
+	PORT_CS |= CS_EXTRA;
+	DDR_CS |= CS_EXTRA;
 	DDR_SPI |= _BV(MOSI) | _BV(SCK) | _BV(SS);
 	SPSR = _BV(SPI2X);
 	SPCR = _BV(MSTR) | _BV(SPE);
 }
 
-/* write wn bytes, then read rn bytes back, half-duplex 
- * chcs = 0: do not change cs status*/
-void spi_rw(uint8_t *wbuf, uint16_t wn, 
-		uint8_t *rbuf, uint16_t rn, uint8_t chcs)
+/* write n bytes, whatever is shifted in is dropped */
+void spi_write(uint8_t *wbuf, uint16_t n)
 {
-	if(chcs)
-		CS_LOW;
+	while(n--){
+		SPDR = *wbuf++;
+		while( !(SPSR & _BV(SPIF)) )
+			;
+	}
+}
 
-	uint16_t i;
-	for(i = 0; i < wn + rn; i++){
-		if(i < wn)
-			SPDR = *(wbuf + i);
-		else
-			SPDR = 0;
+/* read n bytes, each transfer is started before the previous
+ * byte is stored */
+void spi_read(uint8_t *rbuf, uint16_t n)
+{
+	if(!n)
+		return;
+	SPDR = 0;
+	while(--n){
 		while( !(SPSR & _BV(SPIF)) )
 			;
-		if(i >= wn)
-			*(rbuf + i - wn) = SPDR;
+		*rbuf = SPDR;
+		SPDR = 0;
+		rbuf++;
 	}
-	if(chcs)
+	while( !(SPSR & _BV(SPIF)) )
+		;
+	*rbuf = SPDR;
+}
+
+/* write wn bytes, then read rn bytes back, half-duplex 
+ * cs is the mask of chips to select, 0: do not change cs status.
+ * only one chip may be selected if rn is not 0 */
+void spi_rw(uint8_t *wbuf, uint16_t wn, 
+		uint8_t *rbuf, uint16_t rn, uint8_t cs)
+{
+	if(cs)
+		CS_SEL(cs);
+	spi_write(wbuf, wn);
+	spi_read(rbuf, rn);
+	if(cs)
 		CS_HIGH;
 }
@@ -1,5 +1,7 @@
 void spi_init();
-void spi_rw(uint8_t *wbuf, uint16_t wn, uint8_t *rbuf, uint16_t rn, uint8_t chcs);
+void spi_write(uint8_t *wbuf, uint16_t n);
+void spi_read(uint8_t *rbuf, uint16_t n);
+void spi_rw(uint8_t *wbuf, uint16_t wn, uint8_t *rbuf, uint16_t rn, uint8_t cs);
 
 /* Modify definitions below to port to other avr mcus */
 #define DDR_SPI   DDRB
@@ -8,5 +10,24 @@ void spi_rw(uint8_t *wbuf, uint16_t wn, uint8_t *rbuf, uint16_t rn, uint8_t chcs
 #define SCK  PB1
 #define MOSI PB2
 
-#define CS_LOW PORT_SPI &= ~_BV(SS)
-#define CS_HIGH PORT_SPI |= _BV(SS)
+/* chip selects of further chips sharing SCK, MOSI and MISO.
+ * bit 0 of a chip mask is SS, bit n is PCn */
+#define DDR_CS    DDRC
+#define PORT_CS   PORTC
+#define CS_EXTRA  0xFE
+#define CS_ALL    (CS_EXTRA | 0x01)
+
+extern uint8_t cs_mask;    /* chips selected, writes go to all of them */
+
+#define CS_SEL(mask) do{ \
+		if((mask) & 0x01) \
+			PORT_SPI &= ~_BV(SS); \
+		PORT_CS &= ~((mask) & CS_EXTRA); \
+	}while(0)
+#define CS_LOW CS_SEL(cs_mask)
+#define CS_HIGH do{ \
+		PORT_SPI |= _BV(SS); \
+		PORT_CS |= CS_EXTRA; \
+	}while(0)
+/* lowest selected chip, the only one that may drive MISO */
+#define CS_ONE (cs_mask & -cs_mask)
@@ -0,0 +1,31 @@
+#include "avr.h"
+#include <avr/interrupt.h>
+#include "timer.h"
+
+static volatile uint16_t ms;
+
+/* init TIMER1 to interrupt every millisecond, interrupts must be enabled */
+void timer_init()
+{
+	/* CTC mode, clk/64 */
+	OCR1A = F_CPU / 64 / 1000 - 1;
+	TCCR1A = 0;
+	TCCR1B = _BV(WGM12) | _BV(CS11) | _BV(CS10);
+	TIMSK |= _BV(OCIE1A);
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+	ms++;
+}
+
+/* free running millisecond counter, wraps every 65 seconds */
+uint16_t timer_ms()
+{
+	uint16_t t;
+	uint8_t sreg = SREG;
+	cli();
+	t = ms;
+	SREG = sreg;
+	return t;
+}
@@ -0,0 +1,2 @@
+void timer_init();
+uint16_t timer_ms();
@@ -0,0 +1,77 @@
+#!/bin/sh
+# End to end throughput of spiflash against the programmer simulator.
+# Every phase runs on a fresh simulator, the flash content is carried
+# over in an image file. Run from pc/ after make spiflash flashsim.
+#
+#   bench.sh [-s size] [-S baud] [-- flashsim options]
+#
+# size is the amount of data written and read, the chip is the
+# simulator default unless -s is passed to flashsim.
+
+size=0x100000
+baud=2000000
+while [ $# -gt 0 ]; do
+	case $1 in
+		-s) size=$2; shift 2;;
+		-S) baud=$2; shift 2;;
+		--) shift; break;;
+		*) echo "Usage: $0 [-s size] [-S baud] [-- flashsim options]" >&2; exit 1;;
+	esac
+done
+bytes=$(($size))
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+head -c $bytes /dev/urandom > "$dir/random.bin"
+# a quarter of data, the rest blank, as most firmware images
+head -c $(($bytes / 4)) /dev/urandom > "$dir/sparse.bin"
+head -c $(($bytes - $bytes / 4)) /dev/zero | tr '\000' '\377' >> "$dir/sparse.bin"
+
+now_ms()
+{
+	echo $(($(date +%s%N) / 1000000))
+}
+
+# phase name and amount of data, spiflash options are in OPTS
+phase()
+{
+	name=$1
+	amount=$2
+	rm -f "$dir/pty"
+	./flashsim -i "$dir/flash.img" $SIM_ARGS > "$dir/pty" 2> "$dir/stats" &
+	sim=$!
+	while [ ! -s "$dir/pty" ]; do
+		sleep 0.05
+	done
+	t0=$(now_ms)
+	./spiflash -p "$(head -n 1 "$dir/pty")" -S $baud $OPTS > "$dir/log" 2>&1 || {
+		failed=1
+		echo "$name failed:" >&2
+		cat "$dir/log" >&2
+	}
+	ms=$(($(now_ms) - t0))
+	kill -TERM $sim
+	wait $sim
+	[ $ms -gt 0 ] || ms=1
+	awk -v name="$name" -v ms=$ms -v amount=$amount '
+		/^flashsim:/ {
+			cmds = $2 + $4
+			printf "%-12s %8.3f %10.1f %10.1f %8d %10.1f\n", name, ms / 1000,
+			       amount / 1024 / (ms / 1000), cmds / (ms / 1000), cmds,
+			       ($8 + $11) / 1024
+		}' "$dir/stats"
+}
+
+SIM_ARGS="$*"
+printf "%-12s %8s %10s %10s %8s %10s\n" phase "wall s" "KB/s" "cmds/s" cmds "link KB"
+OPTS="-e"; phase erase 0
+OPTS="-w -f $dir/random.bin"; phase write $bytes
+OPTS="-v -f $dir/random.bin"; phase verify $bytes
+OPTS="-w -d -f $dir/random.bin"; phase write-same $bytes
+OPTS="-r -s $size -f $dir/dump.bin"; phase read $bytes
+cmp -s "$dir/dump.bin" "$dir/random.bin" || { failed=1; echo "read back differs" >&2; }
+OPTS="-w -z -f $dir/sparse.bin"; phase write-zip $bytes
+OPTS="-r -z -s $size -f $dir/dump.bin"; phase read-zip $bytes
+cmp -s "$dir/dump.bin" "$dir/sparse.bin" || { failed=1; echo "read back differs" >&2; }
+exit $failed
@@ -0,0 +1,159 @@
+/* Sector cache. Dumps keep the sectors they read here, a later dump of
+ * the same chip reads only the sectors whose crc on the chip differs.
+ *
+ * <key>.idx is a line "spiflash cache 1 <sectors>" followed by the
+ * crc32 of each sector, 4 bytes little endian. it is replaced whole
+ * when the cache is closed, the .img file is written in place. */
+#include "system.h"
+#include "crc.h"
+#include "cache.h"
+
+#define MAGIC "spiflash cache 1"
+
+/* directory of the cache, dir if given, else $XDG_CACHE_HOME/spiflash
+ * or ~/.cache/spiflash
+ * return a new string, NULL without home or memory */
+char *cache_dir(char *dir)
+{
+	char *base = getenv("XDG_CACHE_HOME"), *path;
+	const char *sub = "/spiflash";
+	if(dir)
+		return strdup(dir);
+	if(base == NULL || !*base){
+		base = getenv("HOME");
+		sub = "/.cache/spiflash";
+	}
+	if(base == NULL || !*base)
+		return NULL;
+	path = malloc(strlen(base) + strlen(sub) + 1);
+	if(path)
+		sprintf(path, "%s%s", base, sub);
+	return path;
+}
+
+/* create dir and its parents
+ * return 0 on success, -1 on failure */
+static int make_dir(char *dir)
+{
+	char *p, c;
+	int result;
+	for(p = dir + (*dir == '/'); ; p++){
+		if(*p && *p != '/')
+			continue;
+		c = *p;
+		*p = 0;
+		result = mkdir(dir, 0755);
+		*p = c;
+		if(result < 0 && errno != EEXIST)
+			return -1;
+		if(!c)
+			return 0;
+	}
+}
+
+/* open the cache of the chip named key in dir, for size bytes.
+ * a missing or broken index leaves the cache empty.
+ * return 0 on success, -1 on failure */
+int cache_open(cache *c, char *dir, char *key, int size)
+{
+	unsigned char b[4];
+	char *img;
+	FILE *f;
+	int i, n;
+	memset(c, 0, sizeof(cache));
+	c->sectors = (size + CACHE_SECTOR - 1) / CACHE_SECTOR;
+	img = malloc(strlen(dir) + strlen(key) + sizeof("/.img"));
+	c->index = malloc(strlen(dir) + strlen(key) + sizeof("/.idx"));
+	c->crcs = calloc(c->sectors ? c->sectors : 1, sizeof(unsigned int));
+	if(img == NULL || c->index == NULL || c->crcs == NULL){
+		fprintf(stderr, "Memory allocation failed.\n");
+		goto Fail;
+	}
+	sprintf(img, "%s/%s.img", dir, key);
+	sprintf(c->index, "%s/%s.idx", dir, key);
+	if(make_dir(dir) < 0 || (c->fd = open(img, O_RDWR | O_CREAT, 0644)) < 0){
+		fprintf(stderr, "Cannot open cache %s, %s\n", img, strerror(errno));
+		goto Fail;
+	}
+	free(img);
+	if((f = fopen(c->index, "r")) != NULL){
+		if(fscanf(f, MAGIC " %d", &n) == 1 && fgetc(f) == '\n')
+			for(i = 0; i < n && i < c->sectors && fread(b, 4, 1, f) == 1; i++)
+				c->crcs[i] = b[0] | b[1] << 8 | b[2] << 16 | (unsigned int)b[3] << 24;
+		fclose(f);
+	}
+	return 0;
+Fail:
+	free(img);
+	free(c->index);
+	free(c->crcs);
+	memset(c, 0, sizeof(cache));
+	c->fd = -1;
+	return -1;
+}
+
+/* the sector at addr into buf, if the cache holds it with crc
+ * return 1 if found, 0 if not */
+int cache_get(cache *c, int addr, unsigned int crc, char *buf)
+{
+	int i = addr / CACHE_SECTOR;
+	if(i >= c->sectors || c->crcs[i] != crc ||
+	   pread(c->fd, buf, CACHE_SECTOR, addr) != CACHE_SECTOR ||
+	   crc32(0, buf, CACHE_SECTOR) != crc){
+		c->misses++;
+		return 0;
+	}
+	c->hits++;
+	return 1;
+}
+
+/* keep the sector at addr, a failed write only costs a read later */
+void cache_put(cache *c, int addr, char *data)
+{
+	int i = addr / CACHE_SECTOR;
+	if(i >= c->sectors)
+		return;
+	if(pwrite(c->fd, data, CACHE_SECTOR, addr) == CACHE_SECTOR)
+		c->crcs[i] = crc32(0, data, CACHE_SECTOR);
+	c->changed = 1;
+}
+
+/* save the index and close the cache
+ * return 0 on success, -1 if the index could not be saved */
+int cache_close(cache *c)
+{
+	unsigned char b[4];
+	char *tmp = NULL;
+	FILE *f = NULL;
+	int i, result = 0;
+	if(c->changed){
+		if((tmp = malloc(strlen(c->index) + sizeof(".tmp"))) != NULL){
+			sprintf(tmp, "%s.tmp", c->index);
+			f = fopen(tmp, "w");
+		}
+		if(f){
+			fprintf(f, MAGIC " %d\n", c->sectors);
+			for(i = 0; i < c->sectors; i++){
+				b[0] = c->crcs[i];
+				b[1] = c->crcs[i] >> 8;
+				b[2] = c->crcs[i] >> 16;
+				b[3] = c->crcs[i] >> 24;
+				fwrite(b, 4, 1, f);
+			}
+		}
+		if(f == NULL || ferror(f) | fclose(f) || rename(tmp, c->index)){
+			fprintf(stderr, "Cannot save cache index %s\n", c->index);
+			if(tmp)
+				unlink(tmp);
+			result = -1;
+		}
+		free(tmp);
+	}
+	if(c->fd >= 0)
+		close(c->fd);
+	free(c->index);
+	free(c->crcs);
+	memset(c, 0, sizeof(cache));
+	c->fd = -1;
+	return result;
+}
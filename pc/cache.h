@@ -0,0 +1,20 @@
+#define CACHE_SECTOR 0x1000 /* unit of the cache, the crc block */
+
+/* sectors of one chip kept between runs, in <key>.img at their chip
+ * offsets and their crc32 in <key>.idx. a sector is only taken from
+ * the cache if both crcs match its content */
+typedef struct {
+	int fd;            /* the .img file */
+	char *index;       /* path of the .idx file */
+	unsigned int *crcs; /* of the cached sectors */
+	int sectors;
+	int changed;       /* crcs differ from the .idx file */
+	long hits;
+	long misses;
+} cache;
+
+char *cache_dir(char *dir);
+int cache_open(cache *c, char *dir, char *key, int size);
+int cache_get(cache *c, int addr, unsigned int crc, char *buf);
+void cache_put(cache *c, int addr, char *data);
+int cache_close(cache *c);
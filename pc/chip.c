@@ -0,0 +1,238 @@
+/* Chip detection. Parameters are read from the JEDEC Basic Flash
+ * Parameter table (SFDP, JESD216) if the part has one, otherwise they
+ * come from a table of known IDs or the defaults below. */
+#include "system.h"
+#include "chip.h"
+#include "metrics.h"
+#include "command.h"
+
+#define SFDP_MAGIC 0x50444653 /* "SFDP" */
+#define PARAM_MAX 8        /* parameter headers looked at */
+#define BFPT_DWORDS 16     /* basic table dwords used, JESD216B */
+#define SIZE_3B 0x1000000  /* reach of 3 byte addresses */
+
+/* defaults, generous for 25 series parts */
+static const chip_info generic = {
+	.name = "unknown",
+	.page = 0x100,
+	.addr_bytes = 3,
+	.read = 0x03,
+	.opcode = {[T_PP] = 0x02, [T_SE] = 0x20, [T_BE32] = 0x52, [T_BE] = 0xD8, [T_CE] = 0x60},
+	.timings = {
+		[T_PP] = {1, 10},
+		[T_SE] = {60, 2000},
+		[T_BE32] = {500, 5000},
+		[T_BE] = {700, 5000},
+		[T_CE] = {14000, 60000},
+	},
+};
+
+/* known parts, timings from their datasheets */
+static const struct {
+	unsigned char id[3];
+	char *name;
+	int size;
+	timing timings[T_COUNT];
+} parts[] = {
+	{{0xC2, 0x20, 0x15}, "MX25L1606E", 0x200000,
+	 {{1, 3}, {40, 200}, {200, 1000}, {400, 2000}, {14000, 20000}}},
+	{{0xC2, 0x20, 0x16}, "MX25L3206E", 0x400000,
+	 {{1, 3}, {40, 200}, {200, 1000}, {400, 2000}, {25000, 50000}}},
+	{{0xC2, 0x20, 0x17}, "MX25L6406E", 0x800000,
+	 {{1, 3}, {40, 200}, {200, 1000}, {400, 2000}, {50000, 80000}}},
+	{{0xC2, 0x20, 0x18}, "MX25L12835F", 0x1000000,
+	 {{1, 3}, {40, 200}, {200, 1000}, {400, 2000}, {80000, 150000}}},
+	{{0xEF, 0x40, 0x15}, "W25Q16", 0x200000,
+	 {{1, 3}, {45, 400}, {120, 1600}, {150, 2000}, {5000, 25000}}},
+	{{0xEF, 0x40, 0x16}, "W25Q32", 0x400000,
+	 {{1, 3}, {45, 400}, {120, 1600}, {150, 2000}, {10000, 50000}}},
+	{{0xEF, 0x40, 0x17}, "W25Q64", 0x800000,
+	 {{1, 3}, {45, 400}, {120, 1600}, {150, 2000}, {20000, 100000}}},
+	{{0xEF, 0x40, 0x18}, "W25Q128", 0x1000000,
+	 {{1, 3}, {45, 400}, {120, 1600}, {150, 2000}, {40000, 200000}}},
+	{{0xC8, 0x40, 0x16}, "GD25Q32", 0x400000,
+	 {{1, 3}, {50, 400}, {160, 800}, {250, 1200}, {15000, 30000}}},
+	{{0xC8, 0x40, 0x17}, "GD25Q64", 0x800000,
+	 {{1, 3}, {50, 400}, {160, 800}, {250, 1200}, {30000, 60000}}},
+	{{0xC2, 0x20, 0x19}, "MX25L25645G", 0x2000000,
+	 {{1, 3}, {30, 400}, {150, 1000}, {280, 2000}, {80000, 150000}}},
+	{{0xC2, 0x20, 0x1A}, "MX66L51245G", 0x4000000,
+	 {{1, 3}, {30, 400}, {150, 1000}, {280, 2000}, {150000, 300000}}},
+	{{0xC2, 0x20, 0x1B}, "MX66L1G45G", 0x8000000,
+	 {{1, 3}, {30, 400}, {150, 1000}, {280, 2000}, {300000, 600000}}},
+	{{0xEF, 0x40, 0x19}, "W25Q256", 0x2000000,
+	 {{1, 3}, {45, 400}, {120, 1600}, {150, 2000}, {80000, 400000}}},
+	{{0xEF, 0x40, 0x20}, "W25Q512", 0x4000000,
+	 {{1, 3}, {45, 400}, {120, 1600}, {150, 2000}, {150000, 800000}}},
+	{{0xC8, 0x40, 0x19}, "GD25Q256", 0x2000000,
+	 {{1, 3}, {50, 400}, {160, 800}, {250, 1200}, {120000, 240000}}},
+};
+
+/* makers whose parts answer RDUID, and the bytes of their unique IDs */
+static const struct {
+	unsigned char maker;
+	int n;
+} unique_ids[] = {
+	{0xEF, 8},         /* Winbond */
+	{0xC8, 16},        /* GigaDevice */
+};
+
+/* 3 byte opcodes and their 4 byte address variants */
+static const unsigned char wide[][2] = {
+	{0x03, 0x13}, {0x02, 0x12}, {0x20, 0x21}, {0x52, 0x5C}, {0xD8, 0xDC},
+};
+
+void chip_default(chip_info *chip)
+{
+	*chip = generic;
+}
+
+/* dword n, counting from 1 as JESD216 does, of the table at p */
+static unsigned int dword(unsigned char *p, int n)
+{
+	p += (n - 1) * 4;
+	return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+}
+
+/* set the timing of op to typ us, max is typ times 2 * (mult + 1) */
+static void set_timing(chip_info *chip, int op, long typ, int mult)
+{
+	chip->timings[op].typ = (typ + 999) / 1000;
+	chip->timings[op].max = (typ * 2 * (mult + 1) + 999) / 1000;
+}
+
+/* read the basic flash parameter table into chip
+ * return 0 on success, -1 if the part has none */
+static int chip_sfdp(int fd, chip_info *chip)
+{
+	static const long erase_unit[] = {1000, 16000, 128000, 1000000};
+	static const long ce_unit[] = {16000, 256000, 4000000, 64000000};
+	unsigned char head[8 + 8 * PARAM_MAX], bfpt[BFPT_DWORDS * 4], *p = NULL;
+	unsigned int d;
+	int i, n, len, op, exp;
+	if(SFDP(fd, (char *)head, 0, 8) < 0 || dword(head, 1) != SFDP_MAGIC)
+		return -1;
+	n = head[6] + 1 < PARAM_MAX ? head[6] + 1 : PARAM_MAX;
+	if(SFDP(fd, (char *)head + 8, 8, n * 8) < 0)
+		return -1;
+	/* the basic table has ID 0xFF00 and major revision 1 */
+	for(i = 0; i < n && p == NULL; i++)
+		if(head[8 + i * 8] == 0x00 && head[8 + i * 8 + 7] == 0xFF &&
+		   head[8 + i * 8 + 2] == 1)
+			p = head + 8 + i * 8;
+	if(p == NULL || p[3] < 9)
+		return -1;
+	len = p[3] < BFPT_DWORDS ? p[3] : BFPT_DWORDS;
+	memset(bfpt, 0xFF, sizeof(bfpt));
+	if(SFDP(fd, (char *)bfpt, p[4] | p[5] << 8 | p[6] << 16, len * 4) < 0)
+		return -1;
+
+	d = dword(bfpt, 2);
+	exp = d & 0x7FFFFFFF;
+	if(!(d & 0x80000000))
+		chip->size = (d + 1) / 8;
+	else if(exp >= 3 && exp <= 33)
+		chip->size = 1 << (exp - 3);
+	d = dword(bfpt, 1);
+	chip->addr_bytes = ((d >> 17) & 3) == 2 || chip->size > SIZE_3B ? 4 : 3;
+	/* erase types 1 to 4 are mapped to the sizes the planner knows */
+	chip->opcode[T_SE] = (d & 3) == 1 ? (d >> 8) & 0xFF : 0;
+	chip->opcode[T_BE32] = chip->opcode[T_BE] = 0;
+	for(i = 0; i < 4; i++){
+		d = dword(bfpt, 8 + i / 2) >> (i % 2 * 16);
+		op = (d & 0xFF) == 12 ? T_SE : (d & 0xFF) == 15 ? T_BE32 :
+		     (d & 0xFF) == 16 ? T_BE : -1;
+		if(op < 0)
+			continue;
+		chip->opcode[op] = (d >> 8) & 0xFF;
+		/* times are in JESD216B tables only */
+		if(len >= 11){
+			d = dword(bfpt, 10);
+			set_timing(chip, op, (((d >> (4 + i * 7)) & 0x1F) + 1) *
+			           erase_unit[(d >> (9 + i * 7)) & 3], d & 0xF);
+		}
+	}
+	/* everything is done in 4K sectors, assume the usual opcode */
+	if(!chip->opcode[T_SE])
+		chip->opcode[T_SE] = 0x20;
+	if(len >= 11){
+		d = dword(bfpt, 11);
+		/* smaller pages are taken for garbage, the default stays */
+		if(1 << ((d >> 4) & 0xF) >= PAGE_MIN)
+			chip->page = 1 << ((d >> 4) & 0xF);
+		set_timing(chip, T_PP, (((d >> 8) & 0x1F) + 1) * ((d >> 13) & 1 ? 64 : 8), d & 0xF);
+		set_timing(chip, T_CE, (((d >> 24) & 0x1F) + 1) * ce_unit[(d >> 29) & 3], d & 0xF);
+	}
+	/* parts that list ways into 4 byte mode but no 4 byte opcodes */
+	if(len >= 16){
+		d = dword(bfpt, 16) >> 24;
+		chip->en4b = !(d & 0x20) && (d & 0x03);
+	}
+	return 0;
+}
+
+/* switch opcode to its 4 byte address variant, 0 if there is none */
+static unsigned char widen(unsigned char opcode)
+{
+	int i;
+	for(i = 0; i < (int)(sizeof(wide) / sizeof(wide[0])); i++)
+		if(wide[i][0] == opcode)
+			return wide[i][1];
+	return 0;
+}
+
+/* read the factory unique ID of the chip with the given id into uid,
+ * which holds UID_MAX bytes.
+ * return bytes read, 0 if the part has none or it cannot be read */
+int chip_unique_id(int fd, char *id, char *uid)
+{
+	int i, k;
+	for(i = 0; i < (int)(sizeof(unique_ids) / sizeof(unique_ids[0])); i++){
+		if((unsigned char)id[0] != unique_ids[i].maker)
+			continue;
+		if(RDUID(fd, uid, unique_ids[i].n) < 0)
+			return 0;
+		/* parts without it leave the line high or low */
+		for(k = 1; k < unique_ids[i].n && uid[k] == uid[0]; k++)
+			;
+		return k < unique_ids[i].n || (uid[0] && uid[0] != (char)0xFF) ? unique_ids[i].n : 0;
+	}
+	return 0;
+}
+
+/* find the parameters of the chip on fd with the given id, first from
+ * SFDP, then from the ID table. has_id is 0 if the ID is not known.
+ * return CHIP_* source of the parameters */
+int chip_probe(int fd, char *id, int has_id, chip_info *chip)
+{
+	int i;
+	chip_default(chip);
+	for(i = 0; has_id && i < (int)(sizeof(parts) / sizeof(parts[0])); i++)
+		if(!memcmp(parts[i].id, id, 3)){
+			snprintf(chip->name, sizeof(chip->name), "%s", parts[i].name);
+			chip->size = parts[i].size;
+			memcpy(chip->timings, parts[i].timings, sizeof(chip->timings));
+			chip->source = CHIP_TABLE;
+			break;
+		}
+	/* most 25 series parts report log2 of the size in the last byte */
+	if(has_id && !chip->size && id[2] >= 0x10 && id[2] <= 0x1B)
+		chip->size = 1 << id[2];
+	if(chip_sfdp(fd, chip) == 0){
+		if(chip->source != CHIP_TABLE)
+			strcpy(chip->name, "SFDP part");
+		chip->source = CHIP_SFDP;
+	}
+	if(chip->size > SIZE_3B)
+		chip->addr_bytes = 4;
+	/* in EN4B mode the usual opcodes take 4 byte addresses */
+	if(chip->addr_bytes == 4 && !chip->en4b){
+		chip->read = widen(chip->read);
+		for(i = 0; i < T_COUNT; i++)
+			if(i != T_CE)
+				chip->opcode[i] = widen(chip->opcode[i]);
+		if(!chip->opcode[T_SE])
+			chip->opcode[T_SE] = 0x21;
+	}
+	return chip->source;
+}
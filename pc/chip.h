@@ -0,0 +1,35 @@
+/* typical and maximum duration of a flash operation in ms */
+typedef struct {
+	int typ;
+	int max;
+} timing;
+
+enum {T_PP, T_SE, T_BE32, T_BE, T_CE, T_COUNT};
+
+#define CHIP_SIZE_MAX 0x40000000 /* largest part, ends of ranges fit an int */
+#define PAGE_MIN 0x40      /* smallest program page taken from SFDP */
+
+/* where the chip parameters come from */
+#define CHIP_GUESS 0       /* defaults, size from the ID */
+#define CHIP_TABLE 1       /* built in ID table */
+#define CHIP_SFDP  2       /* read from the chip */
+
+/* chip parameters. the tool works in 4K sectors, larger erase types
+ * are used where they fit */
+typedef struct {
+	char name[24];
+	int size;          /* bytes, 0 if unknown */
+	int page;          /* program page */
+	int addr_bytes;    /* 3, or 4 for parts over 16MB */
+	int en4b;          /* 4 byte mode is entered with EN4B, no 4 byte opcodes */
+	unsigned char read; /* read opcode */
+	unsigned char opcode[T_COUNT]; /* 0 if the operation is missing */
+	timing timings[T_COUNT];
+	int source;
+} chip_info;
+
+#define UID_MAX 16         /* longest unique ID */
+
+void chip_default(chip_info *chip);
+int chip_probe(int fd, char *id, int has_id, chip_info *chip);
+int chip_unique_id(int fd, char *id, char *uid);
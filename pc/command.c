@@ -1,11 +1,31 @@
-/* Basic command implementation. 24-bit address only */
+/* Basic command implementation. 24 or 32 bit addresses, as the chip needs */
 #include "system.h"
 #include "serial_pc.h"
+#include "chip.h"
+#include "metrics.h"
+#include "command.h"
+#include "rle.h"
 #define CMD_RETRY 100
-#define CE_TIMEOUT 10
-#define BE_TIMEOUT 5
-#define PP_TIMEOUT 2
-#define SE_TIMEOUT 2
+#define WAIT_SLICE 5000    /* ms, longest single OP_WAIT, below ACK_TIMEOUT */
+#define POLL_MIN 1         /* ms between host side status polls */
+
+#define PROTO_VER 3
+#define WINDOW_MAX 8       /* frames kept in flight at most */
+#define FRAME_DATA 512     /* max Inum accepted by the programmer */
+#define FRAME_HEAD 9       /* DC1, seq, op, Inum, Onum, STX, ETX */
+#define FRAME_CHECK 2      /* crc16 of a version 3 frame */
+#define CHUNK_MIN 0x400    /* read per frame on a bad link, power of 2 */
+#define CHUNK_MAX 0x8000   /* read per frame on a clean link */
+#define CLEAN_GROW 8       /* clean chunks read before the chunk doubles */
+#define LINK_MAX 64
+#define QUIET_MS 100       /* silence that ends answers still on the way,
+                              not below the programmer's read timeout */
+#define ANSWER_HEAD 4      /* ACK, seq, STX, ETX */
+#define NEGOTIATE_TRIES 3  /* attempts when refused or garbled */
+#define NEGOTIATE_DELAY 200000 /* us, above the programmer's read timeout */
+#define BAUD_RATES 16
+#define BAUD_BOOT 115200   /* rate the programmer starts and falls back to */
+#define TRIAL_TIME 1000    /* ms the programmer waits at a new rate */
 
 typedef struct {
 	int Inum;
@@ -13,6 +33,44 @@ typedef struct {
 	char *cmd;
 } command;
 
+/* a version 2 frame waiting for its answer */
+typedef struct {
+	int seq;
+	int op;
+	int Inum;
+	int Onum;
+	char data[FRAME_DATA];
+	char *Odata;
+	char *bad;         /* marks of blocks that failed their crc, or NULL */
+	int kind;          /* K_* of the metrics */
+	long long sent;    /* us, first time sent */
+} frame;
+
+/* protocol state of one port. frames in flight are kept in a ring
+ * so that they can be sent again after an error */
+typedef struct {
+	int ver;
+	int window;
+	int rx_buf;
+	int ops;
+	int rle;
+	int seq;
+	int head;
+	int n;
+	int bytes;
+	int baud;          /* rate of the link */
+	int error;
+	int chunk;         /* bytes read per frame, adapted to errors */
+	long clean;        /* bytes read since the last error or change */
+	chip_info chip;
+	metrics m;
+	frame queue[WINDOW_MAX];
+} link_state;
+
+static link_state *links[LINK_MAX];
+
+static int command_rw(int fd, command *cmd, char *Odata);
+
 void print_array(FILE *stream, char *data, int n)
 {
 	int i;
@@ -25,6 +83,390 @@ void print_array(FILE *stream, char *data, int n)
 
 
 
+/* get protocol state of fd, version 1 until cmd_init() is called
+ * return NULL if fd is out of range or on allocation failure */
+static link_state *link_get(int fd)
+{
+	if(fd < 0 || fd >= LINK_MAX)
+		return NULL;
+	if(links[fd] == NULL){
+		links[fd] = calloc(1, sizeof(link_state));
+		if(links[fd] == NULL)
+			return NULL;
+		links[fd]->ver = 1;
+		links[fd]->window = 1;
+		links[fd]->chunk = CHUNK_MAX;
+		links[fd]->baud = BAUD_BOOT;
+		chip_default(&links[fd]->chip);
+	}
+	return links[fd];
+}
+
+/* return parameters of the chip on fd, the defaults until changed */
+chip_info *cmd_chip(int fd)
+{
+	static chip_info generic;
+	link_state *l = link_get(fd);
+	if(l)
+		return &l->chip;
+	chip_default(&generic);
+	return &generic;
+}
+
+/* negotiate protocol version with the programmer
+ * return the version in use */
+int cmd_init(int fd)
+{
+	link_state *l = link_get(fd);
+	int i;
+	if(l == NULL)
+		return 1;
+	/* version 1 firmware refuses every time, a noisy line only once */
+	for(i = 0; i < NEGOTIATE_TRIES; i++){
+		l->ver = negotiate(fd, PROTO_VER, &l->window, &l->rx_buf, &l->ops);
+		if(l->ver > 0)
+			break;
+		/* let the programmer time out on whatever it got */
+		usleep(NEGOTIATE_DELAY);
+		serial_flush(fd, TCIFLUSH);
+	}
+	if(l->ver < 1)
+		l->ver = 1;
+	if(l->window > WINDOW_MAX)
+		l->window = WINDOW_MAX;
+	if(l->window < 1)
+		l->window = 1;
+	return l->ver;
+}
+
+/* return protocol version in use on fd */
+int cmd_version(int fd)
+{
+	link_state *l = link_get(fd);
+	return l ? l->ver : 1;
+}
+
+/* the operation that does op for the chip on fd. chips with 4 byte
+ * addresses need the variants that carry opcode and 32 bit address */
+static int chip_op(int fd, int op)
+{
+	if(cmd_chip(fd)->addr_bytes < 4)
+		return op;
+	switch(op){
+		case OP_PROG:
+			return OP_PROG4;
+		case OP_PROGZ:
+			return OP_PROGZ4;
+		case OP_CRC:
+			return OP_CRC4;
+	}
+	return op;
+}
+
+/* write the address head of a PROG, PROGZ or CRC frame for the chip
+ * on fd to data, opcode is only sent for 4 byte addresses.
+ * return length of the head */
+static int frame_addr(int fd, char *data, int opcode, int addr)
+{
+	if(cmd_chip(fd)->addr_bytes < 4){
+		data[0] = (addr >> 16) & 0xFF;
+		data[1] = (addr >> 8) & 0xFF;
+		data[2] = addr & 0xFF;
+		return 3;
+	}
+	data[0] = opcode;
+	append_addr(data, addr, 4);
+	return 5;
+}
+
+/* write opcode and address in the width of the chip on fd to cmd
+ * return length of the command */
+static int addr_cmd(int fd, char *cmd, int opcode, int addr)
+{
+	int n = cmd_chip(fd)->addr_bytes;
+	cmd[0] = opcode;
+	append_addr(cmd, addr, n);
+	return 1 + n;
+}
+
+/* kind of command op with payload data on fd, for the metrics */
+static int cmd_kind(int fd, int op, char *data, int n)
+{
+	static const int kinds[] = {
+		[OP_SPI] = K_SPI, [OP_PROG] = K_PROG, [OP_WAIT] = K_WAIT,
+		[OP_BAUD] = K_BAUD, [OP_RDZ] = K_RDZ, [OP_PROGZ] = K_PROGZ,
+		[OP_CRC] = K_CRC, [OP_PROG4] = K_PROG, [OP_PROGZ4] = K_PROGZ,
+		[OP_CRC4] = K_CRC, [OP_CS] = K_SPI, [OP_WREN] = K_WREN,
+	};
+	chip_info *chip = cmd_chip(fd);
+	unsigned char c = n > 0 ? data[0] : 0;
+	int i;
+	if(op != OP_SPI)
+		return op >= 0 && op <= OP_WREN ? kinds[op] : K_SPI;
+	if(n <= 0)
+		return K_SPI;
+	if(c == chip->read)
+		return K_READ;
+	for(i = 0; i < T_COUNT; i++)
+		if(chip->opcode[i] && c == chip->opcode[i])
+			return K_PP + i;
+	switch(c){
+		case 0x05:
+			return K_RDSR;
+		case 0x06:
+			return K_WREN;
+		case 0x04:
+			return K_WRDI;
+		case 0x9F:
+			return K_RDID;
+		case 0x5A:
+			return K_SFDP;
+		case 0xB7:
+		case 0xE9:
+			return K_EN4B;
+	}
+	return K_SPI;
+}
+
+/* count n commands that failed and were tried again */
+static void count_retries(int fd, int n)
+{
+	link_state *l = link_get(fd);
+	if(l && n > 0)
+		l->m.retries += n;
+}
+
+/* return the counters of fd, with the traffic on the port up to now */
+metrics *cmd_metrics(int fd)
+{
+	link_state *l = link_get(fd);
+	if(l == NULL)
+		return NULL;
+	serial_traffic(fd, &l->m.sent, &l->m.received);
+	l->m.chunk = l->chunk;
+	return &l->m;
+}
+
+/* return 1 if the programmer on fd supports operation op on its chip */
+int cmd_has_op(int fd, int op)
+{
+	link_state *l = link_get(fd);
+	if(l == NULL || l->ver < 2)
+		return op == OP_SPI;
+	return chip_op(fd, op) < l->ops;
+}
+
+/* turn run length encoded reads on or off, if the programmer supports it.
+ * return 1 if reads are encoded from now on */
+int cmd_compress(int fd, int on)
+{
+	link_state *l = link_get(fd);
+	if(l == NULL)
+		return 0;
+	l->rle = on && cmd_has_op(fd, OP_RDZ);
+	return l->rle;
+}
+
+/* negotiate the fastest rate up to max both sides can hold.
+ * the new rate is confirmed by a negotiation at that rate, on failure
+ * both sides go back to BAUD_BOOT.
+ * return rate in use */
+int cmd_speed(int fd, int max)
+{
+	link_state *l = link_get(fd);
+	int rates[BAUD_RATES], n, rate;
+	n = serial_rates(max, rates, BAUD_RATES);
+	if(l == NULL || cmd_version(fd) < 2 || n == 0)
+		return BAUD_BOOT;
+	rate = BAUDSET(fd, rates, n);
+	if(rate <= 0 || rate == BAUD_BOOT || !serial_speed(rate))
+		return BAUD_BOOT;
+	serial_set(fd, serial_speed(rate));
+	serial_flush(fd, TCIOFLUSH);
+	l->baud = rate;
+	if(cmd_init(fd) >= 2)
+		return rate;
+	fprintf(stderr, "Link test at %d baud failed, falling back.\n", rate);
+	l->baud = BAUD_BOOT;
+	serial_set(fd, serial_speed(BAUD_BOOT));
+	/* let the programmer give up on the new rate */
+	usleep(TRIAL_TIME * 2000);
+	serial_flush(fd, TCIOFLUSH);
+	cmd_init(fd);
+	return BAUD_BOOT;
+}
+
+/* wait for outstanding frames and free protocol state of fd */
+void cmd_close(int fd)
+{
+	if(fd < 0 || fd >= LINK_MAX || links[fd] == NULL)
+		return;
+	cmd_sync(fd);
+	free(links[fd]);
+	links[fd] = NULL;
+}
+
+/* bytes frame f takes in the receive buffer of the programmer */
+static int frame_size(link_state *l, int Inum)
+{
+	return FRAME_HEAD + Inum + (l->ver >= 3 ? FRAME_CHECK : 0);
+}
+
+/* halve the read chunk after an error */
+static void chunk_shrink(link_state *l)
+{
+	if(l->chunk > CHUNK_MIN)
+		l->chunk /= 2;
+	l->clean = 0;
+}
+
+/* double the read chunk once enough has been read without error */
+static void chunk_grow(link_state *l, int n)
+{
+	l->clean += n;
+	if(l->chunk < CHUNK_MAX && l->clean >= (long)l->chunk * CLEAN_GROW){
+		l->chunk *= 2;
+		l->clean = 0;
+	}
+}
+
+/* us until the frames in flight and their answers have crossed the
+ * link at 10 bits a byte, and waits among them have run out. answers
+ * are taken as Onum with a crc per block and worst case run lengths */
+static long long link_flight(link_state *l)
+{
+	long long bytes = 0, us = 0;
+	frame *f;
+	int i;
+	for(i = 0; i < l->n; i++){
+		f = &l->queue[(l->head + i) % WINDOW_MAX];
+		bytes += frame_size(l, f->Inum) + ANSWER_HEAD + f->Onum + f->Onum / 64;
+		if(f->op == OP_WAIT && f->Inum == 2)
+			us += ((unsigned char)f->data[0] | (unsigned char)f->data[1] << 8) * 1000LL;
+	}
+	return us + bytes * 10 * 1000000 / l->baud;
+}
+
+/* drop whatever is left on the line and send all frames in flight again */
+static void link_resend(int fd, link_state *l)
+{
+	int i;
+	frame *f;
+	/* let the programmer finish the answers it still has queued, the
+	 * quiet time after them lets it time out on a broken frame */
+	l->m.resends++;
+	usleep(link_flight(l));
+	serial_drain(fd, QUIET_MS);
+	for(i = 0; i < l->n; i++){
+		f = &l->queue[(l->head + i) % WINDOW_MAX];
+		send_frame(fd, f->seq, f->op, f->data, f->Inum, f->Onum, l->ver >= 3);
+	}
+}
+
+/* wait for the answer to the oldest frame in flight.
+ * on error the whole window is sent again, up to CMD_RETRY times.
+ * blocks of a frame with marks that fail their crc are only marked,
+ * the caller fetches them again.
+ * return 0 on success, -1 on failure */
+static int link_complete(int fd, link_state *l)
+{
+	frame *f = &l->queue[l->head];
+	int i, bad = -1;
+	for(i = 0; i < CMD_RETRY; i++){
+		if(f->bad)
+			memset(f->bad, 0, f->Onum ? (f->Onum + SUB_BLOCK - 1) / SUB_BLOCK : 1);
+		bad = read_frame(fd, f->seq, f->Odata, f->Onum, f->op == OP_RDZ,
+		                 l->ver >= 3, f->bad);
+		if(bad >= 0)
+			break;
+		chunk_shrink(l);
+		link_resend(fd, l);
+	}
+	l->head = (l->head + 1) % WINDOW_MAX;
+	l->n--;
+	l->bytes -= frame_size(l, f->Inum);
+	if(bad > 0){
+		l->m.bad_blocks += bad;
+		chunk_shrink(l);
+	}
+	else if(i == 0)
+		chunk_grow(l, f->Onum);
+	if(i == CMD_RETRY){
+		fprintf(stderr, "frame %d lost:", f->seq);
+		print_array(stderr, f->data, f->Inum);
+		fprintf(stderr, "\n");
+		return -1;
+	}
+	metrics_latency(&l->m, f->kind, now_us() - f->sent);
+	return 0;
+}
+
+/* cmd_submit(), blocks of the answer that fail their crc are marked
+ * in bad instead of failing the frame if it is not NULL */
+static int link_submit(int fd, int op, char *Idata, int Inum, char *Odata, int Onum,
+                       char *bad)
+{
+	link_state *l = link_get(fd);
+	frame *f;
+	if(l == NULL || l->ver < 2){
+		command cmd = {Inum, Onum, Idata};
+		if(op != OP_SPI)
+			return -1;
+		if(command_rw(fd, &cmd, Odata) < 0){
+			if(l == NULL)
+				return -1;
+			l->error = -1;
+		}
+		return 0;
+	}
+	if(Inum > FRAME_DATA)
+		return -1;
+	while(l->n && (l->n >= l->window || 
+	               l->bytes + frame_size(l, Inum) > l->rx_buf))
+		l->error |= link_complete(fd, l);
+	f = &l->queue[(l->head + l->n) % WINDOW_MAX];
+	f->seq = l->seq;
+	f->op = op;
+	f->Inum = Inum;
+	f->Onum = Onum;
+	f->Odata = Odata;
+	f->bad = bad;
+	f->kind = cmd_kind(fd, op, Idata, Inum);
+	f->sent = now_us();
+	memcpy(f->data, Idata, Inum);
+	l->m.payload += Inum + Onum;
+	l->seq = (l->seq + 1) & 0xFF;
+	l->n++;
+	l->bytes += frame_size(l, Inum);
+	/* a short write shows up as a missing answer and is retried there */
+	send_frame(fd, f->seq, f->op, f->data, f->Inum, f->Onum, l->ver >= 3);
+	return 0;
+}
+
+/* queue a command for the programmer, blocks while the window is full.
+ * Odata must stay valid until cmd_sync(). on version 1 links the
+ * command is executed at once.
+ * return 0 on success, -1 on invalid command */
+int cmd_submit(int fd, int op, char *Idata, int Inum, char *Odata, int Onum)
+{
+	return link_submit(fd, op, Idata, Inum, Odata, Onum, NULL);
+}
+
+/* wait until all queued commands are answered
+ * return 0 if all of them succeeded since last call, -1 otherwise */
+int cmd_sync(int fd)
+{
+	link_state *l = link_get(fd);
+	int result;
+	if(l == NULL)
+		return 0;
+	while(l->n)
+		l->error |= link_complete(fd, l);
+	result = l->error;
+	l->error = 0;
+	return result;
+}
+
 /* echo error message with given command */
 static void cmd_err(command *cmd, char *msg){
 	fprintf(stderr, msg);
@@ -37,6 +479,14 @@ static void cmd_err(command *cmd, char *msg){
  * high level function, echo error info on failure */
 static int command_rw(int fd, command *cmd, char *Odata)
 {
+	link_state *l = link_get(fd);
+	long long start = now_us();
+	if(l && l->ver >= 2){
+		cmd_submit(fd, OP_SPI, cmd->cmd, cmd->Inum, Odata, cmd->Onum);
+		return cmd_sync(fd);
+	}
+	if(l)
+		l->m.payload += cmd->Inum + cmd->Onum;
 	if(send_header(fd, cmd->Inum, cmd->Onum) < 0){
 		cmd_err(cmd, "send_header fail:");
 		return -1;
@@ -58,6 +508,9 @@ static int command_rw(int fd, command *cmd, char *Odata)
 		cmd_err(cmd, "read_data fail:");
 		return -1;
 	}
+	if(l)
+		metrics_latency(&l->m, cmd_kind(fd, OP_SPI, cmd->cmd, cmd->Inum),
+		                now_us() - start);
 	return 0;
 }
 
@@ -69,6 +522,7 @@ int RDID(int fd, char *buf)
 	int i, result = 1;
 	for(i = 0; result && i < CMD_RETRY; i++)
 		result = command_rw(fd, &cmd, buf); 
+	count_retries(fd, i - 1);
 	return result;
 }
 
@@ -81,21 +535,34 @@ int RDSR(int fd, char *status)
 	int i, result = -1;
 	for(i = 0; result && i < CMD_RETRY; i++)
 		result = command_rw(fd, &cmd_rdsr, status);
+	count_retries(fd, i - 1);
 	return result;
 }
 
-/* enable write, will check status register to make sure succeeded
+/* enable write, will check status register to make sure succeeded.
+ * programmers with OP_WREN check each selected chip and drop those
+ * that fail, see CS().
  * 0 on success, -1 on failure */
 int WREN(int fd)
 {
 	int i ;
-	char wren[1] = {0x06};
+	char wren[1] = {0x06}, rdsr[1] = {0x05};
 	char status = 0;
-	command cmd_wren = {1, 0, wren};
+	if(cmd_has_op(fd, OP_WREN)){
+		status = PR_WREN;
+		for(i = 0; i < CMD_RETRY && status != PR_OK; i++)
+			if(cmd_submit(fd, OP_WREN, wren, 0, &status, 1) < 0 || cmd_sync(fd) < 0)
+				status = PR_WREN;
+		count_retries(fd, i - 1);
+		return status == PR_OK ? 0 : -1;
+	}
+	/* version 2 links send both commands back to back */
 	for(i = 0; i < CMD_RETRY && !(status & 0x02); i++){
-		command_rw(fd, &cmd_wren, NULL);
-		RDSR(fd, &status);
+		cmd_submit(fd, OP_SPI, wren, 1, NULL, 0);
+		cmd_submit(fd, OP_SPI, rdsr, 1, &status, 1);
+		cmd_sync(fd);
 	}
+	count_retries(fd, i - 1);
 	if(i == CMD_RETRY)
 		return -1;
 	return 0;
@@ -106,84 +573,158 @@ int WREN(int fd)
 int WRDI(int fd)
 {
 	int i;
-	char wrdi[1] = {0x04};
+	char wrdi[1] = {0x04}, rdsr[1] = {0x05};
 	char status = 0x02;
-	command cmd_wrdi = {1, 0, wrdi};
 	for(i = 0; i < CMD_RETRY && (status & 0x02); i++){
-		command_rw(fd, &cmd_wrdi, NULL);
-		RDSR(fd, &status);
+		cmd_submit(fd, OP_SPI, wrdi, 1, NULL, 0);
+		cmd_submit(fd, OP_SPI, rdsr, 1, &status, 1);
+		cmd_sync(fd);
 	}
+	count_retries(fd, i - 1);
 	if(i == CMD_RETRY)
 		return -1;
 	return 0;
 }
 
-/* read size bytes into buf, starting at addr
- * effective addr is 24 bits, higher bits will be discarded
+/* read size bytes into buf, starting at addr. size <= 0xFFFF.
+ * version 2 links read in chunks sized to the error rate of the
+ * link, on version 3 only blocks that fail their crc are read again.
  * return 0 on success, -1 on failure */
 int RD(int fd, char *buf, int addr, int size)
 {
-	int i, result = -1;
+	int i, n, k, result = -1;
 	/* address in big endian */
-	char rd[4];
-	rd[0] = 0x03;
-	append_addr(rd, addr);
-	command cmd_rd = {4, size, rd};
+	char rd[5], bad[0x10000 / SUB_BLOCK];
+	link_state *l = link_get(fd);
+	if(l && l->ver >= 2){
+		memset(bad, 0, sizeof(bad));
+		for(i = 0; i < size; i += n){
+			n = size - i < l->chunk ? size - i : l->chunk;
+			k = addr_cmd(fd, rd, cmd_chip(fd)->read, addr + i);
+			link_submit(fd, l->rle ? OP_RDZ : OP_SPI, rd, k, buf + i, n,
+			            l->rle ? NULL : bad + i / SUB_BLOCK);
+		}
+		if(cmd_sync(fd) < 0)
+			return -1;
+		for(i = 0; i < size; i += SUB_BLOCK){
+			if(!bad[i / SUB_BLOCK])
+				continue;
+			n = size - i < SUB_BLOCK ? size - i : SUB_BLOCK;
+			k = addr_cmd(fd, rd, cmd_chip(fd)->read, addr + i);
+			link_submit(fd, OP_SPI, rd, k, buf + i, n, NULL);
+		}
+		return cmd_sync(fd);
+	}
+	n = addr_cmd(fd, rd, cmd_chip(fd)->read, addr);
+	command cmd_rd = {n, size, rd};
 	for(i = 0; result && i < CMD_RETRY; i++)
 		result = command_rw(fd, &cmd_rd, buf);
+	count_retries(fd, i - 1);
 	return result;
 }
 
+static void sleep_ms(long ms)
+{
+	struct timespec t = {ms / 1000, (ms % 1000) * 1000000L};
+	nanosleep(&t, NULL);
+}
+
+/* let the programmer poll status register until write in progress
+ * clears or timeout ms have passed. timeout <= WAIT_SLICE.
+ * elapsed receives the time the chip was busy if not NULL.
+ * requires protocol version 2.
+ * return 0 when ready, 1 on timeout, -1 on failure */
+int WAIT(int fd, int timeout, int *elapsed)
+{
+	char wait[2], ans[3];
+	if(cmd_version(fd) < 2 || timeout > 0xFFFF)
+		return -1;
+	wait[0] = timeout & 0xFF;
+	wait[1] = (timeout >> 8) & 0xFF;
+	if(cmd_submit(fd, OP_WAIT, wait, 2, ans, 3) < 0 || cmd_sync(fd) < 0)
+		return -1;
+	if(elapsed)
+		*elapsed = (unsigned char)ans[1] + ((unsigned char)ans[2] << 8);
+	if(ans[0] == PR_OK)
+		return 0;
+	return ans[0] == PR_TIMEOUT ? 1 : -1;
+}
+
+/* wait until write in progress clears, at most the max time of type.
+ * version 2 links poll on the programmer, version 1 links sleep
+ * for the typical time first and then poll from here.
+ * return 0 on success, -1 on timeout or failure */
+static int busy_wait(int fd, int type)
+{
+	timing *t = cmd_chip(fd)->timings + type;
+	link_state *l = link_get(fd);
+	char status;
+	long left, deadline = now_ms() + t->max, polls = 0;
+	long long start = now_us();
+	int poll = t->typ / 10 > POLL_MIN ? t->typ / 10 : POLL_MIN;
+	int result = -1;
+	if(cmd_version(fd) >= 2){
+		while(result && (left = deadline - now_ms()) > 0){
+			polls++;
+			result = WAIT(fd, left > WAIT_SLICE ? WAIT_SLICE : left, NULL);
+			if(result < 0)
+				break;
+		}
+	}
+	else{
+		sleep_ms(t->typ);
+		for(;;){
+			polls++;
+			if(RDSR(fd, &status) == 0 && !(status & 0x01)){
+				result = 0;
+				break;
+			}
+			if(now_ms() >= deadline)
+				break;
+			sleep_ms(poll);
+		}
+	}
+	if(l)
+		metrics_busy(&l->m, type, polls, now_us() - start);
+	return result ? -1 : 0;
+}
+
 /* chip erase, will check status register to make sure completed.
  * assuming the command is accepted by the chip once sent.
- * since chip erase typically require several seconds, 
- * we can sleep some time to save cpu.
  * write-enable bit will be cleared after CE
  * return 0 on success, -1 on failure */
 int CE(int fd)
 {
 	int i, result = -1;
-	char status = 0x01;   /* assume write in progress */
-	char ce[1] = {0x60};
+	char ce[1];
 	command cmd_ce = {1, 0, ce};
+	ce[0] = cmd_chip(fd)->opcode[T_CE];
 	for(i = 0; result && i < CMD_RETRY; i++)
 		result = command_rw(fd, &cmd_ce, NULL);
+	count_retries(fd, i - 1);
 	if(result)
 		return result;
-	for(i = 0; (status & 0x01) && i < CE_TIMEOUT; i++){
-		sleep(1);
-		RDSR(fd, &status);
-	}
-	if(status & 0x01)
-		return -1;
-	return 0;
+	return busy_wait(fd, T_CE);
 }
 
-/* program selected page at addr. data size <= 256
+/* program selected page at addr. data size <= 256 and the page size
  * will check status to make sure completed
  * assuming the command is accepted by the chip once sent.
  * DO NOT LET size + (addr & 0xFF) > 0x100
  * return 0 on success, -1 on failure */
 int PP(int fd, char *data, int addr, int size)
 {
-	int i, result = -1;
-	char status = 0x01;
-	char pp[4+256];     /* pre-allocate enough space */
-	pp[0] = 0x02;
-	append_addr(pp, addr);
-	memcpy(pp+4, data, size);
-	command cmd_rd = {4 + size, 0, pp};
+	int i, n, result = -1;
+	char pp[5+256];     /* pre-allocate enough space */
+	n = addr_cmd(fd, pp, cmd_chip(fd)->opcode[T_PP], addr);
+	memcpy(pp+n, data, size);
+	command cmd_pp = {n + size, 0, pp};
 	for(i = 0; result && i < CMD_RETRY; i++)
-		result = command_rw(fd, &cmd_rd, NULL);
+		result = command_rw(fd, &cmd_pp, NULL);
+	count_retries(fd, i - 1);
 	if(result)
 		return -1;
-	time_t t0, t1;
-	t0 = t1 = time(NULL);
-	while((status & 0x01) && (t1 - t0) < PP_TIMEOUT)
-		RDSR(fd, &status);
-	if(status & 0x01)
-		return -1;
-	return 0;
+	return busy_wait(fd, T_PP);
 }
 
 /* block erase. assume block size 64k. block_addr = addr & 0xFF0000
@@ -193,22 +734,33 @@ int PP(int fd, char *data, int addr, int size)
 int BE(int fd, int addr)
 {
 	int i, result = -1;
-	char status = 0x01;   /* assume write in progress */
-	char be[4] ;
-	be[0] = 0x52;
-	append_addr(be, addr);
-	command cmd_be = {4, 0, be};
+	char be[5] ;
+	command cmd_be = {0, 0, be};
+	cmd_be.Inum = addr_cmd(fd, be, cmd_chip(fd)->opcode[T_BE], addr);
 	for(i = 0; result && i < CMD_RETRY; i++)
 		result = command_rw(fd, &cmd_be, NULL);
+	count_retries(fd, i - 1);
 	if(result)
 		return result;
-	time_t t0, t1;
-	t0 = t1 = time(NULL);
-	while((status & 0x01) && (t1 - t0) < BE_TIMEOUT)
-		RDSR(fd, &status);
-	if(status & 0x01)
-		return -1;
-	return 0;
+	return busy_wait(fd, T_BE);
+}
+
+/* 32k block erase. block_addr = addr & 0xFF8000
+ * check status register to make sure completed
+ * write enable bit is cleared after BE32
+ * return 0 on sucess, -1 on failure */
+int BE32(int fd, int addr)
+{
+	int i, result = -1;
+	char be[5] ;
+	command cmd_be = {0, 0, be};
+	cmd_be.Inum = addr_cmd(fd, be, cmd_chip(fd)->opcode[T_BE32], addr);
+	for(i = 0; result && i < CMD_RETRY; i++)
+		result = command_rw(fd, &cmd_be, NULL);
+	count_retries(fd, i - 1);
+	if(result)
+		return result;
+	return busy_wait(fd, T_BE32);
 }
 
 /* sector erase. assume sector size 4k, sector_addr=addr & 0xFFF
@@ -218,22 +770,172 @@ int BE(int fd, int addr)
 int SE(int fd, int addr)
 {
 	int i, result = -1;
-	char status = 0x01;   /* assume write in progress */
-	char se[4] ;
-	se[0] = 0x20;
-	append_addr(se, addr);
-	command cmd_se = {4, 0, se};
+	char se[5] ;
+	command cmd_se = {0, 0, se};
+	cmd_se.Inum = addr_cmd(fd, se, cmd_chip(fd)->opcode[T_SE], addr);
 	for(i = 0; result && i < CMD_RETRY; i++)
 		result = command_rw(fd, &cmd_se, NULL);
+	count_retries(fd, i - 1);
 	if(result)
 		return result;
-	time_t t0, t1;
-	t0 = t1 = time(NULL);
-	while((status & 0x01) && (t1 - t0) < SE_TIMEOUT)
-		RDSR(fd, &status);
-	if(status & 0x01)
+	return busy_wait(fd, T_SE);
+}
+
+/* read n bytes of the SFDP tables at addr into buf, n <= 0xFFFF
+ * return 0 on success, -1 on failure */
+int SFDP(int fd, char *buf, int addr, int n)
+{
+	int i, result = -1;
+	char sfdp[5];
+	/* always 3 address bytes, also in 4 byte mode */
+	sfdp[0] = 0x5A;
+	append_addr(sfdp, addr, 3);
+	sfdp[4] = 0;        /* dummy byte */
+	command cmd_sfdp = {5, n, sfdp};
+	for(i = 0; result && i < CMD_RETRY; i++)
+		result = command_rw(fd, &cmd_sfdp, buf);
+	count_retries(fd, i - 1);
+	return result;
+}
+
+/* read n bytes of the unique ID, opcode 0x4B with 4 dummy bytes
+ * return 0 on success, -1 on failure */
+int RDUID(int fd, char *buf, int n)
+{
+	int i, result = -1;
+	char rduid[5] = {0x4B, 0, 0, 0, 0};
+	command cmd_rduid = {5, n, rduid};
+	for(i = 0; result && i < CMD_RETRY; i++)
+		result = command_rw(fd, &cmd_rduid, buf);
+	count_retries(fd, i - 1);
+	return result;
+}
+
+/* enter (on = 1) or leave 4 byte address mode, for chips that have no
+ * 4 byte opcodes. some parts need write enable before entering.
+ * return 0 on success, -1 on failure */
+int EN4B(int fd, int on)
+{
+	int i, result = -1;
+	char en4b[1];
+	command cmd_en4b = {1, 0, en4b};
+	en4b[0] = on ? 0xB7 : 0xE9;
+	if(on && WREN(fd) < 0)
+		return -1;
+	for(i = 0; result && i < CMD_RETRY; i++)
+		result = command_rw(fd, &cmd_en4b, NULL);
+	count_retries(fd, i - 1);
+	if(result || (on && WRDI(fd) < 0))
 		return -1;
 	return 0;
 }
 
+/* program size bytes at addr, write enable, page program and status
+ * polling are all done by the programmer. size <= PR_BLOCK.
+ * the command is queued and status receives a PR_* value at cmd_sync().
+ * requires OP_PROG, or OP_PROG4 for 4 byte addresses.
+ * return 0 if queued, -1 on failure */
+int PR(int fd, char *data, int addr, int size, char *status)
+{
+	char pr[5+PR_BLOCK];
+	int n;
+	if(!cmd_has_op(fd, OP_PROG) || size > PR_BLOCK)
+		return -1;
+	n = frame_addr(fd, pr, cmd_chip(fd)->opcode[T_PP], addr);
+	memcpy(pr+n, data, size);
+	*status = PR_ARG;
+	return cmd_submit(fd, chip_op(fd, OP_PROG), pr, n + size, status, 1);
+}
+
+/* propose n rates to the programmer, which picks the fastest it can hold
+ * and switches to it right after answering. requires protocol version 2.
+ * return chosen rate, 0 if none fits, -1 on failure */
+int BAUDSET(int fd, int *rates, int n)
+{
+	char baud[4 * BAUD_RATES], ans[4];
+	int i;
+	if(cmd_version(fd) < 2 || n > BAUD_RATES)
+		return -1;
+	for(i = 0; i < n * 4; i++)
+		baud[i] = (rates[i / 4] >> (i % 4 * 8)) & 0xFF;
+	if(cmd_submit(fd, OP_BAUD, baud, n * 4, ans, 4) < 0 || cmd_sync(fd) < 0)
+		return -1;
+	return (unsigned char)ans[0] | ((unsigned char)ans[1] << 8) |
+	       ((unsigned char)ans[2] << 16) | ((unsigned char)ans[3] << 24);
+}
+
+/* same as PR(), the payload is run length encoded on the way.
+ * size is not limited by the frame, but the encoded data must fit
+ * into one. requires OP_PROGZ or OP_PROGZ4.
+ * return 0 if queued, -1 if it does not fit or on failure */
+int PRZ(int fd, char *data, int addr, int size, char *status)
+{
+	char prz[FRAME_DATA];
+	int n, head;
+	if(!cmd_has_op(fd, OP_PROGZ))
+		return -1;
+	head = frame_addr(fd, prz, cmd_chip(fd)->opcode[T_PP], addr);
+	n = rle_encode(data, size, prz + head, FRAME_DATA - head);
+	if(n < 0)
+		return -1;
+	*status = PR_ARG;
+	return cmd_submit(fd, chip_op(fd, OP_PROGZ), prz, head + n, status, 1);
+}
 
+/* crc32 of size bytes from addr in blocks of block bytes, computed on
+ * the programmer. the last block may be shorter. size <= CRC_SPAN and
+ * at most 0x3FFF blocks. crcs receives one value per block.
+ * requires OP_CRC, or OP_CRC4 for 4 byte addresses.
+ * return number of blocks, -1 on failure */
+int CRC(int fd, int addr, int size, int block, unsigned int *crcs)
+{
+	unsigned char *ans;
+	int i, n;
+	if(block <= 0)
+		return -1;
+	n = (size + block - 1) / block;
+	if(n * 4 > 0xFFFF || (ans = malloc(n * 4)) == NULL)
+		return -1;
+	if(CRCQ(fd, addr, size, block, (char *)ans) < 0 || cmd_sync(fd) < 0)
+		n = -1;
+	for(i = 0; i < n; i++)
+		crcs[i] = ans[i*4] | ans[i*4+1] << 8 | ans[i*4+2] << 16 |
+		          (unsigned int)ans[i*4+3] << 24;
+	free(ans);
+	return n;
+}
+
+/* same as CRC(), queued without waiting. after cmd_sync() ans holds
+ * the crc of each block, 4 bytes little endian.
+ * return 0 if queued, -1 on failure */
+int CRCQ(int fd, int addr, int size, int block, char *ans)
+{
+	char crc[11];
+	int n, head;
+	if(!cmd_has_op(fd, OP_CRC) || block <= 0 || size > CRC_SPAN)
+		return -1;
+	n = (size + block - 1) / block;
+	if(n * 4 > 0xFFFF)
+		return -1;
+	head = frame_addr(fd, crc, cmd_chip(fd)->read, addr);
+	append_addr(crc + head - 1, size, 3);
+	append_addr(crc + head + 2, block, 3);
+	return cmd_submit(fd, chip_op(fd, OP_CRC), crc, head + 6, ans, n * 4);
+}
+
+/* select the chips of mask, bit n is chip select n. writes go to all
+ * of them, reads, crcs and status polls to the lowest one. failed
+ * receives the chips the programmer dropped since the last call, after
+ * write enable or a page program failed on them. requires OP_CS.
+ * return the chips selected, -1 on failure */
+int CS(int fd, int mask, int *failed)
+{
+	char cs[1], ans[2];
+	if(!cmd_has_op(fd, OP_CS) || mask <= 0 || mask > 0xFF)
+		return -1;
+	cs[0] = mask;
+	if(cmd_submit(fd, OP_CS, cs, 1, ans, 2) < 0 || cmd_sync(fd) < 0)
+		return -1;
+	*failed = (unsigned char)ans[0];
+	return (unsigned char)ans[1];
+}
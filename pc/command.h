@@ -1,3 +1,34 @@
+#define OP_SPI  0x00       /* plain spi transfer */
+#define OP_PROG 0x01       /* program pages on the programmer */
+#define OP_WAIT 0x02       /* poll status register on the programmer */
+#define OP_BAUD 0x03       /* change baud rate of the link */
+#define OP_RDZ  0x04       /* spi transfer with run length encoded answer */
+#define OP_PROGZ 0x05      /* PR() with run length encoded payload */
+#define OP_CRC  0x06       /* crc32 of flash blocks on the programmer */
+#define OP_PROG4 0x07      /* OP_PROG with opcode and 32 bit address */
+#define OP_PROGZ4 0x08     /* OP_PROGZ with opcode and 32 bit address */
+#define OP_CRC4 0x09       /* OP_CRC with opcode and 32 bit address */
+#define OP_CS   0x0A       /* select the chips writes go to */
+#define OP_WREN 0x0B       /* write enable, checked on each selected chip */
+
+/* status returned by PR(), PRZ() and WAIT() */
+#define PR_OK      0x00
+#define PR_WREN    0x01    /* write enable latch not set */
+#define PR_TIMEOUT 0x02    /* write in progress did not clear */
+#define PR_ARG     0x03    /* malformed frame */
+#define PR_BLOCK   0x100   /* max data size of PR() */
+#define CRC_SPAN   0x100000 /* max size of CRC(), keeps answers within host timeouts */
+
+int cmd_init(int fd);
+chip_info *cmd_chip(int fd);
+void cmd_close(int fd);
+int cmd_submit(int fd, int op, char *Idata, int Inum, char *Odata, int Onum);
+int cmd_sync(int fd);
+int cmd_version(int fd);
+int cmd_has_op(int fd, int op);
+metrics *cmd_metrics(int fd);
+int cmd_compress(int fd, int on);
+int cmd_speed(int fd, int max);
 int RDID(int fd, char *buf);
 int RDSR(int fd, char *status);
 int WREN(int fd);
@@ -6,5 +37,16 @@ int RD(int fd, char *buf, int addr, int size);
 int CE(int fd);
 int PP(int fd, char *data, int addr, int size);
 int BE(int fd, int addr);
+int BE32(int fd, int addr);
 int SE(int fd, int addr);
+int SFDP(int fd, char *buf, int addr, int n);
+int RDUID(int fd, char *buf, int n);
+int EN4B(int fd, int on);
 void print_array(FILE *stream, char *data, int n);
+int PR(int fd, char *data, int addr, int size, char *status);
+int PRZ(int fd, char *data, int addr, int size, char *status);
+int WAIT(int fd, int timeout, int *elapsed);
+int BAUDSET(int fd, int *rates, int n);
+int CRC(int fd, int addr, int size, int block, unsigned int *crcs);
+int CRCQ(int fd, int addr, int size, int block, char *ans);
+int CS(int fd, int mask, int *failed);
@@ -0,0 +1,63 @@
+/* CRC-32 (IEEE 802.3, same as zlib and the programmer).
+ * slicing by 8: eight bytes per step through 8 tables.
+ * CRC-16 of protocol version 3 frames, small enough to go bitwise */
+#include "system.h"
+#include "crc.h"
+
+#define POLY 0xEDB88320U
+
+static unsigned int table[8][256];
+static int ready;
+
+static void crc32_init()
+{
+	unsigned int i, j, c;
+	for(i = 0; i < 256; i++){
+		c = i;
+		for(j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ POLY : c >> 1;
+		table[0][i] = c;
+	}
+	for(i = 0; i < 256; i++)
+		for(j = 1; j < 8; j++)
+			table[j][i] = (table[j-1][i] >> 8) ^ table[0][table[j-1][i] & 0xFF];
+	ready = 1;
+}
+
+/* update crc with n bytes, start with crc = 0.
+ * the first call builds the tables, make it before starting threads */
+unsigned int crc32(unsigned int crc, const char *data, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	unsigned int a, b;
+	if(!ready)
+		crc32_init();
+	crc = ~crc;
+	while(n >= 8){
+		a = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24);
+		b = p[4] | p[5] << 8 | p[6] << 16 | (unsigned int)p[7] << 24;
+		crc = table[7][a & 0xFF] ^ table[6][(a >> 8) & 0xFF] ^
+		      table[5][(a >> 16) & 0xFF] ^ table[4][a >> 24] ^
+		      table[3][b & 0xFF] ^ table[2][(b >> 8) & 0xFF] ^
+		      table[1][(b >> 16) & 0xFF] ^ table[0][b >> 24];
+		p += 8;
+		n -= 8;
+	}
+	while(n--)
+		crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+/* update a CRC-16/CCITT-FALSE (poly 0x1021, MSB first) with n bytes,
+ * start with crc = CRC16_INIT */
+unsigned short crc16(unsigned short crc, const char *data, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	int i;
+	while(n--){
+		crc ^= *p++ << 8;
+		for(i = 0; i < 8; i++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
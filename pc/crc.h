@@ -0,0 +1,3 @@
+unsigned int crc32(unsigned int crc, const char *data, size_t n);
+#define CRC16_INIT 0xFFFF
+unsigned short crc16(unsigned short crc, const char *data, size_t n);
@@ -0,0 +1,34 @@
+#!/bin/sh
+# Several chips behind one programmer, on the programmer simulator.
+# Chip select 0, the one reads and crcs go to, never takes write
+# enable. The write must go on with the others: chip select 0 FAIL,
+# 1 and 2 PASS with the data. Run from pc/ after make spiflash flashsim.
+
+size=0x40000
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+head -c $(($size)) /dev/urandom > "$dir/random.bin"
+./flashsim -m 3 -x 0 -i "$dir/flash.img" > "$dir/pty" 2> "$dir/stats" &
+sim=$!
+while [ ! -s "$dir/pty" ]; do
+	sleep 0.05
+done
+./spiflash -p "$(head -n 1 "$dir/pty")" --cs 0-2 -w -v -f "$dir/random.bin" \
+	> "$dir/log" 2>&1
+rc=$?
+kill -TERM $sim
+wait $sim
+
+[ $rc -eq 1 ] || { failed=1; echo "exit status $rc, expected 1" >&2; }
+for result in "0: FAIL" "1: PASS" "2: PASS"; do
+	grep -q "^Chip select $result$" "$dir/log" ||
+		{ failed=1; echo "no \"Chip select $result\"" >&2; }
+done
+for n in 1 2; do
+	cmp -s -n $(($size)) "$dir/flash.img.$n" "$dir/random.bin" ||
+		{ failed=1; echo "chip select $n differs" >&2; }
+done
+[ $failed -eq 0 ] && echo "cs test OK" || cat "$dir/log" >&2
+exit $failed
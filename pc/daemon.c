@@ -0,0 +1,548 @@
+/* Daemon mode. Keeps the programmers open and takes jobs from clients
+ * on a Unix socket, one queue per port. The protocol is in README.md.
+ * everything runs on one thread, jobs run in the background through
+ * sf_submit() and their ends are polled along with the clients. */
+#include "system.h"
+#include "chip.h"
+#include "metrics.h"
+#include "erase.h"
+#include "libspiflash.h"
+#include "daemon.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CLIENT_MAX 32
+#define REQ_LINE 256       /* longest request line */
+#define IN_SIZE 0x1000
+#define MERGE_MAX 0x100000 /* largest merged read or erase */
+#define FLUSH_MS 1000      /* for the last answers of a client on shutdown */
+#define STAGE_MAX 4        /* jobs a write takes */
+
+enum {R_NONE, R_ID, R_READ, R_ERASE, R_PROGRAM, R_VERIFY, R_WRITE};
+
+static const struct {
+	char *name;
+	int payload;       /* data follows the request line */
+} ops[] = {
+	[R_NONE] = {"", 0},
+	[R_ID] = {"id", 0},
+	[R_READ] = {"read", 0},
+	[R_ERASE] = {"erase", 0},
+	[R_PROGRAM] = {"program", 1},
+	[R_VERIFY] = {"verify", 1},
+	[R_WRITE] = {"write", 1},
+};
+
+struct client;
+
+/* one request of a client. it sits in the queue of its port until
+ * run, and in the list of its client until answered */
+typedef struct request {
+	struct request *next;     /* in the port queue or batch */
+	struct request *later;    /* in the client list */
+	struct client *c;         /* NULL once the client is gone */
+	int op;
+	int port;
+	int addr;
+	int size;
+	char *data;
+	int off;                  /* payload offset in data */
+	int got;                  /* payload bytes received */
+	int result;
+	int done;
+} request;
+
+typedef struct client {
+	int fd;
+	int eof;                  /* nothing more to read, answers go on */
+	char in[IN_SIZE];
+	int nin;
+	request *filling;         /* waiting for its payload */
+	request *first;           /* answers are sent in this order */
+	request *last;
+	char *out;
+	int nout;
+	int sent;
+} client;
+
+/* one programmer. a batch of merged requests runs at a time,
+ * as up to STAGE_MAX jobs one after the other */
+typedef struct {
+	char *path;
+	sf_ctx *ctx;
+	request *queue;
+	request *tail;
+	request *batch;
+	char *buf;                /* merged read */
+	sf_job jobs[STAGE_MAX];
+	int njobs;
+	int stage;
+} port;
+
+static port ports[DAEMON_PORTS];
+static int nports, max_baud, flags;
+static client *clients[CLIENT_MAX];
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+/* open a port that is closed, after startup or a link failure
+ * return 0 if open, -1 otherwise */
+static int port_open(port *p)
+{
+	char id[3];
+	int err;
+	if(p->ctx)
+		return 0;
+	p->ctx = sf_open(p->path, max_baud, flags, &err);
+	if(p->ctx == NULL){
+		fprintf(stderr, "%s: %s\n", p->path, sf_strerror(err));
+		return -1;
+	}
+	if((err = sf_chip_id(p->ctx, id)) < 0)
+		fprintf(stderr, "%s: %s\n", p->path, sf_strerror(err));
+	else
+		fprintf(stderr, "%s: protocol version %d, chip ID %02X %02X %02X\n",
+		        p->path, sf_version(p->ctx), (unsigned char)id[0],
+		        (unsigned char)id[1], (unsigned char)id[2]);
+	return 0;
+}
+
+/* append n bytes to the output of c
+ * return 0 on success, -1 on failure */
+static int client_put(client *c, char *data, int n)
+{
+	char *out = realloc(c->out, c->nout + n);
+	if(out == NULL)
+		return -1;
+	memcpy(out + c->nout, data, n);
+	c->out = out;
+	c->nout += n;
+	return 0;
+}
+
+/* answer finished requests of c in order */
+static void client_answer(client *c)
+{
+	request *r;
+	char line[REQ_LINE];
+	while((r = c->first) != NULL && r->done){
+		if(r->result < 0)
+			sprintf(line, "error %d %s\n", r->result, sf_strerror(r->result));
+		else if(r->op == R_READ || r->op == R_ID)
+			sprintf(line, "ok %d\n", r->size);
+		else
+			sprintf(line, "ok %d\n", r->result);
+		client_put(c, line, strlen(line));
+		if(r->result >= 0 && (r->op == R_READ || r->op == R_ID))
+			client_put(c, r->data, r->size);
+		c->first = r->later;
+		free(r->data);
+		free(r);
+	}
+	if(c->first == NULL)
+		c->last = NULL;
+}
+
+static void request_done(request *r, int result)
+{
+	r->result = result;
+	r->done = 1;
+	if(r->c)
+		client_answer(r->c);
+	else{
+		free(r->data);
+		free(r);
+	}
+}
+
+static void stage_done(sf_job *job, void *arg);
+static void port_next(port *p);
+
+/* answer all requests of the running batch of p and go on */
+static void batch_end(port *p, int result)
+{
+	request *r;
+	if(p->batch->op != R_VERIFY && result > 0)
+		result = 0;
+	while((r = p->batch) != NULL){
+		p->batch = r->next;
+		if(p->buf && result >= 0)
+			memcpy(r->data, p->buf + r->addr - p->jobs[0].addr, r->size);
+		request_done(r, result);
+	}
+	free(p->buf);
+	p->buf = NULL;
+	/* start over on the next request, the link may be out of step */
+	if(result == SF_ERR_LINK && !stop){
+		fprintf(stderr, "%s: link lost, reopening\n", p->path);
+		sf_close(p->ctx);
+		p->ctx = NULL;
+	}
+	port_next(p);
+}
+
+/* add job op on [addr, addr + size) of data to the batch of p */
+static void port_stage(port *p, int op, char *data, int addr, int size)
+{
+	sf_job *job = &p->jobs[p->njobs++];
+	memset(job, 0, sizeof(sf_job));
+	job->op = op;
+	job->data = data;
+	job->addr = addr;
+	job->size = size;
+	job->done = stage_done;
+	job->arg = p;
+}
+
+/* take the next requests off the queue of p and start them.
+ * reads and erases that follow each other and touch or overlap
+ * are merged into one job */
+static void port_next(port *p)
+{
+	request *r, *last;
+	int start, end, a, b, n;
+	if(p->batch || (r = p->queue) == NULL)
+		return;
+	if(port_open(p) < 0){
+		/* fail what is queued now, the port is tried again later */
+		while((r = p->queue) != NULL){
+			p->queue = r->next;
+			request_done(r, SF_ERR_PORT);
+		}
+		return;
+	}
+	start = r->addr;
+	end = r->addr + r->size;
+	for(last = r; (r->op == R_READ || r->op == R_ERASE) && last->next; last = last->next){
+		a = last->next->addr;
+		b = a + last->next->size;
+		if(last->next->op != r->op || a < start || a > end ||
+		   (b > end ? b : end) - start > MERGE_MAX)
+			break;
+		end = b > end ? b : end;
+	}
+	p->batch = r;
+	p->queue = last->next;
+	last->next = NULL;
+	p->njobs = 0;
+	p->stage = 0;
+	p->buf = NULL;
+	switch(r->op){
+		case R_ID:
+			batch_end(p, sf_chip_id(p->ctx, r->data));
+			return;
+		case R_READ:
+			if(r->next && (p->buf = malloc(end - start)) == NULL){
+				batch_end(p, SF_ERR_NOMEM);
+				return;
+			}
+			port_stage(p, SF_OP_READ, p->buf ? p->buf : r->data, start, end - start);
+			break;
+		case R_ERASE:
+			port_stage(p, SF_OP_ERASE, NULL, start, end - start);
+			break;
+		case R_PROGRAM:
+			port_stage(p, SF_OP_PROGRAM, r->data, start, end - start);
+			break;
+		case R_VERIFY:
+			port_stage(p, SF_OP_VERIFY, r->data, start, end - start);
+			break;
+		case R_WRITE:
+			/* data holds the whole sectors, the payload is in place,
+			 * the rest of partial sectors is read around it */
+			a = start & ~(SF_SECTOR - 1);
+			b = (end + SF_SECTOR - 1) & ~(SF_SECTOR - 1);
+			if(a < start)
+				port_stage(p, SF_OP_READ, r->data, a, start - a);
+			if(end < b)
+				port_stage(p, SF_OP_READ, r->data + end - a, end, b - end);
+			port_stage(p, SF_OP_ERASE, NULL, a, b - a);
+			port_stage(p, SF_OP_PROGRAM_VERIFY, r->data, a, b - a);
+			break;
+	}
+	if((n = sf_submit(p->ctx, &p->jobs[0])) < 0)
+		batch_end(p, n);
+}
+
+/* a job of the running batch ended, start the next one or answer */
+static void stage_done(sf_job *job, void *arg)
+{
+	port *p = arg;
+	int result = job->result;
+	if(result >= 0 && ++p->stage < p->njobs){
+		if((result = sf_submit(p->ctx, &p->jobs[p->stage])) == 0)
+			return;
+	}
+	batch_end(p, result);
+}
+
+/* put r at the end of the queue of its port */
+static void request_queue(request *r)
+{
+	port *p = &ports[r->port];
+	r->next = NULL;
+	if(p->queue)
+		p->tail->next = r;
+	else
+		p->queue = r;
+	p->tail = r;
+	port_next(p);
+}
+
+/* parse a request line of c and queue it, malformed ones are
+ * answered at once */
+static void client_request(client *c, char *line)
+{
+	char name[16], path[REQ_LINE];
+	request *r = calloc(1, sizeof(request));
+	int i, n, a, b;
+	if(r == NULL)
+		return;
+	r->c = c;
+	r->port = -1;
+	if(c->last)
+		c->last->later = r;
+	else
+		c->first = r;
+	c->last = r;
+	n = sscanf(line, "%15s %255s %i %i", name, path, &r->addr, &r->size);
+	for(i = R_ID; i <= R_WRITE && (n < 1 || strcmp(name, ops[i].name)); i++)
+		;
+	r->op = i <= R_WRITE ? i : R_NONE;
+	/* ports go by path or by number */
+	for(i = 0; n >= 2 && i < nports; i++)
+		if(!strcmp(path, ports[i].path))
+			r->port = i;
+	if(r->port < 0 && n >= 2 && sscanf(path, "%d%n", &i, &a) == 1 &&
+	   path[a] == 0 && i >= 0 && i < nports)
+		r->port = i;
+	if(r->op == R_ID){
+		n = 4;
+		r->addr = 0;
+		r->size = 3;
+	}
+	if(r->op == R_NONE || r->port < 0 || n < 4 || r->addr < 0 || r->size < 0 ||
+	   r->addr > CHIP_SIZE_MAX - r->size ||
+	   (r->op == R_ERASE && (r->addr | r->size) & (SF_SECTOR - 1))){
+		request_done(r, SF_ERR_ARG);
+		return;
+	}
+	a = r->addr & ~(SF_SECTOR - 1);
+	b = (r->addr + r->size + SF_SECTOR - 1) & ~(SF_SECTOR - 1);
+	r->off = r->op == R_WRITE ? r->addr - a : 0;
+	n = r->op == R_WRITE ? b - a : r->op == R_ERASE ? 0 : r->size;
+	if(n && (r->data = malloc(n)) == NULL){
+		request_done(r, SF_ERR_NOMEM);
+		return;
+	}
+	if(ops[r->op].payload && r->size)
+		c->filling = r;
+	else
+		request_queue(r);
+}
+
+/* take what c sent, request lines and payloads
+ * return 0 on success, -1 if c is to be dropped */
+static int client_input(client *c)
+{
+	request *r;
+	char *eol;
+	int i = 0, n;
+	n = read(c->fd, c->in + c->nin, IN_SIZE - c->nin);
+	if(n < 0)
+		return errno == EINTR || errno == EAGAIN ? 0 : -1;
+	if(n == 0){
+		c->eof = 1;
+		return 0;
+	}
+	c->nin += n;
+	while(i < c->nin){
+		if((r = c->filling) != NULL){
+			n = r->size - r->got < c->nin - i ? r->size - r->got : c->nin - i;
+			memcpy(r->data + r->off + r->got, c->in + i, n);
+			r->got += n;
+			i += n;
+			if(r->got == r->size){
+				c->filling = NULL;
+				request_queue(r);
+			}
+			continue;
+		}
+		eol = memchr(c->in + i, '\n', c->nin - i);
+		if(eol == NULL)
+			break;
+		*eol = 0;
+		client_request(c, c->in + i);
+		i = eol + 1 - c->in;
+	}
+	c->nin -= i;
+	memmove(c->in, c->in + i, c->nin);
+	/* a line that does not fit is not a request */
+	return c->nin < REQ_LINE ? 0 : -1;
+}
+
+/* send what is waiting for c
+ * return 0 on success, -1 if c is to be dropped */
+static int client_output(client *c)
+{
+	int n = send(c->fd, c->out + c->sent, c->nout - c->sent, MSG_NOSIGNAL);
+	if(n < 0)
+		return errno == EINTR || errno == EAGAIN ? 0 : -1;
+	c->sent += n;
+	if(c->sent == c->nout){
+		free(c->out);
+		c->out = NULL;
+		c->nout = c->sent = 0;
+	}
+	return 0;
+}
+
+/* return 1 if c has closed its end and got all answers */
+static int client_finished(client *c)
+{
+	return c->eof && c->nout == 0 && (c->first == NULL || c->first == c->filling);
+}
+
+/* requests of c that are queued or running are freed when done */
+static void client_drop(client *c)
+{
+	request *r, *later;
+	for(r = c->first; r; r = later){
+		later = r->later;
+		r->c = NULL;
+		if(r->done || r == c->filling){
+			free(r->data);
+			free(r);
+		}
+	}
+	close(c->fd);
+	free(c->out);
+	free(c);
+}
+
+static int listen_on(char *path)
+{
+	struct sockaddr_un sa;
+	int fd;
+	if(strlen(path) >= sizeof(sa.sun_path)){
+		fprintf(stderr, "Socket path too long\n");
+		return -1;
+	}
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	/* a socket left behind by a previous run is replaced */
+	unlink(path);
+	if(fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0 ||
+	   listen(fd, CLIENT_MAX) < 0){
+		fprintf(stderr, "Cannot listen on %s, %s\n", path, strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* serve n ports on the socket at path until SIGINT or SIGTERM.
+ * return 0 on a clean exit, -1 if the socket cannot be set up */
+int daemon_run(char *path, char **names, int n, int baud, int zip)
+{
+	struct pollfd fds[1 + DAEMON_PORTS + CLIENT_MAX];
+	struct sigaction sa;
+	request *r;
+	int i, k, fd, nfds, listen_fd;
+	nports = n;
+	max_baud = baud;
+	flags = zip ? SF_ZIP : 0;
+	for(i = 0; i < nports; i++){
+		ports[i].path = names[i];
+		port_open(&ports[i]);
+	}
+	if((listen_fd = listen_on(path)) < 0)
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	fprintf(stderr, "Listening on %s\n", path);
+	while(!stop){
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		for(i = 0; i < nports; i++){
+			fds[1 + i].fd = ports[i].batch ? sf_poll_fd(ports[i].ctx) : -1;
+			fds[1 + i].events = POLLIN;
+		}
+		nfds = 1 + nports;
+		for(i = 0; i < CLIENT_MAX; i++){
+			fds[nfds + i].fd = clients[i] ? clients[i]->fd : -1;
+			fds[nfds + i].events = 0;
+			if(clients[i] && !clients[i]->eof)
+				fds[nfds + i].events |= POLLIN;
+			if(clients[i] && clients[i]->nout)
+				fds[nfds + i].events |= POLLOUT;
+		}
+		if(poll(fds, nfds + CLIENT_MAX, -1) < 0)
+			continue;
+		for(i = 0; i < nports; i++)
+			if(fds[1 + i].revents)
+				sf_poll(ports[i].ctx);
+		for(i = 0; i < CLIENT_MAX; i++){
+			k = fds[nfds + i].revents;
+			if(clients[i] == NULL)
+				continue;
+			/* POLLHUP is only seen once both ends are shut */
+			if((k & (POLLHUP | POLLERR)) ||
+			   ((k & POLLOUT) && client_output(clients[i]) < 0) ||
+			   ((k & POLLIN) && client_input(clients[i]) < 0) ||
+			   client_finished(clients[i])){
+				client_drop(clients[i]);
+				clients[i] = NULL;
+			}
+		}
+		if(fds[0].revents & POLLIN){
+			fd = accept(listen_fd, NULL, NULL);
+			for(i = 0; fd >= 0 && i < CLIENT_MAX && clients[i]; i++)
+				;
+			if(fd >= 0 && (i == CLIENT_MAX || (clients[i] = calloc(1, sizeof(client))) == NULL)){
+				close(fd);
+				continue;
+			}
+			if(fd >= 0){
+				fcntl(fd, F_SETFL, O_NONBLOCK);
+				clients[i]->fd = fd;
+			}
+		}
+	}
+	fprintf(stderr, "Shutting down\n");
+	for(i = 0; i < nports; i++){
+		/* running batches finish, what is still queued is cancelled */
+		while((r = ports[i].queue) != NULL){
+			ports[i].queue = r->next;
+			request_done(r, SF_ERR_CANCEL);
+		}
+		if(ports[i].ctx)
+			sf_wait(ports[i].ctx);
+		sf_close(ports[i].ctx);
+	}
+	for(i = 0; i < CLIENT_MAX; i++){
+		if(clients[i] == NULL)
+			continue;
+		fds[0].fd = clients[i]->fd;
+		fds[0].events = POLLOUT;
+		while(clients[i]->nout && poll(fds, 1, FLUSH_MS) > 0 &&
+		      !(fds[0].revents & (POLLHUP | POLLERR)) && client_output(clients[i]) == 0)
+			;
+		client_drop(clients[i]);
+		clients[i] = NULL;
+	}
+	close(listen_fd);
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,3 @@
+#define DAEMON_PORTS 16    /* programmers served at once */
+
+int daemon_run(char *path, char **names, int n, int baud, int zip);
@@ -0,0 +1,111 @@
+/* Erase planner. Covers a sector aligned range with the cheapest mix
+ * of chip, 64k block, 32k block and 4k sector erase. */
+#include "system.h"
+#include "chip.h"
+#include "erase.h"
+
+#define SECTOR 0x1000
+#define OP_OVERHEAD 5      /* ms of serial traffic per erase command */
+#define OP_MISSING 0x7FFFFFF /* cost of an erase type the chip lacks */
+
+static const struct {
+	char *name;
+	int sectors;
+	int timing;
+} types[] = {
+	[E_SE] = {"SE", 1, T_SE},
+	[E_BE32] = {"BE32", 8, T_BE32},
+	[E_BE] = {"BE64", 16, T_BE},
+	[E_CE] = {"CE", 0, T_CE},
+};
+
+static long op_cost(chip_info *chip, int type)
+{
+	if(!chip->opcode[types[type].timing])
+		return OP_MISSING;
+	return chip->timings[types[type].timing].typ + OP_OVERHEAD;
+}
+
+/* plan the block of types[type].sectors sectors starting at sector first.
+ * sectors outside [0, n) are never touched.
+ * return estimated cost in ms, operations are appended to plan at *count */
+static long plan_block(chip_info *chip, char *sectors, int offset, int n, int first,
+                       int type, erase_op *plan, int *count)
+{
+	int i, size = types[type].sectors, start = *count, whole = 1, need = 0;
+	long cost = 0;
+	for(i = first; i < first + size; i++){
+		if(i < 0 || i >= n || sectors[i] == S_KEEP)
+			whole = 0;
+		else if(sectors[i] == S_ERASE)
+			need = 1;
+	}
+	if(!need)
+		return 0;
+	if(type == E_SE){
+		plan[*count].type = E_SE;
+		plan[*count].addr = offset + first * SECTOR;
+		(*count)++;
+		return op_cost(chip, E_SE);
+	}
+	for(i = first; i < first + size; i += types[type - 1].sectors)
+		cost += plan_block(chip, sectors, offset, n, i, type - 1, plan, count);
+	if(whole && op_cost(chip, type) < cost){
+		*count = start;
+		plan[*count].type = type;
+		plan[*count].addr = offset + first * SECTOR;
+		(*count)++;
+		cost = op_cost(chip, type);
+	}
+	return cost;
+}
+
+/* plan erase of n sectors starting at offset, sectors[] holds S_* states.
+ * only erase types the chip has are used, its size is needed to
+ * consider chip erase.
+ * plan must have room for n operations.
+ * return number of operations */
+int erase_plan(chip_info *chip, char *sectors, int offset, int n, erase_op *plan)
+{
+	int i, count = 0, keep = 0, big = types[E_BE].sectors;
+	long cost = 0;
+	/* walk 64k aligned blocks, partial ones at the ends fall back to
+	 * smaller erase types inside plan_block() */
+	for(i = -((offset / SECTOR) % big); i < n; i += big)
+		cost += plan_block(chip, sectors, offset, n, i, E_BE, plan, &count);
+	for(i = 0; i < n; i++)
+		keep |= sectors[i] == S_KEEP;
+	if(chip->size && offset == 0 && n * SECTOR == chip->size && !keep &&
+	   op_cost(chip, E_CE) < cost){
+		plan[0].type = E_CE;
+		plan[0].addr = 0;
+		count = 1;
+	}
+	return count;
+}
+
+/* return bytes erased by type, 0 for a chip erase */
+int erase_size(int type)
+{
+	return types[type].sectors * SECTOR;
+}
+
+/* return estimated time of plan in ms */
+long erase_cost(chip_info *chip, erase_op *plan, int n)
+{
+	int i;
+	long cost = 0;
+	for(i = 0; i < n; i++)
+		cost += op_cost(chip, plan[i].type);
+	return cost;
+}
+
+void erase_print(FILE *stream, chip_info *chip, erase_op *plan, int n)
+{
+	int i;
+	for(i = 0; i < n; i++)
+		fprintf(stream, "  %-4s %06X  ~%ld ms\n", types[plan[i].type].name,
+		        plan[i].addr, op_cost(chip, plan[i].type));
+	fprintf(stream, "%d erase operations, estimated %ld ms\n", n,
+	        erase_cost(chip, plan, n));
+}
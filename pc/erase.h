@@ -0,0 +1,17 @@
+/* erase operation types, from smallest to largest */
+enum {E_SE, E_BE32, E_BE, E_CE};
+
+typedef struct {
+	int type;
+	int addr;
+} erase_op;
+
+/* sector states passed to erase_plan() */
+#define S_KEEP  0    /* unchanged, must not be erased */
+#define S_ERASE 1    /* must be erased */
+#define S_BLANK 2    /* already blank, may be erased */
+
+int erase_plan(chip_info *chip, char *sectors, int offset, int n, erase_op *plan);
+int erase_size(int type);
+long erase_cost(chip_info *chip, erase_op *plan, int n);
+void erase_print(FILE *stream, chip_info *chip, erase_op *plan, int n);
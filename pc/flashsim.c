@@ -0,0 +1,1049 @@
+/* Programmer simulator. Emulates the firmware and a 25 series flash
+ * behind a pseudo terminal, so the host side can be run and timed
+ * without hardware. The terminal to open is printed on the first line
+ * of stdout, counters are printed to stderr when it is stopped.
+ *
+ * Link and SPI throughput are modelled by holding back the answers,
+ * erase and program times by the busy bit of the chip. Both costs add
+ * up, the overlap of SPI and UART in the firmware is not modelled. */
+#define _GNU_SOURCE        /* pseudo terminal calls */
+#include "system.h"
+#include "chip.h"
+#include "crc.h"
+#include "rle.h"
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+
+#define DAT_SIZE 512       /* max data length of a packet */
+#define HDR_SIZE  5
+#define HDR2_SIZE 7
+#define CHECK_SIZE 2       /* crc16 of a version 3 frame */
+#define SUB_BLOCK 256      /* answer bytes per crc16 on version 3 */
+#define PROTO_VER 3
+#define WINDOW    4
+#define RX_BUF    1024     /* receive ring of the firmware */
+#define READ_TIMEOUT 100   /* ms between bytes once a read has started */
+#define TRIAL_TIME 1000    /* ms to confirm a new baud rate */
+
+#define OP_SPI  0x00
+#define OP_PROG 0x01
+#define OP_WAIT 0x02
+#define OP_BAUD 0x03
+#define OP_RDZ  0x04
+#define OP_PROGZ 0x05
+#define OP_CRC  0x06
+#define OP_PROG4 0x07
+#define OP_PROGZ4 0x08
+#define OP_CRC4 0x09
+#define OP_CS   0x0A
+#define OP_WREN 0x0B
+#define OP_MAX  0x0C
+
+#define ST_OK      0x00
+#define ST_WREN    0x01
+#define ST_TIMEOUT 0x02
+#define ST_ARG     0x03
+
+#define PAGE_SIZE 0x100
+#define PP_TIMEOUT 10      /* ms */
+#define F_CPU 16000000L    /* clock of the modelled MCU */
+#define BAUD_TOL 20        /* max baud rate error in 1/1000 */
+#define BAUD_BOOT 115200
+#define SFDP_SIZE 0x70
+#define BFPT 0x30          /* offset of the basic parameter table */
+#define CS_MAX 8           /* chip select lines of the programmer */
+
+/* emulated chips, one per chip select line, all the same part */
+typedef struct {
+	unsigned char *flash;      /* NULL without a chip on the line */
+	int mode_4b, wel;
+	int dead;                  /* never takes write enable */
+	long long busy_until;      /* us */
+} sim_chip;
+static sim_chip chips[CS_MAX], *dev = chips;  /* the one spi_chip() talks to */
+static unsigned char id[3] = {0xC2, 0x20, 0x15};
+static int flash_size = 0x200000, nchips = 1;
+static int has_sfdp = 1, has_4b = 1;
+static long times[T_COUNT] = {      /* us */
+	[T_PP] = 800, [T_SE] = 45000, [T_BE32] = 200000,
+	[T_BE] = 400000, [T_CE] = 2000000,
+};
+static unsigned char sfdp[SFDP_SIZE];
+static const char uid[] = "flashsim unique";  /* RDUID answer, 16 bytes */
+
+/* emulated programmer */
+static int mfd, version = PROTO_VER, link_ver = 2, ops = OP_MAX;
+static int cs_mask = 1, cs_failed; /* chips selected, dropped since OP_CS */
+static double noise;               /* probability of a bit error per byte */
+static double weak;                /* probability of a page program gone wrong */
+static int blocks, block_len, block_sent;
+static unsigned short block_crc;
+static int pace = 1;               /* model link and SPI throughput */
+static long rate = BAUD_BOOT, new_rate, spi_clock = F_CPU / 2;
+static long long model;            /* us, time the answers are due */
+static volatile sig_atomic_t quit;
+
+static struct {
+	long packets;
+	long frames;
+	long naks;
+	long bytes_in;
+	long bytes_out;
+	long spi_bytes;
+	long noise;
+	long weak;
+} stats;
+
+static long long now_us()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+/* account us of modelled time, sleep once it runs ahead of the clock */
+static void spend(long long us)
+{
+	long long t = now_us();
+	if(!pace)
+		return;
+	if(model < t)
+		model = t;
+	model += us;
+	if(model - t > 1000)
+		usleep(model - t);
+}
+
+/* time of n bytes on the link, 10 bits each */
+static long long link_us(long n)
+{
+	return n * 10000000LL / rate;
+}
+
+/* flip a random bit of some of n bytes, as a noisy line would */
+static void add_noise(unsigned char *buf, int n)
+{
+	int i;
+	for(i = 0; i < n; i++)
+		if(drand48() < noise){
+			buf[i] ^= 1 << (lrand48() & 7);
+			stats.noise++;
+		}
+}
+
+/* read n bytes, waiting up to timeout ms for each, -1 waits forever
+ * return bytes read */
+static int link_read(unsigned char *buf, int n, int timeout)
+{
+	struct pollfd p = {mfd, POLLIN, 0};
+	int got = 0, k;
+	while(got < n && !quit){
+		if(poll(&p, 1, timeout) <= 0)
+			break;
+		k = read(mfd, buf + got, n - got);
+		if(k <= 0)
+			break;
+		got += k;
+	}
+	if(noise)
+		add_noise(buf, got);
+	stats.bytes_in += got;
+	spend(link_us(got));
+	return got;
+}
+
+/* send n bytes as they are, apart from the noise */
+static void link_send(unsigned char *buf, int n)
+{
+	unsigned char copy[SUB_BLOCK], *p;
+	int k, part, left;
+	spend(link_us(n));
+	stats.bytes_out += n;
+	for(; n > 0; buf += part, n -= part){
+		part = n < SUB_BLOCK ? n : SUB_BLOCK;
+		memcpy(copy, buf, part);
+		if(noise)
+			add_noise(copy, part);
+		for(p = copy, left = part; left > 0; ){
+			k = write(mfd, p, left);
+			if(k > 0){
+				p += k;
+				left -= k;
+			}
+			else
+				usleep(100);
+		}
+	}
+}
+
+/* close the current answer block with its crc, little endian */
+static void block_end()
+{
+	unsigned char crc[2] = {block_crc & 0xFF, block_crc >> 8};
+	link_send(crc, 2);
+	block_crc = CRC16_INIT;
+	block_len = 0;
+	block_sent = 1;
+}
+
+/* send n bytes of an answer, in crc checked blocks while blocks is set */
+static void link_write(unsigned char *buf, int n)
+{
+	int part;
+	while(blocks && n > 0){
+		part = SUB_BLOCK - block_len < n ? SUB_BLOCK - block_len : n;
+		block_crc = crc16(block_crc, (char *)buf, part);
+		link_send(buf, part);
+		block_len += part;
+		buf += part;
+		n -= part;
+		if(block_len == SUB_BLOCK)
+			block_end();
+	}
+	if(n > 0)
+		link_send(buf, n);
+}
+
+/* start (on = 1) or stop sending in crc checked blocks, as the firmware */
+static void link_blocks(int on)
+{
+	if(!on && blocks && (block_len || !block_sent))
+		block_end();
+	blocks = on;
+	block_crc = CRC16_INIT;
+	block_len = 0;
+	block_sent = 0;
+}
+
+static void reply(unsigned char c)
+{
+	link_write(&c, 1);
+}
+
+/* drop whatever the host has sent so far */
+static void link_flush()
+{
+	unsigned char buf[256];
+	struct pollfd p = {mfd, POLLIN, 0};
+	while(poll(&p, 1, 0) > 0 && read(mfd, buf, sizeof(buf)) > 0)
+		;
+}
+
+static void put32(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* JESD216 erase time field, count and unit of 1, 16, 128 or 1000 ms */
+static unsigned int erase_time(long us)
+{
+	static const long unit[] = {1000, 16000, 128000, 1000000};
+	long count;
+	int u;
+	for(u = 0; u < 3 && (us + unit[u] - 1) / unit[u] > 32; u++)
+		;
+	count = (us + unit[u] - 1) / unit[u];
+	count = count < 1 ? 1 : count > 32 ? 32 : count;
+	return (count - 1) | u << 5;
+}
+
+/* SFDP header and the basic flash parameter table of the chip */
+static void sfdp_init()
+{
+	static const long ce_unit[] = {16000, 256000, 4000000, 64000000};
+	unsigned char *b = sfdp + BFPT;
+	long count;
+	int u, bits;
+	memset(sfdp, 0xFF, sizeof(sfdp));
+	memcpy(sfdp, "SFDP\x06\x01\x00\xFF", 8);
+	memcpy(sfdp + 8, "\x00\x06\x01\x10\x30\x00\x00\xFF", 8);
+	/* 4K erase 0x20, 3 or 4 byte addresses over 16MB */
+	put32(b, 0x20E5 | (flash_size > 0x1000000) << 17);
+	for(bits = 0; (1L << bits) < flash_size * 8L; bits++)
+		;
+	put32(b + 4, bits <= 31 ? (unsigned int)(flash_size * 8L - 1) : 0x80000000 | bits);
+	put32(b + 28, 0x520F200C);
+	put32(b + 32, 0x0000D810);
+	/* typical times, max is 4 times typical */
+	put32(b + 36, 1 | erase_time(times[T_SE]) << 4 |
+	      erase_time(times[T_BE32]) << 11 | erase_time(times[T_BE]) << 18);
+	for(u = 0; u < 3 && (times[T_CE] + ce_unit[u] - 1) / ce_unit[u] > 32; u++)
+		;
+	count = (times[T_CE] + ce_unit[u] - 1) / ce_unit[u];
+	count = count < 1 ? 1 : count > 32 ? 32 : count;
+	put32(b + 40, 1 | 8 << 4 | ((times[T_PP] + 63) / 64 > 32 ? 31 : (times[T_PP] + 63) / 64 - 1) << 8 |
+	      1 << 13 | (count - 1) << 24 | u << 29);
+	/* EN4B, and the 4 byte opcode set if the part has it */
+	put32(b + 60, (has_4b ? 0x21 : 0x01) << 24);
+}
+
+static int chip_busy()
+{
+	return now_us() < dev->busy_until;
+}
+
+/* erase len bytes around addr if write is enabled */
+static void chip_erase(unsigned int addr, int len, int type)
+{
+	if(chip_busy() || !dev->wel)
+		return;
+	addr &= ~(len - 1);
+	memset(dev->flash + addr % flash_size, 0xFF, len);
+	dev->wel = 0;
+	dev->busy_until = now_us() + times[type];
+}
+
+/* one transaction with the CS of dev low, wn bytes written, then rn
+ * bytes read into r, which is preset to 0xFF */
+static void spi_chip(unsigned char *w, int wn, unsigned char *r, int rn)
+{
+	static const unsigned char wide[][2] = {
+		{0x13, 0x03}, {0x12, 0x02}, {0x21, 0x20}, {0x5C, 0x52}, {0xDC, 0xD8},
+	};
+	int op = w[0], n = dev->mode_4b ? 4 : 3, i;
+	unsigned int addr = 0;
+	/* 4 byte opcodes are mapped onto the usual ones */
+	for(i = 0; has_4b && i < 5; i++)
+		if(op == wide[i][0]){
+			op = wide[i][1];
+			n = 4;
+		}
+	if(op == 0x5A)
+		n = 3;
+	for(i = 0; i < n && 1 + i < wn; i++)
+		addr = addr << 8 | w[1 + i];
+	addr %= flash_size;
+	switch(op){
+		case 0x9F:
+			memcpy(r, id, rn < 3 ? rn : 3);
+			break;
+		case 0x5A:
+			for(i = 0; has_sfdp && wn >= 5 && i < rn; i++)
+				if(addr + i < SFDP_SIZE)
+					r[i] = sfdp[addr + i];
+			break;
+		case 0x4B:
+			/* unique id, after 4 dummy bytes */
+			for(i = 0; wn >= 5 && i < rn && i < (int)sizeof(uid); i++)
+				r[i] = uid[i];
+			break;
+		case 0x05:
+			memset(r, chip_busy() | dev->wel << 1, rn);
+			break;
+		case 0x06:
+			if(!chip_busy() && !dev->dead)
+				dev->wel = 1;
+			break;
+		case 0x04:
+			if(!chip_busy())
+				dev->wel = 0;
+			break;
+		case 0xB7:
+			dev->mode_4b = 1;
+			break;
+		case 0xE9:
+			dev->mode_4b = 0;
+			break;
+		case 0x03:
+			for(i = 0; !chip_busy() && i < rn; i++)
+				r[i] = dev->flash[(addr + i) % flash_size];
+			break;
+		case 0x02:
+			if(chip_busy() || !dev->wel)
+				break;
+			/* wraps around within the page */
+			for(i = 1 + n; i < wn; i++)
+				dev->flash[(addr & ~(PAGE_SIZE - 1)) | ((addr + i - 1 - n) & (PAGE_SIZE - 1))] &= w[i];
+			/* a bit left set or one cleared too many */
+			if(wn > 1 + n && drand48() < weak){
+				dev->flash[(addr & ~(PAGE_SIZE - 1)) | ((addr + lrand48() % (wn - 1 - n)) & (PAGE_SIZE - 1))] ^= 1 << (lrand48() & 7);
+				stats.weak++;
+			}
+			dev->wel = 0;
+			dev->busy_until = now_us() + times[T_PP];
+			break;
+		case 0x20:
+			chip_erase(addr, 0x1000, T_SE);
+			break;
+		case 0x52:
+			chip_erase(addr, 0x8000, T_BE32);
+			break;
+		case 0xD8:
+			chip_erase(addr, 0x10000, T_BE);
+			break;
+		case 0x60:
+		case 0xC7:
+			chip_erase(0, flash_size, T_CE);
+			break;
+	}
+}
+
+/* one transaction with the chips of mask selected. writes reach all
+ * of them, the lowest one answers, a line without a chip reads 0xFF */
+static void spi(int mask, unsigned char *w, int wn, unsigned char *r, int rn)
+{
+	int i;
+	stats.spi_bytes += wn + rn;
+	spend((wn + rn) * 8000000LL / spi_clock);
+	if(rn)
+		memset(r, 0xFF, rn);
+	for(i = 0; i < CS_MAX; i++){
+		if(!(mask & 1 << i))
+			continue;
+		if(chips[i].flash){
+			dev = chips + i;
+			spi_chip(w, wn, r, rn);
+		}
+		r = NULL;
+		rn = 0;
+	}
+}
+
+/* lowest selected chip, the only one read from */
+static int cs_one()
+{
+	return cs_mask & -cs_mask;
+}
+
+/* stop writing to the chips in failed, as the firmware does
+ * return 1 if no chip would be left */
+static int drop(int failed)
+{
+	if(failed == cs_mask)
+		return 1;
+	cs_failed |= failed;
+	cs_mask &= ~failed;
+	return 0;
+}
+
+/* status polling of the firmware, in real time as the chips are busy.
+ * a line without a chip reads busy
+ * return mask of the chips still busy */
+static int wait_ready(long timeout, long *elapsed)
+{
+	long long t0 = now_us(), left = 0;
+	int i, busy = 0;
+	for(i = 0; i < CS_MAX; i++)
+		if(cs_mask & 1 << i)
+			left = !chips[i].flash ? timeout * 1000LL :
+			       chips[i].busy_until - t0 > left ? chips[i].busy_until - t0 : left;
+	if(left > timeout * 1000)
+		left = timeout * 1000;
+	if(left > 0)
+		usleep(left);
+	if(elapsed)
+		*elapsed = (now_us() - t0) / 1000;
+	for(i = 0; i < CS_MAX; i++)
+		if(cs_mask & 1 << i && (!chips[i].flash || now_us() < chips[i].busy_until))
+			busy |= 1 << i;
+	return busy;
+}
+
+static int wren()
+{
+	unsigned char cmd = 0x06, status;
+	int i, failed = 0;
+	spi(cs_mask, &cmd, 1, NULL, 0);
+	cmd = 0x05;
+	for(i = 0; i < CS_MAX; i++)
+		if(cs_mask & 1 << i){
+			spi(1 << i, &cmd, 1, &status, 1);
+			if(!(status & 0x02))
+				failed |= 1 << i;
+		}
+	return failed && drop(failed);
+}
+
+/* where a program or crc op works, as in the firmware */
+typedef struct {
+	int cmd;
+	int len;           /* address bytes */
+	unsigned int addr;
+} target;
+
+/* read the 24 bit address, or opcode and 32 bit address if wide
+ * return length of the head */
+static int get_target(unsigned char *data, int wide, int cmd, target *t)
+{
+	int i;
+	t->cmd = wide ? data[0] : cmd;
+	t->len = wide ? 4 : 3;
+	t->addr = 0;
+	for(i = 0; i < t->len; i++)
+		t->addr = t->addr << 8 | data[wide + i];
+	return wide + t->len;
+}
+
+/* write opcode and address of t to cmd
+ * return length */
+static int put_target(target *t, unsigned char *cmd)
+{
+	int i;
+	cmd[0] = t->cmd;
+	for(i = 0; i < t->len; i++)
+		cmd[1 + i] = (t->addr >> ((t->len - 1 - i) * 8)) & 0xFF;
+	return 1 + t->len;
+}
+
+/* program len bytes at t, within one page */
+static int program_page(target *t, unsigned char *data, int len)
+{
+	unsigned char cmd[5 + PAGE_SIZE];
+	int n, busy;
+	if(wren())
+		return ST_WREN;
+	n = put_target(t, cmd);
+	memcpy(cmd + n, data, len);
+	spi(cs_mask, cmd, n + len, NULL, 0);
+	busy = wait_ready(PP_TIMEOUT, NULL);
+	return busy && drop(busy) ? ST_TIMEOUT : ST_OK;
+}
+
+/* expand n bytes of run length encoded data into out
+ * return expanded length, -1 if malformed or longer than max */
+static int rle_decode(unsigned char *data, int n, unsigned char *out, int max)
+{
+	int len = 0, c, run;
+	while(n > 0){
+		c = *data++;
+		n--;
+		if(c < 0x80){
+			run = c + 1;
+			if(run > n || len + run > max)
+				return -1;
+			memcpy(out + len, data, run);
+			data += run;
+			n -= run;
+		}
+		else{
+			if(!n)
+				return -1;
+			run = c < 0xC0 ? (c & 0x3F) + 3 : ((c & 0x1F) << 8 | *data) + 1;
+			if(len + run > max)
+				return -1;
+			memset(out + len, c < 0xC0 ? *data : c < 0xE0 ? 0xFF : 0x00, run);
+			data++;
+			n--;
+		}
+		len += run;
+	}
+	return len;
+}
+
+/* program n bytes of a PROG or PROGZ frame, split at pages.
+ * rle payloads are expanded first, their blank pages are skipped
+ * return ST_* status */
+static int program(unsigned char *data, int n, int wide, int zip)
+{
+	static unsigned char plain[0x20000];
+	target t;
+	int h = wide ? 5 : 3, len, i, blank, status;
+	if(n < h)
+		return ST_ARG;
+	get_target(data, wide, 0x02, &t);
+	data += h;
+	n -= h;
+	if(zip){
+		n = rle_decode(data, n, plain, sizeof(plain));
+		if(n < 0)
+			return ST_ARG;
+		data = plain;
+	}
+	while(n){
+		len = PAGE_SIZE - (t.addr & (PAGE_SIZE - 1));
+		len = len < n ? len : n;
+		for(i = 0, blank = zip; blank && i < len; i++)
+			blank = data[i] == 0xFF;
+		if(!blank && (status = program_page(&t, data, len)) != ST_OK)
+			return status;
+		t.addr += len;
+		data += len;
+		n -= len;
+	}
+	return ST_OK;
+}
+
+static unsigned int get24(unsigned char *data)
+{
+	return data[0] << 16 | data[1] << 8 | data[2];
+}
+
+/* crc32 of the blocks of a CRC frame, one answer of 4 bytes each */
+static void op_crc(unsigned char *data, int wide)
+{
+	unsigned char cmd[5], *buf;
+	unsigned int len, block, crc, i;
+	target t;
+	data += get_target(data, wide, 0x03, &t);
+	len = get24(data);
+	block = get24(data + 3);
+	buf = malloc(len + 4);
+	if(buf == NULL)
+		exit(1);
+	spi(cs_one(), cmd, put_target(&t, cmd), buf, len);
+	for(i = 0; i < len; i += block){
+		crc = crc32(0, (char *)buf + i, len - i < block ? len - i : block);
+		put32(cmd, crc);
+		link_write(cmd, 4);
+	}
+	free(buf);
+}
+
+/* check that Onum matches what op answers, as the firmware does */
+static int op_valid(int op, unsigned char *data, int Inum, int Onum)
+{
+	unsigned int len, block;
+	switch(op){
+		case OP_PROG:
+		case OP_PROGZ:
+		case OP_PROG4:
+		case OP_PROGZ4:
+			return Onum == 1;
+		case OP_WAIT:
+			return Onum == 3;
+		case OP_BAUD:
+			return Onum == 4;
+		case OP_CS:
+			return Inum == 1 && Onum == 2;
+		case OP_WREN:
+			return Inum == 0 && Onum == 1;
+		case OP_CRC:
+		case OP_CRC4:
+			if(Inum != (op == OP_CRC4 ? 11 : 9))
+				return 0;
+			data += Inum - 9;
+			len = get24(data + 3);
+			block = get24(data + 6);
+			return block && (unsigned int)Onum == (len + block - 1) / block * 4;
+	}
+	return 1;
+}
+
+/* return 1 if the MCU clock gives rate within tolerance */
+static int serial_calc(long rate)
+{
+	long div, ub, actual;
+	for(div = 8; div <= 16; div += 8){
+		ub = (F_CPU / div + rate / 2) / rate;
+		if(ub < 1 || ub > 4096)
+			continue;
+		actual = F_CPU / div / ub;
+		if(labs(actual - rate) * 1000 / rate <= BAUD_TOL)
+			return 1;
+	}
+	return 0;
+}
+
+/* pick the fastest proposed rate, switched to after the answer */
+static void op_baud(unsigned char *data, int n)
+{
+	unsigned char ans[4];
+	long r;
+	int i;
+	new_rate = 0;
+	for(i = 0; i + 4 <= n; i += 4){
+		r = data[i] | data[i+1] << 8 | data[i+2] << 16 | (long)data[i+3] << 24;
+		if(r > new_rate && serial_calc(r))
+			new_rate = r;
+	}
+	put32(ans, new_rate);
+	link_write(ans, 4);
+}
+
+static void op_wait(unsigned char *data, int n)
+{
+	unsigned char ans[3] = {ST_ARG, 0, 0};
+	long elapsed;
+	if(n == 2){
+		ans[0] = wait_ready(data[0] | data[1] << 8, &elapsed) ?
+		         ST_TIMEOUT : ST_OK;
+		ans[1] = elapsed & 0xFF;
+		ans[2] = (elapsed >> 8) & 0xFF;
+	}
+	link_write(ans, 3);
+}
+
+/* select the chips of the mask in data, answer those dropped since
+ * the last selection and those selected */
+static void op_cs(unsigned char *data)
+{
+	int mask = data[0] & ((1 << CS_MAX) - 1);
+	reply(cs_failed);
+	cs_failed = 0;
+	if(mask)
+		cs_mask = mask;
+	reply(cs_mask);
+}
+
+/* plain or run length encoded spi transfer, answered as it is read */
+static void op_spi(unsigned char *data, int Inum, int Onum, int zip)
+{
+	static unsigned char buf[0x10000], out[0x20000];
+	int n;
+	spi(Onum ? cs_one() : cs_mask, data, Inum, buf, Onum);
+	if(!zip){
+		link_write(buf, Onum);
+		return;
+	}
+	n = rle_encode((char *)buf, Onum, (char *)out, sizeof(out));
+	link_write(out, n);
+}
+
+/* version 1 packet, SOH already received
+ * return 0 on success, 1 on error */
+static int packet_v1(unsigned char *buffer)
+{
+	unsigned char header[HDR_SIZE - 1];
+	int Inum, Onum;
+	if(link_read(header, HDR_SIZE - 1, READ_TIMEOUT) < HDR_SIZE - 1)
+		return 1;
+	Inum = header[0] | header[1] << 8;
+	Onum = header[2] | header[3] << 8;
+	if(Inum > DAT_SIZE)
+		return 1;
+	reply(ACK);
+	if(link_read(buffer, Inum + 2, READ_TIMEOUT) < Inum + 2 ||
+	   buffer[0] != STX || buffer[Inum + 1] != ETX)
+		return 1;
+	stats.packets++;
+	reply(ACK);
+	reply(STX);
+	op_spi(buffer + 1, Inum, Onum, 0);
+	reply(ETX);
+	return 0;
+}
+
+static void nak(int seq)
+{
+	unsigned char ans[2] = {NAK, seq};
+	stats.naks++;
+	link_write(ans, 2);
+}
+
+/* version 2 frame, DC1 already received, with crcs from version 3 on
+ * return 0 on success, 1 on error */
+static int frame_v2(unsigned char *buffer)
+{
+	unsigned char header[HDR2_SIZE - 1];
+	int Inum, Onum, seq, op, check = link_ver >= 3 ? CHECK_SIZE : 0;
+	unsigned short crc;
+	if(link_read(header, HDR2_SIZE - 1, READ_TIMEOUT) < HDR2_SIZE - 1){
+		nak(0);
+		return 1;
+	}
+	seq = header[0];
+	op = header[1];
+	Inum = header[2] | header[3] << 8;
+	Onum = header[4] | header[5] << 8;
+	if(Inum > DAT_SIZE || op >= ops){
+		nak(seq);
+		return 1;
+	}
+	if(link_read(buffer, Inum + 2 + check, READ_TIMEOUT) < Inum + 2 + check ||
+	   buffer[0] != STX || buffer[Inum + 1 + check] != ETX ||
+	   !op_valid(op, buffer + 1, Inum, Onum)){
+		nak(seq);
+		return 1;
+	}
+	if(check){
+		crc = crc16(crc16(CRC16_INIT, (char *)header, HDR2_SIZE - 1),
+		            (char *)buffer + 1, Inum);
+		if(buffer[Inum + 1] != (crc & 0xFF) || buffer[Inum + 2] != crc >> 8){
+			nak(seq);
+			return 1;
+		}
+	}
+	stats.frames++;
+	reply(ACK);
+	reply(seq);
+	reply(STX);
+	link_blocks(check);
+	switch(op){
+		case OP_SPI:
+		case OP_RDZ:
+			op_spi(buffer + 1, Inum, Onum, op == OP_RDZ);
+			break;
+		case OP_PROG:
+		case OP_PROGZ:
+		case OP_PROG4:
+		case OP_PROGZ4:
+			reply(program(buffer + 1, Inum, op >= OP_PROG4,
+			              op == OP_PROGZ || op == OP_PROGZ4));
+			break;
+		case OP_WAIT:
+			op_wait(buffer + 1, Inum);
+			break;
+		case OP_BAUD:
+			op_baud(buffer + 1, Inum);
+			break;
+		case OP_CRC:
+		case OP_CRC4:
+			op_crc(buffer + 1, op == OP_CRC4);
+			break;
+		case OP_CS:
+			op_cs(buffer + 1);
+			break;
+		case OP_WREN:
+			reply(wren() ? ST_WREN : ST_OK);
+			break;
+	}
+	link_blocks(0);
+	reply(ETX);
+	return 0;
+}
+
+/* version negotiation, SYN already received
+ * return 0 on success, 1 on error */
+static int negotiate(int window)
+{
+	unsigned char header[HDR_SIZE - 1], ans[6];
+	if(link_read(header, HDR_SIZE - 1, READ_TIMEOUT) < HDR_SIZE - 1){
+		reply(NAK);
+		return 1;
+	}
+	ans[0] = ACK;
+	ans[1] = header[0] < version ? header[0] : version;
+	link_ver = ans[1];
+	ans[2] = window;
+	ans[3] = RX_BUF & 0xFF;
+	ans[4] = RX_BUF >> 8;
+	ans[5] = ops;
+	link_write(ans, 6);
+	return 0;
+}
+
+static void stop(int sig)
+{
+	quit = 1;
+}
+
+/* parse "pp,se,be32,be,ce" in us into times */
+static int parse_times(char *s)
+{
+	int i;
+	char *end;
+	for(i = 0; i < T_COUNT; i++){
+		times[i] = strtol(s, &end, 0);
+		if(end == s || times[i] < 0 || (*end != ',' && i < T_COUNT - 1))
+			return -1;
+		s = end + 1;
+	}
+	return 0;
+}
+
+/* image file of chip select i, <image>.i beyond the first
+ * return a new string */
+static char *image_name(char *image, int i)
+{
+	char *name = malloc(strlen(image) + 4);
+	if(name == NULL)
+		exit(1);
+	if(i)
+		sprintf(name, "%s.%d", image, i);
+	else
+		strcpy(name, image);
+	return name;
+}
+
+static void printhelp(char *argv0)
+{
+	printf("Usage: %s [options]\n", argv0);
+	printf("Options:\n");
+	printf("  -s <size>         Chip size in bytes, default 0x200000\n");
+	printf("  -I <id>           Chip ID in hex, default C22015\n");
+	printf("  -i <image>        Load flash content from file, save it on exit\n");
+	printf("  -t <pp,se,be32,be,ce>\n");
+	printf("                    Busy times in us, default 800,45000,200000,400000,2000000\n");
+	printf("  -n                Chip has no SFDP table\n");
+	printf("  -4                Chip has no 4 byte opcodes, only EN4B\n");
+	printf("  -c <hz>           SPI clock, default 8000000\n");
+	printf("  -f                Do not model link and SPI throughput\n");
+	printf("  -1                Firmware speaks protocol version 1 only\n");
+	printf("  -V <version>      Highest protocol version of the firmware, default 3\n");
+	printf("  -e <rate>         Bit errors per byte on the link, both ways, e.g. 1e-5\n");
+	printf("  -b <rate>         Page programs that flip a bit, e.g. 0.01\n");
+	printf("  -w <frames>       Window the firmware offers, default 4\n");
+	printf("  -o <ops>          Operations the firmware supports, default 12\n");
+	printf("  -m <chips>        Chips on chip selects 0 to chips - 1, default 1.\n");
+	printf("                    Chip n > 0 keeps its image in <image>.n\n");
+	printf("  -x <cs>           Chip on chip select cs never takes write enable\n");
+	printf("  -h                Print this message\n");
+}
+
+int main(int argc, char **argv)
+{
+	static unsigned char buffer[DAT_SIZE + 2 + CHECK_SIZE];
+	struct sigaction sa;
+	struct termios t;
+	unsigned char c;
+	char *image = NULL, *name;
+	FILE *file;
+	int opt, window = WINDOW, error = 1, trial = 0, dead = 0, i;
+	unsigned int v;
+	while((opt = getopt(argc, argv, "s:I:i:t:n4c:f1V:e:b:w:o:m:x:h")) != -1){
+		switch(opt){
+			case 's':
+				flash_size = strtol(optarg, NULL, 0);
+				break;
+			case 'I':
+				v = strtoul(optarg, NULL, 16);
+				id[0] = v >> 16;
+				id[1] = v >> 8;
+				id[2] = v;
+				break;
+			case 'i':
+				image = optarg;
+				break;
+			case 't':
+				if(parse_times(optarg) < 0){
+					fprintf(stderr, "Wrong times\n");
+					exit(1);
+				}
+				break;
+			case 'n':
+				has_sfdp = 0;
+				break;
+			case '4':
+				has_4b = 0;
+				break;
+			case 'c':
+				spi_clock = strtol(optarg, NULL, 0);
+				break;
+			case 'f':
+				pace = 0;
+				break;
+			case '1':
+				version = 1;
+				break;
+			case 'V':
+				version = atoi(optarg);
+				break;
+			case 'e':
+				noise = strtod(optarg, NULL);
+				break;
+			case 'b':
+				weak = strtod(optarg, NULL);
+				break;
+			case 'w':
+				window = atoi(optarg);
+				break;
+			case 'o':
+				ops = atoi(optarg);
+				break;
+			case 'm':
+				nchips = atoi(optarg);
+				break;
+			case 'x':
+				v = atoi(optarg);
+				dead |= v < CS_MAX ? 1 << v : 0;
+				break;
+			default:
+				printhelp(argv[0]);
+				exit(opt != 'h');
+		}
+	}
+	if(flash_size <= 0 || flash_size > CHIP_SIZE_MAX || spi_clock <= 0 ||
+	   window < 1 || window > 255 || ops < 1 || ops > OP_MAX ||
+	   version < 1 || version > PROTO_VER || noise < 0 || noise >= 1 ||
+	   weak < 0 || weak > 1 || nchips < 1 || nchips > CS_MAX){
+		fprintf(stderr, "Invalid option value\n");
+		exit(1);
+	}
+	for(i = 0; i < nchips; i++){
+		chips[i].flash = malloc(flash_size);
+		chips[i].dead = dead >> i & 1;
+		if(chips[i].flash == NULL){
+			fprintf(stderr, "Memory allocation failed\n");
+			exit(1);
+		}
+		memset(chips[i].flash, 0xFF, flash_size);
+		if(image == NULL)
+			continue;
+		name = image_name(image, i);
+		if((file = fopen(name, "r"))){
+			if(fread(chips[i].flash, 1, flash_size, file) == 0)
+				fprintf(stderr, "Image %s is empty\n", name);
+			fclose(file);
+		}
+		free(name);
+	}
+	sfdp_init();
+
+	mfd = posix_openpt(O_RDWR | O_NOCTTY);
+	if(mfd < 0 || grantpt(mfd) < 0 || unlockpt(mfd) < 0 || tcgetattr(mfd, &t) < 0){
+		fprintf(stderr, "Failed to open a pseudo terminal, %s\n", strerror(errno));
+		exit(1);
+	}
+	cfmakeraw(&t);
+	tcsetattr(mfd, TCSANOW, &t);
+	/* keep the slave side open, so the master does not hang up
+	 * between two runs of the host */
+	if(open(ptsname(mfd), O_RDWR | O_NOCTTY) < 0){
+		fprintf(stderr, "Failed to open %s, %s\n", ptsname(mfd), strerror(errno));
+		exit(1);
+	}
+	printf("%s\n", ptsname(mfd));
+	fflush(stdout);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	while(!quit){
+		if(new_rate){
+			rate = new_rate;
+			new_rate = 0;
+			trial = 1;
+		}
+		/* the firmware also drops input after version 1 packets, SYN and
+		 * baud changes. on a pseudo terminal the host may already have
+		 * sent the next packet by then, so only errors drop it here */
+		if(error)
+			link_flush();
+		/* the host has TRIAL_TIME to get a packet through at a new rate */
+		if(trial && link_read(&c, 1, TRIAL_TIME) < 1){
+			rate = BAUD_BOOT;
+			trial = 0;
+			continue;
+		}
+		if(!trial && link_read(&c, 1, -1) < 1)
+			continue;
+		if(c == SOH){
+			error = packet_v1(buffer);
+			if(error)
+				reply(NAK);
+		}
+		else if(c == DC1 && version >= 2)
+			error = frame_v2(buffer);
+		else if(c == SYN && version >= 2)
+			error = negotiate(window);
+		else{
+			reply(NAK);
+			error = 1;
+		}
+		if(trial){
+			if(error)
+				rate = BAUD_BOOT;
+			trial = 0;
+		}
+	}
+
+	for(i = 0; image && i < nchips; i++){
+		name = image_name(image, i);
+		if((file = fopen(name, "w"))){
+			if(fwrite(chips[i].flash, 1, flash_size, file) != (size_t)flash_size)
+				fprintf(stderr, "Failed to save %s\n", name);
+			fclose(file);
+		}
+		free(name);
+	}
+	fprintf(stderr, "flashsim: %ld packets, %ld frames, %ld naks, %ld bytes in, "
+	        "%ld bytes out, %ld spi bytes, %ld bit errors, %ld bad programs\n", stats.packets,
+	        stats.frames, stats.naks, stats.bytes_in, stats.bytes_out,
+	        stats.spi_bytes, stats.noise, stats.weak);
+	return 0;
+}
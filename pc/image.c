@@ -0,0 +1,95 @@
+/* Image source, a mapped file or a stream from stdin */
+#include "system.h"
+#include "image.h"
+#include <sys/mman.h>
+
+/* open path, "-" is stdin. size 0 takes the size of the file.
+ * regular files are mapped, anything else is streamed.
+ * return 0 on success, -1 on failure */
+int image_open(image *im, char *path, int size)
+{
+	struct stat st;
+	memset(im, 0, sizeof(image));
+	im->fd = strcmp(path, "-") ? open(path, O_RDONLY) : STDIN_FILENO;
+	if(im->fd < 0){
+		fprintf(stderr,"Failed to open file, %s\n", strerror(errno));
+		return -1;
+	}
+	if(fstat(im->fd, &st) < 0 || (!size && !S_ISREG(st.st_mode)) ||
+	   (!size && st.st_size > IMAGE_MAX)){
+		fprintf(stderr,"Invalid file.\n");
+		goto Fail;
+	}
+	im->size = size ? size : (int)st.st_size;
+	if(S_ISREG(st.st_mode) && im->fd != STDIN_FILENO){
+		if(st.st_size < im->size){
+			fprintf(stderr,"failed to read file.\n");
+			goto Fail;
+		}
+		if(im->size == 0)
+			return 0;
+		im->map = mmap(NULL, im->size, PROT_READ, MAP_PRIVATE, im->fd, 0);
+		if(im->map == MAP_FAILED){
+			im->map = NULL;
+			fprintf(stderr,"Failed to map file, %s\n", strerror(errno));
+			goto Fail;
+		}
+		madvise(im->map, im->size, MADV_SEQUENTIAL);
+		return 0;
+	}
+	im->window = malloc(IMAGE_WINDOW);
+	if(im->window == NULL){
+		fprintf(stderr, "Memory allocation failed.\n");
+		goto Fail;
+	}
+	return 0;
+Fail:
+	if(im->fd != STDIN_FILENO)
+		close(im->fd);
+	im->fd = -1;
+	return -1;
+}
+
+/* n bytes at offset. a stream holds at least the IMAGE_KEEP bytes
+ * before the end of the last request, n is at most IMAGE_KEEP.
+ * return pointer valid until the next call, NULL on failure */
+char *image_get(image *im, int offset, int n)
+{
+	ssize_t got;
+	int drop;
+	if(offset < 0 || offset + n > im->size)
+		return NULL;
+	if(im->map)
+		return im->map + offset;
+	if(offset < im->start || n > IMAGE_KEEP)
+		return NULL;
+	while(im->start + im->len < offset + n){
+		/* when full, drop all but IMAGE_KEEP bytes before the end */
+		if(im->len == IMAGE_WINDOW){
+			drop = offset + n - IMAGE_KEEP - im->start;
+			if(drop > im->len)
+				drop = im->len;
+			memmove(im->window, im->window + drop, im->len - drop);
+			im->len -= drop;
+			im->start += drop;
+		}
+		got = read(im->fd, im->window + im->len, IMAGE_WINDOW - im->len);
+		if(got < 0 && errno == EINTR)
+			continue;
+		if(got <= 0)
+			return NULL;
+		im->len += got;
+	}
+	return im->window + (offset - im->start);
+}
+
+void image_close(image *im)
+{
+	if(im->map)
+		munmap(im->map, im->size);
+	free(im->window);
+	if(im->fd > STDIN_FILENO)
+		close(im->fd);
+	im->map = im->window = NULL;
+	im->fd = -1;
+}
@@ -0,0 +1,18 @@
+#define IMAGE_WINDOW 0x40000 /* bytes of a streamed image held at once */
+#define IMAGE_KEEP   0x20000 /* bytes a stream can go back from its end */
+#define IMAGE_MAX  0x40000000 /* largest file taken whole, the largest chip */
+
+/* image to program or verify against. a file is mapped whole,
+ * a pipe is read through a window that only moves forward */
+typedef struct {
+	int fd;
+	char *map;         /* whole file, NULL when streaming */
+	int size;
+	char *window;      /* streamed bytes [start, start + len) */
+	int start;
+	int len;
+} image;
+
+int image_open(image *im, char *path, int size);
+char *image_get(image *im, int offset, int n);
+void image_close(image *im);
@@ -0,0 +1,217 @@
+/* Job journal. A text file starting with a header that describes the
+ * job, followed by one line per unit of work finished:
+ *
+ *   spiflash journal 1
+ *   w C22015 1A2B3C4D 1234 F0000   op, chip id, image crc, addr, size
+ *   dirty F2 1111...              sector states, write only
+ *   head FFFF...                  old content of partial sectors,
+ *   tail FFFF...                  write only, if any
+ *   plan 2                        erase plan, write only
+ *   1 0
+ *   2 8000
+ *   erased 1                      erase operations done
+ *   done 10000                    bytes programmed or read
+ *
+ * progress lines are appended and synced, the last one counts. */
+#include "system.h"
+#include "chip.h"
+#include "erase.h"
+#include "journal.h"
+
+#define MAGIC "spiflash journal 1"
+#define SECTOR 0x1000
+
+static void put_hex(FILE *file, char *data, int n)
+{
+	int i;
+	for(i = 0; i < n; i++)
+		fprintf(file, "%02X", (unsigned char)data[i]);
+	fputc('\n', file);
+}
+
+/* return 0 on success, -1 on malformed data */
+static int get_hex(FILE *file, char *data, int n)
+{
+	int i;
+	unsigned int c;
+	for(i = 0; i < n; i++){
+		if(fscanf(file, "%2x", &c) != 1)
+			return -1;
+		data[i] = c;
+	}
+	return 0;
+}
+
+/* read the sector states, partial sectors and erase plan of a write */
+static int load_write(journal *jn, FILE *file)
+{
+	erase_op *op;
+	char key[8];
+	int i, c;
+	if(fscanf(file, " dirty %x ", &jn->block) != 1 ||
+	   jn->block <= 0 || jn->block > CHIP_SIZE_MAX / SECTOR)
+		return -1;
+	jn->dirty = malloc(jn->block);
+	jn->plan = malloc(jn->block * sizeof(erase_op));
+	if(jn->dirty == NULL || jn->plan == NULL)
+		return -1;
+	for(i = 0; i < jn->block; i++){
+		c = fgetc(file);
+		if(c < '0' || c > '2')
+			return -1;
+		jn->dirty[i] = c - '0';
+	}
+	for(;;){
+		if(fscanf(file, " %7s ", key) != 1)
+			return -1;
+		if(!strcmp(key, "head")){
+			if(get_hex(file, jn->head, SECTOR) < 0)
+				return -1;
+			jn->has_head = 1;
+		}
+		else if(!strcmp(key, "tail")){
+			if(get_hex(file, jn->tail, SECTOR) < 0)
+				return -1;
+			jn->has_tail = 1;
+		}
+		else if(!strcmp(key, "plan"))
+			break;
+		else
+			return -1;
+	}
+	if(fscanf(file, "%d", &jn->nplan) != 1 || jn->nplan < 0 || jn->nplan > jn->block)
+		return -1;
+	/* the type picks opcodes, a chip erase starts at 0 */
+	for(i = 0; i < jn->nplan; i++){
+		op = &jn->plan[i];
+		if(fscanf(file, " %d %x", &op->type, &op->addr) != 2 ||
+		   op->type < E_SE || op->type > E_CE || op->addr < 0 ||
+		   op->addr > CHIP_SIZE_MAX - erase_size(op->type) ||
+		   (op->type == E_CE ? op->addr : op->addr & (erase_size(op->type) - 1)))
+			return -1;
+	}
+	return 0;
+}
+
+/* read the journal at path into jn, dirty and plan are allocated.
+ * return 0 on success, -1 if missing or malformed */
+int journal_load(journal *jn, char *path)
+{
+	FILE *file = fopen(path, "r");
+	char line[32], key[16];
+	unsigned int id;
+	int value;
+	memset(jn, 0, sizeof(journal));
+	if(file == NULL)
+		return -1;
+	if(fgets(line, sizeof(line), file) == NULL || strncmp(line, MAGIC, strlen(MAGIC)) ||
+	   fscanf(file, " %c %x %x %x %x", &jn->op, &id, &jn->crc, &jn->addr, &jn->size) != 5 ||
+	   (jn->op != 'w' && jn->op != 'r') ||
+	   (jn->op == 'w' && load_write(jn, file) < 0))
+		goto Fail;
+	jn->id[0] = id >> 16;
+	jn->id[1] = id >> 8;
+	jn->id[2] = id;
+	/* a torn last line is ignored */
+	while(fscanf(file, " %15s %x", key, &value) == 2){
+		if(!strcmp(key, "erased"))
+			jn->erased = value;
+		else if(!strcmp(key, "done"))
+			jn->done = value;
+	}
+	/* done picks the data to go on with, it must lie within the job */
+	if(jn->erased < 0 || jn->erased > jn->nplan || jn->done < 0 ||
+	   jn->done > (jn->op == 'w' ? jn->block * SECTOR : jn->size))
+		goto Fail;
+	fclose(file);
+	return 0;
+Fail:
+	fclose(file);
+	journal_end(jn, NULL, 0);
+	return -1;
+}
+
+/* return 1 if both journals describe the same job */
+int journal_match(journal *a, journal *b)
+{
+	return a->op == b->op && !memcmp(a->id, b->id, 3) && a->crc == b->crc &&
+	       a->addr == b->addr && a->size == b->size;
+}
+
+/* flush a progress line to disk. return 0 on success, -1 on failure */
+static int journal_sync(journal *jn)
+{
+	if(fflush(jn->file) || fsync(fileno(jn->file)) < 0)
+		return -1;
+	return 0;
+}
+
+/* write the journal of jn to path, including progress so far.
+ * the file stays open for progress lines.
+ * return 0 on success, -1 on failure */
+int journal_start(journal *jn, char *path)
+{
+	int i;
+	jn->file = fopen(path, "w");
+	if(jn->file == NULL)
+		return -1;
+	fprintf(jn->file, "%s\n%c %02X%02X%02X %08X %X %X\n", MAGIC, jn->op,
+	        jn->id[0], jn->id[1], jn->id[2], jn->crc, jn->addr, jn->size);
+	if(jn->op == 'w'){
+		fprintf(jn->file, "dirty %X ", jn->block);
+		for(i = 0; i < jn->block; i++)
+			fputc('0' + jn->dirty[i], jn->file);
+		fputc('\n', jn->file);
+		if(jn->has_head){
+			fprintf(jn->file, "head ");
+			put_hex(jn->file, jn->head, SECTOR);
+		}
+		if(jn->has_tail){
+			fprintf(jn->file, "tail ");
+			put_hex(jn->file, jn->tail, SECTOR);
+		}
+		fprintf(jn->file, "plan %d\n", jn->nplan);
+		for(i = 0; i < jn->nplan; i++)
+			fprintf(jn->file, "%d %X\n", jn->plan[i].type, jn->plan[i].addr);
+	}
+	if(jn->erased)
+		fprintf(jn->file, "erased %X\n", jn->erased);
+	if(jn->done)
+		fprintf(jn->file, "done %X\n", jn->done);
+	return journal_sync(jn);
+}
+
+/* record that erased operations of the plan are done */
+int journal_erased(journal *jn, int erased)
+{
+	jn->erased = erased;
+	if(jn->file == NULL)
+		return 0;
+	fprintf(jn->file, "erased %X\n", erased);
+	return journal_sync(jn);
+}
+
+/* record that done bytes are programmed or read */
+int journal_done(journal *jn, int done)
+{
+	jn->done = done;
+	if(jn->file == NULL)
+		return 0;
+	fprintf(jn->file, "done %X\n", done);
+	return journal_sync(jn);
+}
+
+/* close the journal, remove it if the job is finished.
+ * dirty and plan are freed */
+void journal_end(journal *jn, char *path, int finished)
+{
+	if(jn->file)
+		fclose(jn->file);
+	if(finished && path)
+		unlink(path);
+	free(jn->dirty);
+	free(jn->plan);
+	jn->file = NULL;
+	jn->dirty = NULL;
+	jn->plan = NULL;
+}
@@ -0,0 +1,27 @@
+/* progress of a write or read job, kept on disk so that it can be
+ * resumed after a failure */
+typedef struct {
+	FILE *file;
+	char op;            /* 'w' write, 'r' read */
+	unsigned char id[3];/* chip id */
+	unsigned int crc;   /* crc32 of the image, 0 for reads */
+	int addr;
+	int size;
+	int block;          /* sectors, write only */
+	char *dirty;        /* sector states, write only */
+	int has_head;       /* first and last sector are only partly */
+	int has_tail;       /* written, their old content is kept here */
+	char head[0x1000];
+	char tail[0x1000];
+	int nplan;
+	erase_op *plan;     /* erase plan, write only */
+	int erased;         /* erase operations done */
+	int done;           /* bytes programmed or read */
+} journal;
+
+int journal_load(journal *jn, char *path);
+int journal_match(journal *a, journal *b);
+int journal_start(journal *jn, char *path);
+int journal_erased(journal *jn, int erased);
+int journal_done(journal *jn, int done);
+void journal_end(journal *jn, char *path, int finished);
@@ -0,0 +1,364 @@
+/* Sparse images. Intel HEX, Motorola S-record and layout files are
+ * loaded into a list of regions, the chip is left alone between them.
+ *
+ * a layout file has one region per line, # starts a comment:
+ *
+ *   address file [file_offset [size]]
+ *
+ * without size the rest of the file is taken. relative paths start
+ * from the directory of the layout file. */
+#include "system.h"
+#include "chip.h"
+#include "layout.h"
+#include <ctype.h>
+#include <strings.h>
+
+#define LINE_SIZE 1024     /* longest line of any format */
+#define FILE_CHUNK 0x10000 /* bytes read from a layout's file at once */
+
+static const char *format_names[] = {
+	[F_BIN] = "bin", [F_HEX] = "hex", [F_SREC] = "srec", [F_LAYOUT] = "layout",
+};
+
+static const struct {
+	char *ext;
+	int format;
+} extensions[] = {
+	{".hex", F_HEX}, {".ihex", F_HEX}, {".ihx", F_HEX},
+	{".srec", F_SREC}, {".s19", F_SREC}, {".s28", F_SREC}, {".s37", F_SREC},
+	{".mot", F_SREC}, {".layout", F_LAYOUT},
+};
+
+/* format given by name, or else by the extension of path
+ * return F_*, -1 for an unknown name */
+int layout_format(char *path, char *name)
+{
+	char *ext = path ? strrchr(path, '.') : NULL;
+	int i;
+	if(name){
+		for(i = 0; i < (int)(sizeof(format_names) / sizeof(format_names[0])); i++)
+			if(!strcmp(name, format_names[i]))
+				return i;
+		return -1;
+	}
+	if(ext == NULL || strchr(ext, '/'))
+		return F_BIN;
+	for(i = 0; i < (int)(sizeof(extensions) / sizeof(extensions[0])); i++)
+		if(!strcasecmp(ext, extensions[i].ext))
+			return extensions[i].format;
+	return F_BIN;
+}
+
+/* append n bytes at addr, to the last region if they follow it
+ * return 0 on success, -1 on failure */
+static int add_data(layout *l, long addr, char *data, int n)
+{
+	region *r = l->n ? &l->r[l->n - 1] : NULL;
+	void *p;
+	int room;
+	if(n == 0)
+		return 0;
+	if(addr < 0 || addr + n > CHIP_SIZE_MAX){
+		fprintf(stderr, "Data at %lX is beyond the largest chip.\n", addr);
+		return -1;
+	}
+	if(r == NULL || r->addr + r->size != addr){
+		if(l->n == l->room){
+			room = l->room ? l->room * 2 : 16;
+			if((p = realloc(l->r, room * sizeof(region))) == NULL)
+				goto NoMem;
+			l->r = p;
+			l->room = room;
+		}
+		r = &l->r[l->n++];
+		r->addr = addr;
+		r->size = 0;
+		r->data = NULL;
+		l->data_room = 0;
+	}
+	if(r->size + n > l->data_room){
+		for(room = l->data_room ? l->data_room : 0x1000; room < r->size + n; room *= 2)
+			;
+		if((p = realloc(r->data, room)) == NULL)
+			goto NoMem;
+		r->data = p;
+		l->data_room = room;
+	}
+	memcpy(r->data + r->size, data, n);
+	r->size += n;
+	l->size += n;
+	return 0;
+NoMem:
+	fprintf(stderr, "Memory allocation failed.\n");
+	return -1;
+}
+
+/* the hex digit pairs of a record up to the end of line into buf
+ * return number of bytes, -1 if not hex */
+static int hex_bytes(char *s, unsigned char *buf)
+{
+	unsigned int v;
+	int n = 0;
+	while(*s && *s != '\r' && *s != '\n'){
+		if(!isxdigit((unsigned char)s[0]) || !isxdigit((unsigned char)s[1]) ||
+		   sscanf(s, "%2x", &v) != 1)
+			return -1;
+		buf[n++] = v;
+		s += 2;
+	}
+	return n;
+}
+
+static int blank_line(char *line)
+{
+	while(isspace((unsigned char)*line))
+		line++;
+	return *line == 0;
+}
+
+/* Intel HEX, data records with extended segment and linear addresses
+ * return 0 on success, -1 on failure */
+static int load_hex(layout *l, FILE *f, char *path, long base)
+{
+	char line[LINE_SIZE];
+	unsigned char b[LINE_SIZE / 2];
+	int i, n, sum, lineno = 0;
+	long upper = 0;
+	while(fgets(line, sizeof(line), f)){
+		lineno++;
+		if(blank_line(line))
+			continue;
+		if(line[0] != ':' || (n = hex_bytes(line + 1, b)) < 5 || n != b[0] + 5)
+			goto Bad;
+		for(i = sum = 0; i < n; i++)
+			sum += b[i];
+		if(sum & 0xFF)
+			goto Bad;
+		switch(b[3]){
+			case 0:
+				if(add_data(l, base + upper + (b[1] << 8 | b[2]), (char *)b + 4, b[0]) < 0)
+					return -1;
+				break;
+			case 1:
+				return 0;
+			case 2:
+			case 4:
+				if(b[0] != 2)
+					goto Bad;
+				upper = (long)(b[4] << 8 | b[5]) << (b[3] == 2 ? 4 : 16);
+				break;
+			case 3:
+			case 5:
+				/* start address, nothing to program */
+				break;
+			default:
+				goto Bad;
+		}
+	}
+	fprintf(stderr, "%s: no end of file record.\n", path);
+	return -1;
+Bad:
+	fprintf(stderr, "%s:%d: bad Intel HEX record.\n", path, lineno);
+	return -1;
+}
+
+/* Motorola S-record, S1 to S3 data with 2 to 4 address bytes
+ * return 0 on success, -1 on failure */
+static int load_srec(layout *l, FILE *f, char *path, long base)
+{
+	char line[LINE_SIZE];
+	unsigned char b[LINE_SIZE / 2];
+	int i, n, sum, type, alen, lineno = 0;
+	long addr;
+	while(fgets(line, sizeof(line), f)){
+		lineno++;
+		if(blank_line(line))
+			continue;
+		if(line[0] != 'S' || !isdigit((unsigned char)line[1]) ||
+		   (n = hex_bytes(line + 2, b)) < 3 || n != b[0] + 1)
+			goto Bad;
+		for(i = sum = 0; i < n; i++)
+			sum += b[i];
+		if((sum & 0xFF) != 0xFF)
+			goto Bad;
+		type = line[1] - '0';
+		switch(type){
+			case 1:
+			case 2:
+			case 3:
+				alen = type + 1;
+				if(n < alen + 2)
+					goto Bad;
+				for(addr = 0, i = 1; i <= alen; i++)
+					addr = addr << 8 | b[i];
+				if(add_data(l, base + addr, (char *)b + 1 + alen, n - alen - 2) < 0)
+					return -1;
+				break;
+			case 7:
+			case 8:
+			case 9:
+				return 0;
+			case 0:
+			case 5:
+			case 6:
+				/* header and record counts */
+				break;
+			default:
+				goto Bad;
+		}
+	}
+	fprintf(stderr, "%s: no termination record.\n", path);
+	return -1;
+Bad:
+	fprintf(stderr, "%s:%d: bad S-record.\n", path, lineno);
+	return -1;
+}
+
+/* size bytes of file from offset at addr, size -1 takes the rest
+ * return 0 on success, -1 on failure */
+static int load_file(layout *l, char *file, long addr, long offset, long size)
+{
+	char buf[FILE_CHUNK];
+	FILE *f = fopen(file, "r");
+	size_t n;
+	int result = 0;
+	if(f == NULL || fseek(f, offset, SEEK_SET)){
+		fprintf(stderr, "%s: %s\n", file, strerror(errno));
+		if(f)
+			fclose(f);
+		return -1;
+	}
+	while(size && result == 0){
+		n = size < 0 || size > FILE_CHUNK ? FILE_CHUNK : size;
+		if((n = fread(buf, 1, n, f)) == 0)
+			break;
+		result = add_data(l, addr, buf, n);
+		addr += n;
+		if(size > 0)
+			size -= n;
+	}
+	if(result == 0 && size > 0){
+		fprintf(stderr, "%s is too short.\n", file);
+		result = -1;
+	}
+	fclose(f);
+	return result;
+}
+
+/* layout file, one region of a binary file per line
+ * return 0 on success, -1 on failure */
+static int load_layout(layout *l, FILE *f, char *path, long base)
+{
+	char line[LINE_SIZE], file[LINE_SIZE], name[2 * LINE_SIZE], *p;
+	char *dir = strrchr(path, '/');
+	long addr, offset = 0, size = -1;
+	int k, lineno = 0;
+	while(fgets(line, sizeof(line), f)){
+		lineno++;
+		if((p = strchr(line, '#')) != NULL)
+			*p = 0;
+		k = sscanf(line, "%li %1023s %li %li", &addr, file, &offset, &size);
+		if(k <= 0)
+			continue;
+		if(k < 2 || addr < 0 || (k > 2 && offset < 0) || (k > 3 && size < 0)){
+			fprintf(stderr, "%s:%d: expected address file [offset [size]].\n",
+			        path, lineno);
+			return -1;
+		}
+		if(file[0] != '/' && dir)
+			snprintf(name, sizeof(name), "%.*s/%s", (int)(dir - path), path, file);
+		else
+			snprintf(name, sizeof(name), "%s", file);
+		if(load_file(l, name, base + addr, k > 2 ? offset : 0, k > 3 ? size : -1) < 0)
+			return -1;
+		/* give back what the last region has spare */
+		if(l->n && (p = realloc(l->r[l->n - 1].data, l->r[l->n - 1].size)) != NULL){
+			l->r[l->n - 1].data = p;
+			l->data_room = l->r[l->n - 1].size;
+		}
+	}
+	return 0;
+}
+
+static int by_addr(const void *a, const void *b)
+{
+	return ((region *)a)->addr - ((region *)b)->addr;
+}
+
+/* sort the regions, join those that touch and refuse overlaps
+ * return 0 on success, -1 on failure */
+static int layout_sort(layout *l, char *path)
+{
+	region *r, *last;
+	char *p;
+	int i, n = 0;
+	qsort(l->r, l->n, sizeof(region), by_addr);
+	for(i = 1; i < l->n; i++)
+		if(l->r[i].addr < l->r[i - 1].addr + l->r[i - 1].size){
+			fprintf(stderr, "%s: data at %X overlaps data before it.\n",
+			        path, l->r[i].addr);
+			return -1;
+		}
+	for(i = 0; i < l->n; i++){
+		r = &l->r[i];
+		last = n ? &l->r[n - 1] : NULL;
+		if(last == NULL || r->addr != last->addr + last->size){
+			l->r[n++] = *r;
+			continue;
+		}
+		if((p = realloc(last->data, last->size + r->size)) == NULL){
+			fprintf(stderr, "Memory allocation failed.\n");
+			/* keep the regions not joined yet for layout_free() */
+			memmove(&l->r[n], r, (l->n - i) * sizeof(region));
+			l->n = n + l->n - i;
+			return -1;
+		}
+		memcpy(p + last->size, r->data, r->size);
+		last->data = p;
+		last->size += r->size;
+		free(r->data);
+	}
+	l->n = n;
+	return 0;
+}
+
+/* load the sparse image at path in format, "-" is stdin.
+ * addresses are moved up by base.
+ * return 0 on success, -1 on failure */
+int layout_load(layout *l, char *path, int format, int base)
+{
+	FILE *f;
+	int result;
+	memset(l, 0, sizeof(layout));
+	f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if(f == NULL){
+		fprintf(stderr,"Failed to open file, %s\n", strerror(errno));
+		return -1;
+	}
+	if(format == F_HEX)
+		result = load_hex(l, f, path, base);
+	else if(format == F_SREC)
+		result = load_srec(l, f, path, base);
+	else
+		result = load_layout(l, f, path, base);
+	if(f != stdin)
+		fclose(f);
+	if(result == 0)
+		result = layout_sort(l, path);
+	if(result == 0 && l->n == 0){
+		fprintf(stderr, "%s holds no data.\n", path);
+		result = -1;
+	}
+	if(result < 0)
+		layout_free(l);
+	return result;
+}
+
+void layout_free(layout *l)
+{
+	int i;
+	for(i = 0; i < l->n; i++)
+		free(l->r[i].data);
+	free(l->r);
+	memset(l, 0, sizeof(layout));
+}
@@ -0,0 +1,22 @@
+/* input formats of -f */
+enum {F_BIN, F_HEX, F_SREC, F_LAYOUT};
+
+/* one contiguous piece of a sparse image */
+typedef struct {
+	int addr;
+	int size;
+	char *data;
+} region;
+
+/* regions of a sparse image, sorted by address, apart from each other */
+typedef struct {
+	region *r;
+	int n;
+	int room;          /* regions allocated */
+	int data_room;     /* bytes allocated for the data of the last region */
+	int size;          /* bytes in all regions */
+} layout;
+
+int layout_format(char *path, char *name);
+int layout_load(layout *l, char *path, int format, int base);
+void layout_free(layout *l);
@@ -0,0 +1,708 @@
+/* libspiflash, flash operations on a context and background jobs.
+ * built on the command layer, which is driven by one thread per port */
+#include "system.h"
+#include "serial_pc.h"
+#include "chip.h"
+#include "metrics.h"
+#include "command.h"
+#include "erase.h"
+#include "crc.h"
+#include "libspiflash.h"
+#include <pthread.h>
+#include <poll.h>
+
+#define RD_BLOCK 0xffff    /* max answer of one read */
+#define PROG_UNIT 0x10000  /* bytes queued between status checks */
+#define ZIP_PAGES 16       /* max pages per compressed frame */
+#define REPAIRS 2          /* tries to fix a range that fails its check */
+#define FLASH_3B 0x1000000 /* reach of 3 byte addresses */
+
+struct sf_ctx {
+	int fd;
+	int baud;
+	int compress;
+	int has_id;
+	char id[3];
+	int uid_len;       /* -1 until read */
+	char uid[UID_MAX];
+	int error_addr;    /* where the last erase or program failed */
+	sf_progress_cb progress;
+	void *arg;
+	sf_job *job;       /* running in the background */
+	int result;        /* of the last background job */
+	pthread_t thread;
+	int event[2];      /* pipe, a byte is written when the job ends */
+};
+
+static const char *errors[] = {
+	[-SF_OK] = "Success",
+	[-SF_ERR_PORT] = "Cannot set up port",
+	[-SF_ERR_LINK] = "Programmer does not answer",
+	[-SF_ERR_WREN] = "Cannot enable write",
+	[-SF_ERR_ERASE] = "Erase failed",
+	[-SF_ERR_PROG] = "Page write failed",
+	[-SF_ERR_ARG] = "Invalid argument",
+	[-SF_ERR_NOMEM] = "Memory allocation failed",
+	[-SF_ERR_BUSY] = "Job in progress",
+	[-SF_ERR_VERIFY] = "Content differs",
+	[-SF_ERR_NOCHIP] = "No chip found",
+	[-SF_ERR_CANCEL] = "Cancelled",
+};
+
+const char *sf_strerror(int err)
+{
+	if(err > 0)
+		err = 0;
+	if(-err >= (int)(sizeof(errors) / sizeof(errors[0])))
+		return "Unknown error";
+	return errors[-err];
+}
+
+static void progress(sf_ctx *ctx, int op, int done, int total)
+{
+	if(ctx->progress)
+		ctx->progress(ctx->arg, op, done, total);
+}
+
+/* return 1 if the range is not within the chip, or within what its
+ * addresses reach if the size is unknown */
+static int bad_range(sf_ctx *ctx, int addr, int size)
+{
+	chip_info *chip = cmd_chip(ctx->fd);
+	int end = chip->size ? chip->size : chip->addr_bytes == 4 ? CHIP_SIZE_MAX : FLASH_3B;
+	return addr < 0 || size < 0 || addr > end - size;
+}
+
+/* open the programmer on port, negotiate the protocol and a speed up
+ * to max_baud, 0 keeps the default. the chip is identified, a failure
+ * there is not fatal, see sf_chip_id().
+ * return new context, NULL on failure with the reason in err */
+sf_ctx *sf_open(char *port, int max_baud, int flags, int *err)
+{
+	sf_ctx *ctx = calloc(1, sizeof(sf_ctx));
+	int result = SF_ERR_PORT;
+	if(ctx == NULL){
+		result = SF_ERR_NOMEM;
+		goto Fail;
+	}
+	ctx->event[0] = ctx->event[1] = -1;
+	ctx->uid_len = -1;
+	ctx->fd = serial_open(port);
+	if(ctx->fd < 0 || serial_set(ctx->fd, BAUD) < 0 || pipe(ctx->event) < 0)
+		goto Fail;
+	fcntl(ctx->event[0], F_SETFL, O_NONBLOCK);
+	serial_flush(ctx->fd, TCIOFLUSH);
+	cmd_init(ctx->fd);
+	ctx->baud = max_baud ? cmd_speed(ctx->fd, max_baud) : 115200;
+	ctx->compress = (flags & SF_ZIP) && cmd_compress(ctx->fd, 1);
+	ctx->has_id = RDID(ctx->fd, ctx->id) == 0;
+	chip_probe(ctx->fd, ctx->id, ctx->has_id, cmd_chip(ctx->fd));
+	if(cmd_chip(ctx->fd)->en4b && EN4B(ctx->fd, 1) < 0){
+		result = SF_ERR_LINK;
+		goto Fail;
+	}
+	/* build the crc tables before jobs share them */
+	crc32(0, NULL, 0);
+	if(err)
+		*err = SF_OK;
+	return ctx;
+Fail:
+	if(err)
+		*err = result;
+	if(ctx){
+		if(ctx->fd >= 0){
+			cmd_close(ctx->fd);
+			close(ctx->fd);
+		}
+		if(ctx->event[0] >= 0){
+			close(ctx->event[0]);
+			close(ctx->event[1]);
+		}
+		free(ctx);
+	}
+	return NULL;
+}
+
+/* wait for the background job and close the programmer */
+void sf_close(sf_ctx *ctx)
+{
+	if(ctx == NULL)
+		return;
+	sf_wait(ctx);
+	/* leave the chip in the mode others expect */
+	if(cmd_chip(ctx->fd)->en4b)
+		EN4B(ctx->fd, 0);
+	cmd_close(ctx->fd);
+	close(ctx->fd);
+	close(ctx->event[0]);
+	close(ctx->event[1]);
+	free(ctx);
+}
+
+/* return protocol version in use */
+int sf_version(sf_ctx *ctx)
+{
+	return cmd_version(ctx->fd);
+}
+
+/* return baud rate in use */
+int sf_baud(sf_ctx *ctx)
+{
+	return ctx->baud;
+}
+
+/* return 1 if data is compressed on the link */
+int sf_compress(sf_ctx *ctx)
+{
+	return ctx->compress;
+}
+
+/* copy the 3 byte chip id to id
+ * return 0 on success, SF_ERR_LINK if the programmer did not answer,
+ * SF_ERR_NOCHIP if no chip did, id is copied then */
+int sf_chip_id(sf_ctx *ctx, char *id)
+{
+	memcpy(id, ctx->id, 3);
+	if(!ctx->has_id)
+		return SF_ERR_LINK;
+	if(!memcmp(id, "\xFF\xFF\xFF", 3) || !memcmp(id, "\0\0\0", 3))
+		return SF_ERR_NOCHIP;
+	return 0;
+}
+
+/* copy the factory unique ID of the chip to uid, UID_MAX bytes at most.
+ * it is read on first use.
+ * return its length, 0 if the chip has none, SF_ERR_* on failure */
+int sf_unique_id(sf_ctx *ctx, char *uid)
+{
+	if(ctx->job)
+		return SF_ERR_BUSY;
+	if(ctx->uid_len < 0)
+		ctx->uid_len = ctx->has_id ? chip_unique_id(ctx->fd, ctx->id, ctx->uid) : 0;
+	memcpy(uid, ctx->uid, ctx->uid_len);
+	return ctx->uid_len;
+}
+
+/* return 1 if the programmer computes sector checksums itself,
+ * 0 if sf_crc() reads the sectors back */
+int sf_has_crc(sf_ctx *ctx)
+{
+	return cmd_has_op(ctx->fd, OP_CRC);
+}
+
+/* select the chips of mask on a programmer with several chip selects,
+ * bit n is chip select n. writes and erases go to all of them at once,
+ * reads, crcs and so verifies to the lowest one, whose ID sf_chip_id()
+ * returns from now on. all chips are taken to be the same part.
+ * a chip that fails write enable or a page program is dropped by the
+ * programmer and the others go on, the next call reports it.
+ * return mask of the chips dropped since the last call, SF_ERR_ARG if
+ * the programmer cannot select mask, SF_ERR_* on failure */
+int sf_select(sf_ctx *ctx, int mask)
+{
+	char old[3];
+	int n, failed, had = ctx->has_id;
+	if(ctx->job)
+		return SF_ERR_BUSY;
+	if(!cmd_has_op(ctx->fd, OP_CS))
+		return mask == 1 ? 0 : SF_ERR_ARG;
+	if((n = CS(ctx->fd, mask, &failed)) < 0)
+		return SF_ERR_LINK;
+	if(n != mask)
+		return SF_ERR_ARG;
+	memcpy(old, ctx->id, 3);
+	ctx->has_id = RDID(ctx->fd, ctx->id) == 0;
+	ctx->uid_len = -1;
+	if(ctx->has_id != had || memcmp(old, ctx->id, 3))
+		chip_probe(ctx->fd, ctx->id, ctx->has_id, cmd_chip(ctx->fd));
+	/* chips selected for the first time enter the mode as well */
+	if(cmd_chip(ctx->fd)->en4b && EN4B(ctx->fd, 1) < 0)
+		return SF_ERR_LINK;
+	return failed;
+}
+
+/* return chip size in bytes, 0 if unknown */
+int sf_chip_size(sf_ctx *ctx)
+{
+	return cmd_chip(ctx->fd)->size;
+}
+
+/* return parameters of the chip, they may be changed before use */
+chip_info *sf_chip(sf_ctx *ctx)
+{
+	return cmd_chip(ctx->fd);
+}
+
+/* return address of the operation that failed last */
+int sf_error_addr(sf_ctx *ctx)
+{
+	return ctx->error_addr;
+}
+
+/* copy the command counters of the port since it was opened to m,
+ * not to be called while a background job runs */
+void sf_metrics(sf_ctx *ctx, metrics *m)
+{
+	metrics *l = cmd_metrics(ctx->fd);
+	if(l)
+		*m = *l;
+	else
+		memset(m, 0, sizeof(*m));
+}
+
+/* report progress of each call to progress, NULL turns it off.
+ * during a background job it is called from the job's thread */
+void sf_set_progress(sf_ctx *ctx, sf_progress_cb progress, void *arg)
+{
+	ctx->progress = progress;
+	ctx->arg = arg;
+}
+
+static int read_range(sf_ctx *ctx, char *buf, int addr, int size)
+{
+	int i, n;
+	if(bad_range(ctx, addr, size))
+		return SF_ERR_ARG;
+	for(i = 0; i < size; i += n){
+		n = size - i < RD_BLOCK ? size - i : RD_BLOCK;
+		if(RD(ctx->fd, buf + i, addr + i, n) < 0)
+			return SF_ERR_LINK;
+		progress(ctx, SF_OP_READ, i + n, size);
+	}
+	return 0;
+}
+
+static int erase_ops(sf_ctx *ctx, erase_op *plan, int n)
+{
+	int i, result = 0;
+	for(i = 0; i < n; i++){
+		ctx->error_addr = plan[i].addr;
+		if(WREN(ctx->fd) < 0)
+			return SF_ERR_WREN;
+		switch(plan[i].type){
+			case E_SE:
+				result = SE(ctx->fd, plan[i].addr);
+				break;
+			case E_BE32:
+				result = BE32(ctx->fd, plan[i].addr);
+				break;
+			case E_BE:
+				result = BE(ctx->fd, plan[i].addr);
+				break;
+			case E_CE:
+				result = CE(ctx->fd);
+				break;
+		}
+		if(result)
+			return SF_ERR_ERASE;
+		progress(ctx, SF_OP_ERASE, i + 1, n);
+	}
+	return 0;
+}
+
+static int erase_range(sf_ctx *ctx, int addr, int size)
+{
+	int n = size / SF_SECTOR, result = SF_ERR_NOMEM;
+	char *sectors;
+	erase_op *plan;
+	if(bad_range(ctx, addr, size) || (addr | size) & (SF_SECTOR - 1))
+		return SF_ERR_ARG;
+	if(n == 0)
+		return 0;
+	sectors = malloc(n);
+	plan = malloc(n * sizeof(erase_op));
+	if(sectors && plan){
+		memset(sectors, S_ERASE, n);
+		result = erase_ops(ctx, plan, erase_plan(cmd_chip(ctx->fd), sectors, addr, n, plan));
+	}
+	free(sectors);
+	free(plan);
+	return result;
+}
+
+static int erase_chip(sf_ctx *ctx)
+{
+	ctx->error_addr = 0;
+	if(WREN(ctx->fd) < 0)
+		return SF_ERR_WREN;
+	if(CE(ctx->fd) < 0)
+		return SF_ERR_ERASE;
+	progress(ctx, SF_OP_CHIP_ERASE, 1, 1);
+	return 0;
+}
+
+/* return 1 if all n bytes are 0xFF, which is the erased state */
+static int is_blank(char *data, int n)
+{
+	int i;
+	for(i = 0; i < n; i++)
+		if((unsigned char)data[i] != 0xFF)
+			return 0;
+	return 1;
+}
+
+/* bytes sent at a time, a frame never crosses a page of the chip */
+static int prog_page(sf_ctx *ctx)
+{
+	int page = cmd_chip(ctx->fd)->page;
+	return page < SF_PAGE ? page : SF_PAGE;
+}
+
+/* program [addr, addr + size) from data one page at a time, each page
+ * is write enabled, programmed and polled from here */
+static int program_v1(sf_ctx *ctx, char *data, int addr, int size)
+{
+	int i, n, page = prog_page(ctx);
+	for(i = 0; i < size; i += n){
+		n = page - ((addr + i) & (page - 1));
+		n = n < size - i ? n : size - i;
+		if(is_blank(data + i, n))
+			continue;
+		ctx->error_addr = addr + i;
+		if(WREN(ctx->fd) < 0)
+			return SF_ERR_WREN;
+		if(PP(ctx->fd, data + i, addr + i, n) < 0)
+			return SF_ERR_PROG;
+		progress(ctx, SF_OP_PROGRAM, i + n, size);
+	}
+	return 0;
+}
+
+static int program(sf_ctx *ctx, char *data, int addr, int size, int check);
+
+/* return 1 if the chip content can become data by programming alone,
+ * which only clears bits */
+static int programmable(char *chip, char *data, int n)
+{
+	int i;
+	for(i = 0; i < n; i++)
+		if((chip[i] & data[i]) != data[i])
+			return 0;
+	return 1;
+}
+
+/* read [addr, addr + size) back and fix what differs from data, sector
+ * by sector. pages are programmed again if their bits can still be
+ * cleared, otherwise the sector is read whole, erased and written again.
+ * return 0 once the range holds data, SF_ERR_* on failure */
+static int repair(sf_ctx *ctx, char *data, int addr, int size)
+{
+	char chip[SF_SECTOR];
+	int i, j, n, m, sector, try, bad = 1, result, page = prog_page(ctx);
+	for(try = 0; bad && try <= REPAIRS; try++){
+		for(i = 0, bad = 0; i < size; i += n){
+			n = SF_SECTOR - ((addr + i) & (SF_SECTOR - 1));
+			n = n < size - i ? n : size - i;
+			if(RD(ctx->fd, chip, addr + i, n) < 0)
+				return SF_ERR_LINK;
+			if(!memcmp(chip, data + i, n))
+				continue;
+			bad = 1;
+			ctx->error_addr = addr + i;
+			if(try == REPAIRS)
+				return SF_ERR_VERIFY;
+			if(programmable(chip, data + i, n)){
+				for(j = 0; j < n; j += m){
+					m = page - ((addr + i + j) & (page - 1));
+					m = m < n - j ? m : n - j;
+					if(memcmp(chip + j, data + i + j, m) &&
+					   (result = program(ctx, data + i + j, addr + i + j, m, 0)) < 0)
+						return result;
+				}
+				continue;
+			}
+			sector = (addr + i) & ~(SF_SECTOR - 1);
+			if(RD(ctx->fd, chip, sector, SF_SECTOR) < 0)
+				return SF_ERR_LINK;
+			memcpy(chip + addr + i - sector, data + i, n);
+			if((result = erase_range(ctx, sector, SF_SECTOR)) < 0 ||
+			   (result = program(ctx, chip, sector, SF_SECTOR, 0)) < 0)
+				return result;
+		}
+	}
+	return 0;
+}
+
+/* program [addr, addr + size) from data. with check each piece of
+ * a sector or less is checked by the programmer's crc32 right after
+ * its pages, while the next pages are on the way, and repaired if
+ * it differs. without the crc operation pieces are read back */
+static int program(sf_ctx *ctx, char *data, int addr, int size, int check)
+{
+	char status[PROG_UNIT / PAGE_MIN];
+	int where[PROG_UNIT / PAGE_MIN];
+	unsigned char sums[PROG_UNIT / SF_SECTOR * 4], *sum;
+	int piece[PROG_UNIT / SF_SECTOR + 1];
+	int i, j, k, n, end, frames, pieces, result, zip, page = prog_page(ctx);
+	int crc = check && cmd_has_op(ctx->fd, OP_CRC);
+	if(bad_range(ctx, addr, size))
+		return SF_ERR_ARG;
+	if(!cmd_has_op(ctx->fd, OP_PROG)){
+		result = program_v1(ctx, data, addr, size);
+		return result < 0 || !check ? result : repair(ctx, data, addr, size);
+	}
+	/* the programmer splits pages of SF_PAGE on its own */
+	zip = ctx->compress && cmd_has_op(ctx->fd, OP_PROGZ) && page == SF_PAGE;
+	/* pages of a unit go out back to back, the programmer does the rest */
+	for(i = 0; i < size; i = end){
+		end = ((addr + i) & ~(PROG_UNIT - 1)) + PROG_UNIT - addr;
+		end = end < size ? end : size;
+		piece[0] = i;
+		for(j = i, frames = pieces = 0; j < end; j += n){
+			n = page - ((addr + j) & (page - 1));
+			n = n < end - j ? n : end - j;
+			if(is_blank(data + j, n))
+				;
+			else if(!zip || n < SF_PAGE){
+				where[frames] = addr + j;
+				PR(ctx->fd, data + j, addr + j, n, status + frames++);
+			}
+			else{
+				/* as many following pages as still encode into one frame */
+				for(k = 1; k < ZIP_PAGES && j + (k + 1) * SF_PAGE <= end; k++)
+					;
+				while(k > 1 && PRZ(ctx->fd, data + j, addr + j, k * SF_PAGE, status + frames) < 0)
+					k--;
+				if(k == 1)
+					PRZ(ctx->fd, data + j, addr + j, SF_PAGE, status + frames);
+				where[frames++] = addr + j;
+				n = k * SF_PAGE;
+			}
+			/* a piece ends with a sector or the unit */
+			if(check && (((addr + j + n) & (SF_SECTOR - 1)) == 0 || j + n == end)){
+				sum = sums + pieces * 4;
+				memset(sum, 0, 4);
+				if(crc)
+					CRCQ(ctx->fd, addr + piece[pieces], j + n - piece[pieces],
+					     j + n - piece[pieces], (char *)sum);
+				piece[++pieces] = j + n;
+			}
+		}
+		cmd_sync(ctx->fd);
+		for(k = 0; k < frames && status[k] == PR_OK; k++)
+			;
+		if(k < frames){
+			ctx->error_addr = where[k];
+			if(status[k] == PR_WREN)
+				return SF_ERR_WREN;
+			/* frames that got no answer keep PR_ARG */
+			return status[k] == PR_TIMEOUT ? SF_ERR_PROG : SF_ERR_LINK;
+		}
+		for(k = 0; k < pieces; k++){
+			sum = sums + k * 4;
+			n = piece[k + 1] - piece[k];
+			if(crc && crc32(0, data + piece[k], n) ==
+			   (sum[0] | sum[1] << 8 | sum[2] << 16 | (unsigned int)sum[3] << 24))
+				continue;
+			if((result = repair(ctx, data + piece[k], addr + piece[k], n)) < 0)
+				return result;
+		}
+		progress(ctx, SF_OP_PROGRAM, end, size);
+	}
+	return 0;
+}
+
+static int crc_range(sf_ctx *ctx, int addr, int size, unsigned int *crcs)
+{
+	char buf[SF_SECTOR];
+	int i, n, part;
+	if(bad_range(ctx, addr, size))
+		return SF_ERR_ARG;
+	if(cmd_has_op(ctx->fd, OP_CRC)){
+		for(i = 0; i < size; i += CRC_SPAN){
+			part = size - i < CRC_SPAN ? size - i : CRC_SPAN;
+			if(CRC(ctx->fd, addr + i, part, SF_SECTOR, crcs + i / SF_SECTOR) < 0)
+				return SF_ERR_LINK;
+		}
+		return 0;
+	}
+	for(i = 0; i < size; i += SF_SECTOR){
+		n = size - i < SF_SECTOR ? size - i : SF_SECTOR;
+		if(RD(ctx->fd, buf, addr + i, n) < 0)
+			return SF_ERR_LINK;
+		crcs[i / SF_SECTOR] = crc32(0, buf, n);
+	}
+	return 0;
+}
+
+static int verify(sf_ctx *ctx, char *data, int addr, int size, sf_diff_cb diff, void *arg)
+{
+	char buf[SF_SECTOR];
+	int i, j, n, bad, count = 0, block = (size + SF_SECTOR - 1) / SF_SECTOR;
+	unsigned int *crcs;
+	if(bad_range(ctx, addr, size))
+		return SF_ERR_ARG;
+	if(block == 0)
+		return 0;
+	crcs = malloc(block * sizeof(unsigned int));
+	if(crcs == NULL)
+		return SF_ERR_NOMEM;
+	if((count = crc_range(ctx, addr, size, crcs)) < 0)
+		goto Done;
+	for(i = 0; i < size; i += n){
+		n = size - i < SF_SECTOR ? size - i : SF_SECTOR;
+		if(crcs[i / SF_SECTOR] != crc32(0, data + i, n)){
+			if(RD(ctx->fd, buf, addr + i, n) < 0){
+				count = SF_ERR_LINK;
+				goto Done;
+			}
+			for(j = 0, bad = 0; j < n; j++)
+				bad += buf[j] != data[i + j];
+			if(bad && diff)
+				diff(arg, addr + i, buf, data + i, n);
+			count += bad;
+		}
+		progress(ctx, SF_OP_VERIFY, i + n, size);
+	}
+Done:
+	free(crcs);
+	return count;
+}
+
+/* read size bytes at addr into buf
+ * return 0 on success, SF_ERR_* on failure */
+int sf_read(sf_ctx *ctx, char *buf, int addr, int size)
+{
+	return ctx->job ? SF_ERR_BUSY : read_range(ctx, buf, addr, size);
+}
+
+/* erase the sector aligned range [addr, addr + size) with the fewest
+ * and largest erase operations that fit.
+ * return 0 on success, SF_ERR_* on failure */
+int sf_erase(sf_ctx *ctx, int addr, int size)
+{
+	return ctx->job ? SF_ERR_BUSY : erase_range(ctx, addr, size);
+}
+
+/* run n planned erase operations, see erase_plan()
+ * return 0 on success, SF_ERR_* on failure */
+int sf_erase_ops(sf_ctx *ctx, erase_op *plan, int n)
+{
+	return ctx->job ? SF_ERR_BUSY : erase_ops(ctx, plan, n);
+}
+
+/* erase the whole chip
+ * return 0 on success, SF_ERR_* on failure */
+int sf_erase_chip(sf_ctx *ctx)
+{
+	return ctx->job ? SF_ERR_BUSY : erase_chip(ctx);
+}
+
+/* program size bytes of data at addr, which must be erased.
+ * pages that stay blank are skipped.
+ * return 0 on success, SF_ERR_* on failure */
+int sf_program(sf_ctx *ctx, char *data, int addr, int size)
+{
+	return ctx->job ? SF_ERR_BUSY : program(ctx, data, addr, size, 0);
+}
+
+/* sf_program(), each sector is checked while the next one is sent.
+ * pages that did not take are programmed again, after erasing their
+ * sector if they must.
+ * return 0 on success, SF_ERR_VERIFY if the content still differs
+ * after REPAIRS tries, SF_ERR_* on other failures */
+int sf_program_verify(sf_ctx *ctx, char *data, int addr, int size)
+{
+	return ctx->job ? SF_ERR_BUSY : program(ctx, data, addr, size, 1);
+}
+
+/* crc32 of each SF_SECTOR of size bytes at addr, the last one may be
+ * shorter. computed on the programmer if it can, otherwise read back.
+ * return 0 on success, SF_ERR_* on failure */
+int sf_crc(sf_ctx *ctx, int addr, int size, unsigned int *crcs)
+{
+	return ctx->job ? SF_ERR_BUSY : crc_range(ctx, addr, size, crcs);
+}
+
+/* compare size bytes of data with the chip at addr by sector crc,
+ * sectors that differ are read back and passed to diff if not NULL.
+ * return number of differing bytes, SF_ERR_* on failure */
+int sf_verify(sf_ctx *ctx, char *data, int addr, int size, sf_diff_cb diff, void *arg)
+{
+	return ctx->job ? SF_ERR_BUSY : verify(ctx, data, addr, size, diff, arg);
+}
+
+static void *job_thread(void *arg)
+{
+	sf_ctx *ctx = arg;
+	sf_job *job = ctx->job;
+	switch(job->op){
+		case SF_OP_READ:
+			job->result = read_range(ctx, job->data, job->addr, job->size);
+			break;
+		case SF_OP_ERASE:
+			job->result = erase_range(ctx, job->addr, job->size);
+			break;
+		case SF_OP_CHIP_ERASE:
+			job->result = erase_chip(ctx);
+			break;
+		case SF_OP_PROGRAM:
+			job->result = program(ctx, job->data, job->addr, job->size, 0);
+			break;
+		case SF_OP_PROGRAM_VERIFY:
+			job->result = program(ctx, job->data, job->addr, job->size, 1);
+			break;
+		case SF_OP_VERIFY:
+			job->result = verify(ctx, job->data, job->addr, job->size, job->diff, job->arg);
+			break;
+		default:
+			job->result = SF_ERR_ARG;
+	}
+	/* wakes up sf_poll() and whoever waits on sf_poll_fd() */
+	while(write(ctx->event[1], "", 1) < 0 && errno == EINTR)
+		;
+	return NULL;
+}
+
+/* start job in the background, the context is busy until sf_poll() or
+ * sf_wait() finds it done and calls job->done from the caller's thread.
+ * job->arg is passed to job->diff and job->done.
+ * return 0 if started, SF_ERR_* on failure */
+int sf_submit(sf_ctx *ctx, sf_job *job)
+{
+	if(ctx->job)
+		return SF_ERR_BUSY;
+	ctx->job = job;
+	if(pthread_create(&ctx->thread, NULL, job_thread, ctx) != 0){
+		ctx->job = NULL;
+		return SF_ERR_NOMEM;
+	}
+	return 0;
+}
+
+/* return a descriptor that becomes readable when the background job
+ * ends, for poll() over many contexts */
+int sf_poll_fd(sf_ctx *ctx)
+{
+	return ctx->event[0];
+}
+
+/* finish the background job if it has ended, never blocks
+ * return 1 while a job is running, 0 otherwise */
+int sf_poll(sf_ctx *ctx)
+{
+	sf_job *job = ctx->job;
+	char c;
+	if(job == NULL)
+		return 0;
+	if(read(ctx->event[0], &c, 1) != 1)
+		return 1;
+	pthread_join(ctx->thread, NULL);
+	ctx->job = NULL;
+	ctx->result = job->result;
+	if(job->done)
+		job->done(job, job->arg);
+	return 0;
+}
+
+/* block until no background job runs, also those started by done
+ * return result of the last one, 0 if there was none */
+int sf_wait(sf_ctx *ctx)
+{
+	struct pollfd p = {ctx->event[0], POLLIN, 0};
+	if(ctx->job == NULL)
+		return 0;
+	while(sf_poll(ctx) || ctx->job)
+		poll(&p, 1, -1);
+	return ctx->result;
+}
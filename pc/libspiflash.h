@@ -0,0 +1,78 @@
+/* libspiflash, read and write 25 series flash through the programmer.
+ * a context holds the port, its protocol state, operation timings and
+ * the chip geometry. data is read into and programmed from caller
+ * buffers, which are used in place. needs chip.h, metrics.h and erase.h */
+
+#define SF_PAGE   0x100    /* largest program page sent at once */
+#define SF_SECTOR 0x1000   /* smallest erase, also the crc block */
+
+/* error codes, calls return 0 or more on success */
+#define SF_OK        0
+#define SF_ERR_PORT  -1    /* cannot open or set up the port */
+#define SF_ERR_LINK  -2    /* programmer does not answer */
+#define SF_ERR_WREN  -3    /* write enable latch not set */
+#define SF_ERR_ERASE -4    /* erase did not complete */
+#define SF_ERR_PROG  -5    /* page program did not complete */
+#define SF_ERR_ARG   -6    /* bad address, size or alignment */
+#define SF_ERR_NOMEM -7
+#define SF_ERR_BUSY  -8    /* a job is running on the context */
+#define SF_ERR_VERIFY -9   /* content differs */
+#define SF_ERR_NOCHIP -10  /* no chip answers, its ID is all 0 or FF */
+#define SF_ERR_CANCEL -11  /* dropped before it ran */
+
+/* flags of sf_open() */
+#define SF_ZIP 0x01        /* compress data on the link if supported */
+
+/* operations, for progress callbacks and jobs */
+enum {SF_OP_READ, SF_OP_ERASE, SF_OP_CHIP_ERASE, SF_OP_PROGRAM, SF_OP_VERIFY,
+      SF_OP_PROGRAM_VERIFY};
+
+typedef struct sf_ctx sf_ctx;
+
+/* done of total units of op finished, bytes or erase operations */
+typedef void (*sf_progress_cb)(void *arg, int op, int done, int total);
+/* n bytes at addr differ, chip holds the content read back */
+typedef void (*sf_diff_cb)(void *arg, int addr, char *chip, char *data, int n);
+
+/* an operation run in the background, owned by the caller and
+ * left untouched until done is called */
+typedef struct sf_job {
+	int op;
+	char *data;        /* buffer to read into or to program and verify */
+	int addr;
+	int size;
+	sf_diff_cb diff;   /* verify only, may be NULL */
+	void (*done)(struct sf_job *job, void *arg);
+	void *arg;
+	int result;        /* return value of the call, set before done */
+} sf_job;
+
+sf_ctx *sf_open(char *port, int max_baud, int flags, int *err);
+void sf_close(sf_ctx *ctx);
+const char *sf_strerror(int err);
+int sf_version(sf_ctx *ctx);
+int sf_baud(sf_ctx *ctx);
+int sf_compress(sf_ctx *ctx);
+int sf_chip_id(sf_ctx *ctx, char *id);
+int sf_unique_id(sf_ctx *ctx, char *uid);
+int sf_has_crc(sf_ctx *ctx);
+int sf_select(sf_ctx *ctx, int mask);
+int sf_chip_size(sf_ctx *ctx);
+chip_info *sf_chip(sf_ctx *ctx);
+int sf_error_addr(sf_ctx *ctx);
+void sf_metrics(sf_ctx *ctx, metrics *m);
+void sf_set_progress(sf_ctx *ctx, sf_progress_cb progress, void *arg);
+
+int sf_read(sf_ctx *ctx, char *buf, int addr, int size);
+int sf_erase(sf_ctx *ctx, int addr, int size);
+int sf_erase_ops(sf_ctx *ctx, erase_op *plan, int n);
+int sf_erase_chip(sf_ctx *ctx);
+int sf_program(sf_ctx *ctx, char *data, int addr, int size);
+int sf_program_verify(sf_ctx *ctx, char *data, int addr, int size);
+int sf_crc(sf_ctx *ctx, int addr, int size, unsigned int *crcs);
+int sf_verify(sf_ctx *ctx, char *data, int addr, int size, sf_diff_cb diff, void *arg);
+
+int sf_submit(sf_ctx *ctx, sf_job *job);
+int sf_poll_fd(sf_ctx *ctx);
+int sf_poll(sf_ctx *ctx);
+int sf_wait(sf_ctx *ctx);
@@ -0,0 +1,91 @@
+/* Command metrics of a port and their JSON form */
+#include "system.h"
+#include "chip.h"
+#include "metrics.h"
+
+const char *metrics_names[K_COUNT] = {
+	"read", "pp", "se", "be32", "be", "ce", "rdsr", "wren", "wrdi",
+	"rdid", "sfdp", "en4b", "spi", "prog", "wait", "baud", "rdz",
+	"progz", "crc",
+};
+
+static const char *busy_names[T_COUNT] = {"pp", "se", "be32", "be", "ce"};
+
+/* count one command of kind that took us */
+void metrics_latency(metrics *m, int kind, long long us)
+{
+	latency *l = m->lat + kind;
+	int bin = 0;
+	while(bin < HIST_BINS - 1 && us >> (bin + 1))
+		bin++;
+	l->count++;
+	l->total_us += us;
+	if(us > l->max_us)
+		l->max_us = us;
+	l->bins[bin]++;
+}
+
+/* count one wait for an operation of type, done after polls status reads */
+void metrics_busy(metrics *m, int type, long polls, long long us)
+{
+	polling *p = m->busy + type;
+	p->waits++;
+	p->polls += polls;
+	if(polls > p->max_polls)
+		p->max_polls = polls;
+	p->total_us += us;
+}
+
+/* close an object opened at indent, empty if first is still set */
+static void close_object(FILE *stream, int first, const char *indent)
+{
+	if(first)
+		fprintf(stream, "},\n");
+	else
+		fprintf(stream, "\n%s},\n", indent);
+}
+
+/* write the members of an object with all counters of m, each line
+ * starts with indent. histograms end at their last used bin */
+void metrics_json(FILE *stream, metrics *m, const char *indent)
+{
+	latency *l;
+	polling *p;
+	int i, j, n, first = 1;
+	fprintf(stream, "%s\"commands\": {", indent);
+	for(i = 0; i < K_COUNT; i++){
+		l = m->lat + i;
+		if(!l->count)
+			continue;
+		for(n = HIST_BINS; n > 0 && !l->bins[n - 1]; n--)
+			;
+		fprintf(stream, "%s\n%s\t\"%s\": {\"count\": %ld, \"mean_us\": %lld, "
+		        "\"max_us\": %lld, \"hist\": [", first ? "" : ",", indent,
+		        metrics_names[i], l->count, l->total_us / l->count, l->max_us);
+		for(j = 0; j < n; j++)
+			fprintf(stream, "%s%ld", j ? ", " : "", l->bins[j]);
+		fprintf(stream, "]}");
+		first = 0;
+	}
+	close_object(stream, first, indent);
+	first = 1;
+	fprintf(stream, "%s\"busy\": {", indent);
+	for(i = 0; i < T_COUNT; i++){
+		p = m->busy + i;
+		if(!p->waits)
+			continue;
+		fprintf(stream, "%s\n%s\t\"%s\": {\"waits\": %ld, \"polls\": %ld, "
+		        "\"max_polls\": %ld, \"mean_us\": %lld}", first ? "" : ",",
+		        indent, busy_names[i], p->waits, p->polls, p->max_polls,
+		        p->total_us / p->waits);
+		first = 0;
+	}
+	close_object(stream, first, indent);
+	fprintf(stream, "%s\"retries\": %ld,\n", indent, m->retries);
+	fprintf(stream, "%s\"resends\": %ld,\n", indent, m->resends);
+	fprintf(stream, "%s\"bad_blocks\": %ld,\n", indent, m->bad_blocks);
+	fprintf(stream, "%s\"read_chunk\": %d,\n", indent, m->chunk);
+	fprintf(stream, "%s\"payload_bytes\": %lld,\n", indent, m->payload);
+	fprintf(stream, "%s\"wire_bytes_out\": %lld,\n", indent, m->sent);
+	fprintf(stream, "%s\"wire_bytes_in\": %lld", indent, m->received);
+}
@@ -0,0 +1,44 @@
+/* counters of the commands sent on one port. latencies are from
+ * sending a command until its answer is complete, in us, and are
+ * kept in histograms with bin i holding [2^i, 2^(i+1)) us.
+ * needs chip.h */
+
+#define HIST_BINS 24
+
+/* kinds of command, spi commands by what their opcode does */
+enum {K_READ, K_PP, K_SE, K_BE32, K_BE, K_CE, K_RDSR, K_WREN, K_WRDI,
+      K_RDID, K_SFDP, K_EN4B, K_SPI, K_PROG, K_WAIT, K_BAUD, K_RDZ,
+      K_PROGZ, K_CRC, K_COUNT};
+
+typedef struct {
+	long count;
+	long long total_us;
+	long long max_us;
+	long bins[HIST_BINS];
+} latency;
+
+/* status polling until write in progress clears, per erase or program */
+typedef struct {
+	long waits;
+	long polls;
+	long max_polls;
+	long long total_us;
+} polling;
+
+typedef struct {
+	latency lat[K_COUNT];
+	polling busy[T_COUNT];
+	long retries;      /* commands repeated after an error */
+	long resends;      /* windows of frames sent again */
+	long bad_blocks;   /* answer blocks that failed their crc, read again */
+	int chunk;         /* bytes read per frame at the end */
+	long long payload; /* command and answer bytes */
+	long long sent;    /* bytes on the wire */
+	long long received;
+} metrics;
+
+extern const char *metrics_names[K_COUNT];
+
+void metrics_latency(metrics *m, int kind, long long us);
+void metrics_busy(metrics *m, int type, long polls, long long us);
+void metrics_json(FILE *stream, metrics *m, const char *indent);
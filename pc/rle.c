@@ -0,0 +1,62 @@
+/* Run length encoding of payloads, format in protocol.md */
+#include "system.h"
+#include "rle.h"
+
+#define LIT_MAX  128       /* literal bytes per code */
+#define REP_MAX  66        /* repeated byte per code */
+#define FILL_MAX 8192      /* 0xFF or 0x00 per code */
+
+/* length of the run starting at in[0], at most n */
+static int run_length(unsigned char *in, int n)
+{
+	int i, max = (in[0] == 0xFF || in[0] == 0x00) ? FILL_MAX : REP_MAX;
+	for(i = 1; i < n && i < max && in[i] == in[0]; i++)
+		;
+	return i;
+}
+
+/* a run pays off from 2 bytes for 0xFF and 0x00, 3 bytes otherwise */
+static int is_run(unsigned char *in, int len)
+{
+	return len >= 3 || (len == 2 && (in[0] == 0xFF || in[0] == 0x00));
+}
+
+/* encode n bytes of data into out, which can hold max bytes.
+ * return encoded size, -1 if it does not fit */
+int rle_encode(char *data, int n, char *out, int max)
+{
+	unsigned char *in = (unsigned char *)data;
+	int pos = 0, size = 0, len, lit;
+	while(pos < n){
+		len = run_length(in + pos, n - pos);
+		if(is_run(in + pos, len)){
+			if(size + 2 > max)
+				return -1;
+			if(in[pos] == 0xFF || in[pos] == 0x00){
+				out[size++] = (in[pos] ? 0xC0 : 0xE0) | ((len - 1) >> 8);
+				out[size++] = (len - 1) & 0xFF;
+			}
+			else{
+				out[size++] = 0x80 | (len - 3);
+				out[size++] = in[pos];
+			}
+			pos += len;
+			continue;
+		}
+		/* collect literals up to the next run */
+		for(lit = 0; pos + lit < n && lit < LIT_MAX; lit += len){
+			len = run_length(in + pos + lit, n - pos - lit);
+			if(is_run(in + pos + lit, len))
+				break;
+			if(lit + len > LIT_MAX)
+				len = LIT_MAX - lit;
+		}
+		if(size + 1 + lit > max)
+			return -1;
+		out[size++] = lit - 1;
+		memcpy(out + size, in + pos, lit);
+		size += lit;
+		pos += lit;
+	}
+	return size;
+}
@@ -0,0 +1 @@
+int rle_encode(char *in, int n, char *out, int max);
@@ -1,15 +1,75 @@
 #include "system.h"
+#include "serial_pc.h"
+#include "crc.h"
+#include <poll.h>
+#include <sys/uio.h>
 
+#define ACK_TIMEOUT 10000  /* ms */
+#define RW_TIMEOUT 20000   /* ms */
+#define RX_SIZE 4096       /* receive buffer of each port */
+#define RX_FDS 64
 
-#define ACK_TIMEOUT 10
-#define RW_TIMEOUT 20
-/*append 24 bit address to data in big endian, 
+/* data part of an answer. on version 3 links it comes in blocks of
+ * SUB_BLOCK bytes, the last one shorter, each followed by its crc16 */
+typedef struct {
+	int fd;
+	int check;         /* blocks carry a crc */
+	int len;           /* bytes of the current block so far */
+	int index;         /* of the current block */
+	unsigned short crc;
+	char *bad;         /* marks of blocks that failed, NULL fails the answer */
+	int nbad;
+	int failed;
+} answer;
+
+/* bytes read from the port but not yet consumed, and traffic since open */
+typedef struct {
+	unsigned char data[RX_SIZE];
+	int pos;
+	int len;
+	long long sent;
+	long long received;
+} rx_buffer;
+
+static rx_buffer *rx[RX_FDS];
+
+/* rates the host can offer, fastest first */
+static const struct {
+	int rate;
+	speed_t speed;
+} speeds[] = {
+#ifdef B2000000
+	{2000000, B2000000},
+#endif
+#ifdef B1500000
+	{1500000, B1500000},
+#endif
+#ifdef B1000000
+	{1000000, B1000000},
+#endif
+#ifdef B921600
+	{921600, B921600},
+#endif
+#ifdef B500000
+	{500000, B500000},
+#endif
+#ifdef B460800
+	{460800, B460800},
+#endif
+#ifdef B250000
+	{250000, B250000},
+#endif
+	{230400, B230400},
+	{115200, B115200},
+};
+#define SPEEDS (sizeof(speeds) / sizeof(speeds[0]))
+/*append address of n bytes to data in big endian, 
  *start from the second byte */
-void append_addr(char *data, int addr)
+void append_addr(char *data, int addr, int n)
 {
-	data[1] = (addr >> 16) & 0xFF;
-	data[2] = (addr >> 8 ) & 0xFF;
-	data[3] = addr & 0xFF;
+	int i;
+	for(i = 0; i < n; i++)
+		data[1 + i] = (addr >> ((n - 1 - i) * 8)) & 0xFF;
 }
 int serial_open(char *port)
 {
@@ -17,12 +77,161 @@ int serial_open(char *port)
 	int flag = O_RDWR | O_NOCTTY | O_NDELAY;
 	fd = open(port, flag);
 	if(fd < 0) {
-		fprintf(stderr, "Failed to open port, %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
+		fprintf(stderr, "Failed to open port %s, %s\n", port, strerror(errno));
+		return -1;
+	}
+	if(fd < RX_FDS && rx[fd]){
+		rx[fd]->pos = rx[fd]->len = 0;
+		rx[fd]->sent = rx[fd]->received = 0;
 	}
 	return fd;
 }
 
+/* monotonic clock in ms */
+long now_ms()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000L + t.tv_nsec / 1000000;
+}
+
+/* monotonic clock in us */
+long long now_us()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+/* receive buffer of fd, NULL if fd is out of range or out of memory */
+static rx_buffer *rx_get(int fd)
+{
+	if(fd < 0 || fd >= RX_FDS)
+		return NULL;
+	if(rx[fd] == NULL && (rx[fd] = calloc(1, sizeof(rx_buffer))) == NULL)
+		return NULL;
+	return rx[fd];
+}
+
+/* bytes written to and read from fd since it was opened */
+void serial_traffic(int fd, long long *sent, long long *received)
+{
+	rx_buffer *r = rx_get(fd);
+	*sent = r ? r->sent : 0;
+	*received = r ? r->received : 0;
+}
+
+/* drop buffered and pending data, queue is passed to tcflush */
+void serial_flush(int fd, int queue)
+{
+	if(queue != TCOFLUSH && fd >= 0 && fd < RX_FDS && rx[fd])
+		rx[fd]->pos = rx[fd]->len = 0;
+	tcflush(fd, queue);
+}
+
+/* sleep until fd is ready for events or deadline passes.
+ * return 1 when ready, 0 on timeout, -1 on error */
+static int wait_fd(int fd, short events, long deadline)
+{
+	struct pollfd p = {fd, events, 0};
+	long left;
+	int n;
+	for(;;){
+		left = deadline - now_ms();
+		if(left < 0)
+			left = 0;
+		n = poll(&p, 1, (int)left);
+		if(n > 0)
+			return 1;
+		if(n == 0)
+			return 0;
+		if(errno != EINTR)
+			return -1;
+	}
+}
+
+/* write all cnt buffers in as few calls as the port allows,
+ * iov is consumed. return 0 on success, -1 on timeout or error */
+static int write_iov(int fd, struct iovec *iov, int cnt, long deadline)
+{
+	rx_buffer *r = rx_get(fd);
+	ssize_t n;
+	while(cnt > 0){
+		n = writev(fd, iov, cnt);
+		if(n > 0 && r)
+			r->sent += n;
+		if(n < 0){
+			if(errno != EAGAIN && errno != EINTR)
+				return -1;
+			if(wait_fd(fd, POLLOUT, deadline) <= 0)
+				return -1;
+			continue;
+		}
+		while(cnt > 0 && (size_t)n >= iov->iov_len){
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if(cnt > 0){
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* read count bytes through the receive buffer, waiting at most ms.
+ * return bytes actually read */
+static ssize_t read_timeout(int fd, char *buf, size_t count, long ms)
+{
+	rx_buffer *r = rx_get(fd);
+	long deadline = now_ms() + ms;
+	size_t got = 0;
+	ssize_t n;
+	while(got < count){
+		if(r && r->pos < r->len){
+			n = r->len - r->pos < count - got ? r->len - r->pos : count - got;
+			memcpy(buf + got, r->data + r->pos, n);
+			r->pos += n;
+			got += n;
+			continue;
+		}
+		/* large reads bypass the buffer */
+		if(r && count - got < RX_SIZE){
+			n = read(fd, r->data, RX_SIZE);
+			if(n > 0){
+				r->received += n;
+				r->pos = 0;
+				r->len = n;
+				continue;
+			}
+		}
+		else{
+			n = read(fd, buf + got, count - got);
+			if(n > 0){
+				if(r)
+					r->received += n;
+				got += n;
+				continue;
+			}
+		}
+		if(n == 0 || (errno != EAGAIN && errno != EINTR))
+			break;
+		if(wait_fd(fd, POLLIN, deadline) <= 0)
+			break;
+	}
+	return got;
+}
+
+/* read and drop data until the line has been quiet for ms */
+void serial_drain(int fd, long ms)
+{
+	char scratch[RX_SIZE];
+	serial_flush(fd, TCIFLUSH);
+	while(read_timeout(fd, scratch, sizeof(scratch), ms) > 0)
+		;
+}
+
 /* set port to 8N1 mode, given baud in B*  */
 int serial_set(int fd, int baud)
 {
@@ -30,7 +239,7 @@ int serial_set(int fd, int baud)
 
 	if(tcgetattr(fd, &option) < 0){
 		fprintf(stderr, "Failed to get port attr, %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
+		return -1;
 	}
 
 	option.c_iflag = 0;
@@ -41,45 +250,49 @@ int serial_set(int fd, int baud)
 	cfsetispeed(&option, baud);
 
 	if(tcsetattr(fd, TCSANOW, &option) < 0){
-		fprintf(stderr, "Failed to get port attr, %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
+		fprintf(stderr, "Failed to set port attr, %s\n", strerror(errno));
+		return -1;
 	}
 
 	return 0;
 }
 
+/* termios speed of rate, 0 if not supported */
+speed_t serial_speed(int rate)
+{
+	int i;
+	for(i = 0; i < SPEEDS; i++)
+		if(speeds[i].rate == rate)
+			return speeds[i].speed;
+	return 0;
+}
+
+/* fill rates with up to n supported rates no faster than max,
+ * fastest first. return number of rates */
+int serial_rates(int max, int *rates, int n)
+{
+	int i, count = 0;
+	for(i = 0; i < SPEEDS && count < n; i++)
+		if(speeds[i].rate <= max)
+			rates[count++] = speeds[i].rate;
+	return count;
+}
+
 /* unbuffered reliable write, 
  * return number of bytes actually written */
 ssize_t serial_write(int fd, char *buf, size_t count)
 {
-	size_t left = count;
-	ssize_t n;
-	time_t t0, t1;
-	t0 = t1 = time(NULL);
-	while(left > 0 && (t1 - t0) < RW_TIMEOUT){
-		n = write(fd, buf + count - left, left);
-		if(n > 0)
-			left -= n;
-		t1 = time(NULL);
-	}
-	return count - left;
+	struct iovec iov = {buf, count};
+	if(write_iov(fd, &iov, 1, now_ms() + RW_TIMEOUT) < 0)
+		return count - iov.iov_len;
+	return count;
 }
 
 /* try to get enough data before timeout
  * return bytes actually read */
 ssize_t serial_read(int fd, char *buf, size_t count)
 {
-	size_t left = count;
-	ssize_t n;
-	time_t t0, t1;
-	t0 = t1 = time(NULL);
-	while(left > 0 && (t1 - t0) < RW_TIMEOUT){
-		n = read(fd, buf + count - left, left);
-		if(n > 0)
-			left -= n;
-		t1 = time(NULL);
-	}
-	return count - left;
+	return read_timeout(fd, buf, count, RW_TIMEOUT);
 }
 
 /* unbuffered, append STX and ETX
@@ -87,64 +300,211 @@ ssize_t serial_read(int fd, char *buf, size_t count)
 int send_data(int fd, char *data, size_t size)
 {
 	char stx = STX, etx = ETX;
-	if(serial_write(fd, &stx, 1) < 1){
-		return -1;
-	}
-	if(serial_write(fd, data, size) < size){
+	struct iovec iov[3] = {{&stx, 1}, {data, size}, {&etx, 1}};
+	return write_iov(fd, iov, 3, now_ms() + RW_TIMEOUT);
+}
+
+/* send header of given Inum and Onum
+ * return 0 on sucess, -1 or short or error */
+int send_header(int fd, int Inum, int Onum)
+{
+	char header[5];
+	header[0] = SOH;
+	header[1] = Inum & 0xFF;
+	header[2] = (Inum >> 8) & 0xFF;
+	header[3] = Onum & 0xFF;
+	header[4] = (Onum >> 8) & 0xFF;
+	return serial_write(fd, header, 5) < 5 ? -1 : 0;
+}
+
+/* read the crc of the current block of a and check it
+ * return 0 on success, -1 on short read */
+static int answer_check(answer *a)
+{
+	unsigned char c[2];
+	if(serial_read(a->fd, (char *)c, 2) < 2)
 		return -1;
+	if((c[0] | c[1] << 8) != a->crc){
+		if(a->bad)
+			a->bad[a->index] = 1;
+		else
+			a->failed = 1;
+		a->nbad++;
 	}
-	if(serial_write(fd, &etx, 1) < 1){
-		return -1;
+	a->index++;
+	a->len = 0;
+	a->crc = CRC16_INIT;
+	return 0;
+}
+
+/* read n bytes of the data of a, checking the blocks they end
+ * return 0 on success, -1 on short read */
+static int answer_read(answer *a, char *buf, int n)
+{
+	int part;
+	while(n > 0){
+		part = a->check && SUB_BLOCK - a->len < n ? SUB_BLOCK - a->len : n;
+		if(serial_read(a->fd, buf, part) < part)
+			return -1;
+		if(a->check){
+			a->crc = crc16(a->crc, buf, part);
+			a->len += part;
+			if(a->len == SUB_BLOCK && answer_check(a) < 0)
+				return -1;
+		}
+		buf += part;
+		n -= part;
 	}
 	return 0;
 }
 
-/* send header of given Inum and Onum
- * return 0 on sucess, -1 or short or error */
-int send_header(int fd, int Inum, int Onum)
+/* check the last block of a and the ETX after it.
+ * an empty answer still has the crc of one empty block
+ * return 0 on success, -1 on error */
+static int answer_end(answer *a)
 {
-	short num[2] = {(short)Inum, (short)Onum};
-	char soh = SOH;
-	if(serial_write(fd, &soh, 1) < 1)
+	char c;
+	if(a->check && (a->len || !a->index) && answer_check(a) < 0)
 		return -1;
-	if(serial_write(fd, (char *)num, 4) < 4)
+	if(serial_read(a->fd, &c, 1) < 1 || c != ETX)
 		return -1;
-	return 0;
+	return a->failed ? -1 : 0;
 }
 
-/* read data of given Onum, STX and ETX are checked.
+/* read Onum bytes of data into buf, STX and ETX are checked
  * return 0 on sucess, -1 or short or error */
-int read_data(int fd, char *buf, int Onum)
+static int answer_data(answer *a, char *buf, int Onum)
 {
 	char c;
-	int n;
-	if((n = serial_read(fd, &c, 1) < 1) || c != STX){
+	if(serial_read(a->fd, &c, 1) < 1 || c != STX)
 		return -1;
-	}
-	if((n = serial_read(fd, buf, Onum)) < Onum){
+	if(answer_read(a, buf, Onum) < 0)
 		return -1;
-	}
-	if(serial_read(fd, &c, 1) < 1 || c != ETX){
+	return answer_end(a);
+}
+
+/* read run length encoded data expanding to Onum bytes,
+ * STX and ETX are checked.
+ * return 0 on sucess, -1 or short or error */
+static int answer_rle(answer *a, char *buf, int Onum)
+{
+	unsigned char c[2];
+	int n, pos = 0;
+	if(serial_read(a->fd, (char *)c, 1) < 1 || c[0] != STX)
 		return -1;
+	while(pos < Onum){
+		if(answer_read(a, (char *)c, 1) < 0)
+			return -1;
+		if(c[0] < 0x80){
+			/* literal */
+			n = c[0] + 1;
+			if(pos + n > Onum || answer_read(a, buf + pos, n) < 0)
+				return -1;
+		}
+		else{
+			if(answer_read(a, (char *)c + 1, 1) < 0)
+				return -1;
+			if(c[0] < 0xC0)
+				n = (c[0] & 0x3F) + 3;
+			else
+				n = ((c[0] & 0x1F) << 8 | c[1]) + 1;
+			if(pos + n > Onum)
+				return -1;
+			if(c[0] < 0xC0)
+				memset(buf + pos, c[1], n);
+			else
+				memset(buf + pos, c[0] < 0xE0 ? 0xFF : 0x00, n);
+		}
+		pos += n;
 	}
-	return 0;
+	return answer_end(a);
+}
+
+/* read data of given Onum, STX and ETX are checked.
+ * return 0 on sucess, -1 or short or error */
+int read_data(int fd, char *buf, int Onum)
+{
+	answer a = {fd};
+	return answer_data(&a, buf, Onum);
 }
 
 /* read one byte from serial, check if it is ACK.
- * return 1 on ACK, 0 on error */
+ * a NAK is not printed, the callers count their retries and
+ * output may be the dump itself.
+ * return 1 on ACK, 0 on error or NAK */
 int isACK(int fd)
 {
 	char c = 0;
-	time_t t0, t1;
-	t0 = t1 = time(NULL);
-	while(serial_read(fd, &c, 1) < 1 && (t1-t0) < ACK_TIMEOUT){
-		t1 = time(NULL);
+	read_timeout(fd, &c, 1, ACK_TIMEOUT);
+	return c == ACK;
+}
+
+/* send a version 2 frame with a single write, no ACK is waited for.
+ * check adds the crc16 of version 3 before ETX.
+ * return 0 on sucess, -1 on short or error */
+int send_frame(int fd, int seq, int op, char *data, int Inum, int Onum, int check)
+{
+	char header[8], tail[3];
+	unsigned short crc;
+	struct iovec iov[3] = {{header, 8}, {data, Inum}, {tail, 1}};
+	header[0] = DC1;
+	header[1] = seq & 0xFF;
+	header[2] = op & 0xFF;
+	header[3] = Inum & 0xFF;
+	header[4] = (Inum >> 8) & 0xFF;
+	header[5] = Onum & 0xFF;
+	header[6] = (Onum >> 8) & 0xFF;
+	header[7] = STX;
+	tail[0] = ETX;
+	if(check){
+		crc = crc16(crc16(CRC16_INIT, header + 1, 6), data, Inum);
+		tail[0] = crc & 0xFF;
+		tail[1] = crc >> 8;
+		tail[2] = ETX;
+		iov[2].iov_len = 3;
 	}
-	if(c == ACK)
+	return write_iov(fd, iov, 3, now_ms() + RW_TIMEOUT);
+}
+
+/* read the answer to a version 2 frame, ACK and seq are checked.
+ * rle selects run length encoded data, check the crc16 blocks of
+ * version 3. blocks that fail are marked in bad if not NULL, one
+ * char each, and the rest of the answer is still taken.
+ * return number of bad blocks, -1 on NAK, wrong seq, short, error
+ * or a bad block without bad */
+int read_frame(int fd, int seq, char *buf, int Onum, int rle, int check, char *bad)
+{
+	answer a = {fd, check, 0, 0, CRC16_INIT, bad};
+	char c;
+	if(!isACK(fd))
+		return -1;
+	if(serial_read(fd, &c, 1) < 1 || (unsigned char)c != (seq & 0xFF))
+		return -1;
+	if((rle ? answer_rle(&a, buf, Onum) : answer_data(&a, buf, Onum)) < 0)
+		return -1;
+	return a.nbad;
+}
+
+/* ask the programmer for protocol version ver or below.
+ * version 1 firmware answers NAK to the request.
+ * return negotiated version, window, rx_buf and ops (number of programmer
+ * operations) are filled for version 2. 1 without answer, 0 on NAK,
+ * which a garbled request also gets, -1 if the answer is garbled */
+int negotiate(int fd, int ver, int *window, int *rx_buf, int *ops)
+{
+	char req[5] = {SYN, ver, 0, 0, 0}, ans[5];
+	char c = 0;
+	*window = 1;
+	*rx_buf = 0;
+	*ops = 0;
+	if(serial_write(fd, req, 5) < 5 || serial_read(fd, &c, 1) < 1)
 		return 1;
-	else{
-		if(c == NAK)
-			printf("NAK!!\n");
-		return 0;
-	}
+	if(c != ACK)
+		return c == NAK ? 0 : -1;
+	if(serial_read(fd, ans, 5) < 5 || ans[0] < 2 || ans[0] > ver)
+		return -1;
+	*window = (unsigned char)ans[1];
+	*rx_buf = (unsigned char)ans[2] + ((unsigned char)ans[3] << 8);
+	*ops = (unsigned char)ans[4];
+	return (unsigned char)ans[0];
 }
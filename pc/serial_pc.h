@@ -1,9 +1,21 @@
+#define SUB_BLOCK 0x100    /* answer bytes per crc16 on version 3 links */
+
 int serial_open(char *port);
 int serial_set(int fd, int baud);
+long now_ms();
+long long now_us();
+void serial_traffic(int fd, long long *sent, long long *received);
+void serial_flush(int fd, int queue);
+void serial_drain(int fd, long ms);
+speed_t serial_speed(int rate);
+int serial_rates(int max, int *rates, int n);
 ssize_t serial_write(int fd, char *buf, size_t count);
 ssize_t serial_read(int fd, char *buf, size_t count);
 int send_data(int fd, char *data, size_t size);
 int send_header(int fd, int Inum, int Onum);
 int read_data(int fd, char *buf, int Onum);
 int isACK(int fd);
-void append_addr(char *data, int addr);
+void append_addr(char *data, int addr, int n);
+int send_frame(int fd, int seq, int op, char *data, int Inum, int Onum, int check);
+int read_frame(int fd, int seq, char *buf, int Onum, int rle, int check, char *bad);
+int negotiate(int fd, int ver, int *window, int *rx_buf, int *ops);
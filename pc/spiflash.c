@@ -1,46 +1,1390 @@
 #include "system.h"
 #include "serial_pc.h"
-#include "command.h"
+#include "chip.h"
+#include "metrics.h"
+#include "erase.h"
+#include "libspiflash.h"
+#include "crc.h"
+#include "journal.h"
+#include "image.h"
+#include "layout.h"
+#include "cache.h"
+#include "daemon.h"
+#include <pthread.h>
+#include <getopt.h>
 
 #define RD_BLOCK 0xffff
-#define PP_BLOCK 0x100
+#define SE_BLOCK SF_SECTOR
+#define DIFF_MAX 16        /* differing bytes reported per sector */
+#define PORT_MAX DAEMON_PORTS /* programmers driven at once */
+#define JOURNAL_UNIT 0x10000 /* bytes programmed between journal entries */
+#define LIVE_MS 200        /* ms between updates of the progress line */
+#define CS_MAX 8           /* chip selects of one programmer */
 
+/* parts of a job, timed for the metrics report */
+enum {PH_OPEN, PH_ERASE, PH_READ, PH_COMPARE, PH_PROGRAM, PH_VERIFY, PH_COUNT};
 
+static const char *phase_names[PH_COUNT] = {
+	"open", "erase", "read", "compare", "program", "verify",
+};
 
+typedef struct {
+	long long us;
+	long long bytes;
+	long count;        /* library calls, operations for erase */
+} phase;
 
+/* what to do, from the command line. shared read-only by all ports */
+typedef struct {
+	int isread;
+	int iswrite;
+	int isce;
+	int isverify;
+	int isdiff;
+	int iszip;
+	int resume;        /* continue from the journal */
+	int max_baud;
+	int offset_rom;
+	int size;
+	char *path;
+	char *report;      /* metrics report file, NULL without */
+	char *cache;       /* sector cache directory of -r, NULL without */
+	int format;        /* F_* of the file */
+	int cs;            /* chip selects of --cs, bit n is chip select n */
+	image im;          /* file content for -w and -v, opened once */
+	layout lay;        /* the same for a sparse image */
+	unsigned int crc;  /* crc32 of a mapped image */
+} job;
+
+/* one programmer. progress goes to out and errors to err, in gang
+ * mode both are collected in log and printed when the port is done.
+ * with a progress line they are collected in log and err_log and
+ * passed on to live_out and live_err above the line */
+typedef struct {
+	char *port;
+	sf_ctx *ctx;
+	char *journal;     /* progress file of this port */
+	job *job;
+	FILE *out;
+	FILE *err;
+	char *log;
+	size_t log_size;
+	int result;
+	long ms;
+	pthread_t thread;
+	/* kept for the report after the port is closed */
+	metrics *m;
+	chip_info chip;
+	char id[3];
+	int version;
+	int baud;
+	int zip;
+	int cs;            /* chips of job->cs still written */
+	int failed;        /* chips of job->cs that failed */
+	phase phases[PH_COUNT];
+	int ph;            /* phase running and its start */
+	long long ph_start;
+	/* progress line */
+	int live;
+	FILE *live_out;
+	FILE *live_err;
+	char *err_log;
+	size_t err_size;
+	size_t out_shown;
+	size_t err_shown;
+	long shown;        /* ms, last drawn */
+	long long start;   /* us, job start */
+	long long goal;    /* bytes to read, program and verify */
+	long long done;    /* of them in finished calls */
+	long long partial; /* in the call running */
+} worker;
+
+/* pass collected messages on and redraw the progress line, which
+ * is done at most every LIVE_MS otherwise. the rate counts read,
+ * programmed and verified bytes over the whole job */
+static void show_live(worker *w)
+{
+	long long done = w->done + w->partial, us, rate;
+	long now = now_ms(), eta;
+	if(!w->live)
+		return;
+	fflush(w->out);
+	fflush(w->err);
+	if(now - w->shown < LIVE_MS && w->log_size == w->out_shown &&
+	   w->err_size == w->err_shown)
+		return;
+	w->shown = now;
+	fprintf(w->live_err, "\r\033[K");
+	if(w->log_size > w->out_shown){
+		fwrite(w->log + w->out_shown, 1, w->log_size - w->out_shown, w->live_out);
+		fflush(w->live_out);
+		w->out_shown = w->log_size;
+	}
+	if(w->err_size > w->err_shown){
+		fwrite(w->err_log + w->err_shown, 1, w->err_size - w->err_shown, w->live_err);
+		w->err_shown = w->err_size;
+	}
+	if(done > w->goal)
+		done = w->goal;
+	us = now_us() - w->start;
+	rate = us > 0 ? done * 1000000 / us : 0;
+	fprintf(w->live_err, "%-8s", phase_names[w->ph]);
+	if(w->goal)
+		fprintf(w->live_err, " %3d%%", (int)(done * 100 / w->goal));
+	fprintf(w->live_err, " %8.1f KB/s", rate / 1024.0);
+	if(w->goal && rate > 0){
+		eta = (w->goal - done) / rate;
+		fprintf(w->live_err, "  ETA %ld:%02ld", eta / 60, eta % 60);
+	}
+	fflush(w->live_err);
+}
+
+/* progress of the library call running */
+static void live_progress(void *arg, int op, int done, int total)
+{
+	worker *w = arg;
+	if(op == SF_OP_READ || op == SF_OP_PROGRAM || op == SF_OP_VERIFY)
+		w->partial = done;
+	show_live(w);
+}
+
+/* collect the messages of w for a progress line on stderr
+ * return 0 on success, -1 on failure */
+static int live_start(worker *w)
+{
+	w->live_out = w->out;
+	w->live_err = w->err;
+	w->out = open_memstream(&w->log, &w->log_size);
+	w->err = open_memstream(&w->err_log, &w->err_size);
+	if(w->out == NULL || w->err == NULL){
+		if(w->out)
+			fclose(w->out);
+		w->out = w->live_out;
+		w->err = w->live_err;
+		return -1;
+	}
+	w->live = 1;
+	return 0;
+}
+
+/* pass on the last messages and remove the progress line */
+static void live_end(worker *w)
+{
+	if(!w->live)
+		return;
+	fclose(w->out);
+	fclose(w->err);
+	fprintf(w->live_err, "\r\033[K");
+	fwrite(w->log + w->out_shown, 1, w->log_size - w->out_shown, w->live_out);
+	fwrite(w->err_log + w->err_shown, 1, w->err_size - w->err_shown, w->live_err);
+	fflush(w->live_out);
+	free(w->log);
+	free(w->err_log);
+	w->out = w->live_out;
+	w->err = w->live_err;
+	w->live = 0;
+}
+
+/* time phase ph of the job */
+static void phase_begin(worker *w, int ph)
+{
+	w->ph = ph;
+	w->ph_start = now_us();
+	show_live(w);
+}
+
+/* end the phase running, count units of bytes of work */
+static void phase_end(worker *w, long long bytes, long count)
+{
+	phase *p = w->phases + w->ph;
+	p->us += now_us() - w->ph_start;
+	p->bytes += bytes;
+	p->count += count;
+	if(w->ph == PH_READ || w->ph == PH_PROGRAM || w->ph == PH_VERIFY)
+		w->done += bytes;
+	w->partial = 0;
+	show_live(w);
+}
+
+/* print the first DIFF_MAX differing bytes of a sector to out */
+static void print_diff(void *out, int addr, char *chip, char *data, int n)
+{
+	int i, shown = 0;
+	for(i = 0; i < n; i++){
+		if(chip[i] == data[i])
+			continue;
+		if(shown++ < DIFF_MAX)
+			fprintf(out, "  %06X: chip %02X file %02X\n", addr + i,
+			        (unsigned char)chip[i], (unsigned char)data[i]);
+	}
+	if(shown > DIFF_MAX)
+		fprintf(out, "  ... %d more in this sector\n", shown - DIFF_MAX);
+}
+
+/* compare size bytes of data with the chip at addr, differences
+ * are reported to out if not NULL.
+ * return number of differing bytes, -1 on failure */
+static int verify(worker *w, char *data, int addr, int size, FILE *out)
+{
+	int diff;
+	phase_begin(w, PH_VERIFY);
+	diff = sf_verify(w->ctx, data, addr, size, out ? print_diff : NULL, out);
+	phase_end(w, size, 1);
+	return diff < 0 ? -1 : diff;
+}
+
+/* chip erase on one port
+ * return 0 on success, -1 on failure */
+static int erase_chip(worker *w)
+{
+	int result;
+	fprintf(w->out, "Performing chip erase...\n");
+	phase_begin(w, PH_ERASE);
+	result = sf_erase_chip(w->ctx);
+	phase_end(w, sf_chip_size(w->ctx), 1);
+	if(result < 0){
+		fprintf(w->err, "%s, please try again.\n", sf_strerror(result));
+		return -1;
+	}
+	fprintf(w->out, "Chip erased!\n");
+	return 0;
+}
+
+/* run planned erase operations
+ * return 0 on success, -1 on failure */
+static int erase_run(worker *w, erase_op *plan, int n)
+{
+	long long bytes = 0;
+	int i, result;
+	for(i = 0; i < n; i++)
+		bytes += plan[i].type == E_CE ? sf_chip_size(w->ctx) : erase_size(plan[i].type);
+	phase_begin(w, PH_ERASE);
+	result = sf_erase_ops(w->ctx, plan, n);
+	phase_end(w, bytes, n);
+	if(result < 0){
+		fprintf(w->err, "%s at %X\n", sf_strerror(result), sf_error_addr(w->ctx));
+		return -1;
+	}
+	return 0;
+}
+
+/* return 1 if mask holds more than one chip */
+static int several(int mask)
+{
+	return (mask & (mask - 1)) != 0;
+}
+
+/* select the chips of mask, those the programmer dropped during the
+ * last broadcast are taken out of the chips written
+ * return 0 on success, -1 on failure */
+static int select_chips(worker *w, int mask)
+{
+	int i, dropped = sf_select(w->ctx, mask);
+	if(dropped == SF_ERR_ARG){
+		fprintf(w->err, "Programmer cannot select chips %02X.\n", mask);
+		return -1;
+	}
+	if(dropped < 0){
+		fprintf(w->err, "Cannot select chips %02X, %s\n", mask, sf_strerror(dropped));
+		return -1;
+	}
+	for(i = 0; i < CS_MAX; i++)
+		if(dropped & w->cs & 1 << i)
+			fprintf(w->err, "Chip select %d failed to write and was left out.\n", i);
+	w->failed |= dropped & w->cs;
+	w->cs &= ~dropped;
+	return 0;
+}
+
+/* with several chips buf was read from the lowest, check that the
+ * others hold the same, as a broadcast write keeps it for all of them
+ * return 0 if they do, -1 if not or on failure */
+static int same_on_chips(worker *w, char *buf, int addr, int size)
+{
+	char *tmp;
+	int i, result = 0;
+	if(!several(w->cs))
+		return 0;
+	if((tmp = malloc(size)) == NULL){
+		fprintf(w->err, "Memory allocation failed.\n");
+		return -1;
+	}
+	for(i = 0; i < CS_MAX && result == 0; i++){
+		/* each one but the lowest */
+		if(!(w->cs & 1 << i) || !(w->cs & ((1 << i) - 1)))
+			continue;
+		if(select_chips(w, 1 << i) < 0 || sf_read(w->ctx, tmp, addr, size) < 0)
+			result = -1;
+		else if(memcmp(tmp, buf, size)){
+			fprintf(w->err, "Chip select %d holds other data at %X-%X, which a write "
+			        "to all chips would not keep.\n", i, addr, addr + size - 1);
+			result = -1;
+		}
+	}
+	if(select_chips(w, w->cs) < 0)
+		result = -1;
+	free(tmp);
+	return result;
+}
+
+/* read size bytes at addr into buf
+ * return 0 on success, -1 on failure */
+static int read_block(worker *w, char *buf, int addr, int size)
+{
+	int result;
+	phase_begin(w, PH_READ);
+	result = sf_read(w->ctx, buf, addr, size);
+	if(result >= 0)
+		result = same_on_chips(w, buf, addr, size);
+	phase_end(w, size, 1);
+	return result < 0 ? -1 : 0;
+}
+
+/* crc32 of n sectors of the chip from addr, and of a blank sector
+ * return a new array, NULL on failure */
+static unsigned int *sector_crcs(worker *w, int addr, int n, unsigned int *crc_blank)
+{
+	char tmp[SE_BLOCK];
+	unsigned int *crcs = malloc(n * sizeof(unsigned int));
+	int result = -1;
+	memset(tmp, 0xFF, SE_BLOCK);
+	*crc_blank = crc32(0, tmp, SE_BLOCK);
+	fprintf(w->out, "Comparing sectors...\n");
+	if(crcs){
+		phase_begin(w, PH_COMPARE);
+		result = sf_crc(w->ctx, addr, n * SE_BLOCK, crcs);
+		phase_end(w, (long long)n * SE_BLOCK, 1);
+	}
+	if(result < 0){
+		fprintf(w->err, "Cannot read sector checksums.\n");
+		free(crcs);
+		return NULL;
+	}
+	return crcs;
+}
+
+/* open the sector cache of the chip, named after its ID and its
+ * unique ID if it has one, for a dump that ends at end
+ * return 0 on success, -1 if the dump goes without */
+static int cache_start(worker *w, cache *c, int end)
+{
+	char id[3], uid[UID_MAX], key[7 + 2 * UID_MAX + 1];
+	int i, n, size = sf_chip_size(w->ctx);
+	if(!sf_has_crc(w->ctx)){
+		fprintf(w->err, "Programmer cannot checksum sectors, reading without cache.\n");
+		return -1;
+	}
+	if(sf_chip_id(w->ctx, id) < 0){
+		fprintf(w->err, "Chip ID unknown, reading without cache.\n");
+		return -1;
+	}
+	n = sf_unique_id(w->ctx, uid);
+	sprintf(key, "%02X%02X%02X", (unsigned char)id[0], (unsigned char)id[1],
+	        (unsigned char)id[2]);
+	if(n > 0)
+		strcat(key, "-");
+	for(i = 0; i < n; i++)
+		sprintf(key + strlen(key), "%02X", (unsigned char)uid[i]);
+	if(cache_open(c, w->job->cache, key, size ? size : end) < 0)
+		return -1;
+	fprintf(w->out, "Using cache %s/%s\n", w->job->cache, key);
+	return 0;
+}
+
+/* read n bytes at addr into buf through the cache. sectors whose crc,
+ * from crcs[] that start at sector lo, matches the cache are taken from
+ * there, the others are read whole and put into it. tmp holds the
+ * sectors of the range.
+ * return 0 on success, -1 on failure */
+static int read_cached(worker *w, cache *c, unsigned int *crcs, int lo, char *tmp,
+                       char *buf, int addr, int n)
+{
+	char hit[RD_BLOCK / SE_BLOCK + 2];
+	int i, k, first = addr & ~(SE_BLOCK - 1);
+	int nsec = (addr + n - first + SE_BLOCK - 1) / SE_BLOCK;
+	unsigned int *crc = crcs + (first - lo) / SE_BLOCK;
+	for(i = 0; i < nsec; i++)
+		if((hit[i] = cache_get(c, first + i * SE_BLOCK, crc[i], tmp + i * SE_BLOCK)))
+			w->done += SE_BLOCK;
+	for(i = 0; i < nsec; i = k){
+		for(k = i; k < nsec && !hit[k]; k++)
+			;
+		if(k > i && read_block(w, tmp + i * SE_BLOCK, first + i * SE_BLOCK,
+		                       (k - i) * SE_BLOCK) < 0)
+			return -1;
+		for(; i < k; i++)
+			cache_put(c, first + i * SE_BLOCK, tmp + i * SE_BLOCK);
+		k++;
+	}
+	memcpy(buf, tmp + addr - first, n);
+	return 0;
+}
+
+/* say why a job is not resumed */
+static void start_over(worker *w)
+{
+	if(w->job->resume)
+		fprintf(w->out, "No journal for this job, starting over.\n");
+	else if(w->journal && access(w->journal, F_OK) == 0)
+		fprintf(w->err, "Replacing journal of an unfinished job, "
+		        "use --resume to continue it.\n");
+}
+
+/* dump size bytes at offset_rom into the file, RD_BLOCK at a time.
+ * without size the dump goes on to the end of the chip.
+ * each block is written out as soon as it is read, "-" is stdout.
+ * finished blocks are journaled, on resume the dump continues after
+ * the last one, which is checked against the chip first.
+ * with a cache only sectors that changed since they were cached are
+ * read, the chip's sector crcs are fetched first to find them.
+ * return 0 on success, -1 on failure */
+static int read_rom(worker *w, char *id)
+{
+	job *j = w->job;
+	journal jn, old;
+	cache c;
+	FILE *file = NULL;
+	char *buf, *tmp = NULL;
+	unsigned int crc_blank, *crcs = NULL;
+	int n, lo = 0, hi, cached = 0, result = -1;
+	memset(&jn, 0, sizeof(journal));
+	jn.op = 'r';
+	memcpy(jn.id, id, 3);
+	jn.addr = j->offset_rom;
+	jn.size = j->size ? j->size : sf_chip_size(w->ctx) - j->offset_rom;
+	if(jn.size <= 0){
+		fprintf(w->err, "Chip size unknown, please specify size for reading.\n");
+		return -1;
+	}
+	buf = malloc(RD_BLOCK);
+	if(buf == NULL){
+		fprintf(w->err, "Memory allocation failed.\n");
+		return -1;
+	}
+	if(j->resume && journal_load(&old, w->journal) == 0){
+		if(journal_match(&old, &jn) && (file = fopen(j->path, "r+")) != NULL){
+			jn.done = old.done;
+			/* the last block may not have reached the disk */
+			n = jn.done % RD_BLOCK ? jn.done % RD_BLOCK : RD_BLOCK;
+			if(jn.done && (fseek(file, jn.done - n, SEEK_SET) ||
+			   fread(buf, n, 1, file) < 1 ||
+			   verify(w, buf, j->offset_rom + jn.done - n, n, NULL) != 0))
+				jn.done -= n;
+			fprintf(w->out, "Resuming at %X\n", j->offset_rom + jn.done);
+		}
+		journal_end(&old, NULL, 0);
+	}
+	if(file == NULL){
+		start_over(w);
+		file = strcmp(j->path, "-") ? fopen(j->path, "w") : stdout;
+	}
+	if(file == NULL){
+		fprintf(w->err, "Failed to create file, %s\n", strerror(errno));
+		free(buf);
+		return -1;
+	}
+	if(w->journal && journal_start(&jn, w->journal) < 0){
+		fprintf(w->err, "Cannot write journal %s\n", w->journal);
+		goto Done;
+	}
+	lo = (j->offset_rom + jn.done) & ~(SE_BLOCK - 1);
+	hi = (j->offset_rom + jn.size + SE_BLOCK - 1) & ~(SE_BLOCK - 1);
+	if(j->cache && cache_start(w, &c, hi) == 0){
+		cached = 1;
+		tmp = malloc(RD_BLOCK + 2 * SE_BLOCK);
+		if(tmp == NULL || (crcs = sector_crcs(w, lo, (hi - lo) / SE_BLOCK, &crc_blank)) == NULL)
+			goto Done;
+	}
+	fprintf(w->out, "Reading rom content\n");
+	w->goal += jn.size - jn.done;
+	if(jn.done && fseek(file, jn.done, SEEK_SET)){
+		fprintf(w->err, "File write failed\n");
+		goto Done;
+	}
+	while(jn.done < jn.size){
+		n = jn.size - jn.done < RD_BLOCK ? jn.size - jn.done : RD_BLOCK;
+		/* cached blocks end on a sector */
+		if(cached && n == RD_BLOCK)
+			n = (RD_BLOCK & ~(SE_BLOCK - 1)) - ((j->offset_rom + jn.done) & (SE_BLOCK - 1));
+		if((cached ? read_cached(w, &c, crcs, lo, tmp, buf, j->offset_rom + jn.done, n) :
+		    read_block(w, buf, j->offset_rom + jn.done, n)) < 0){
+			fprintf(w->err, "RD instruction failed.\n");
+			goto Done;
+		}
+		if(fwrite(buf, n, 1, file) < 1 || fflush(file)){
+			fprintf(w->err, "File write failed\n");
+			goto Done;
+		}
+		journal_done(&jn, jn.done + n);
+	}
+	if(cached)
+		fprintf(w->out, "%ld of %ld sectors from cache\n", c.hits, c.hits + c.misses);
+	fprintf(w->out, "Operation complete.\n");
+	result = 0;
+Done:
+	journal_end(&jn, w->journal, result == 0);
+	if(cached)
+		cache_close(&c);
+	if(file != stdout)
+		fclose(file);
+	free(buf);
+	free(tmp);
+	free(crcs);
+	return result;
+}
+
+/* n bytes of new content at addr of the sector aligned range being
+ * written: the image, with the kept head and tail around it.
+ * n is at most SE_BLOCK, tmp must hold n bytes.
+ * return pointer to the data, NULL if the image is short */
+static char *new_data(job *j, journal *jn, int addr, int n, char *tmp)
+{
+	int lo = j->offset_rom & 0xFFF, hi = lo + j->size, end = addr + n, b;
+	char *p;
+	if(addr >= lo && end <= hi)
+		return image_get(&j->im, addr - lo, n);
+	if(addr < lo){
+		b = end < lo ? end : lo;
+		memcpy(tmp, jn->head + addr, b - addr);
+		addr = b;
+	}
+	if(addr < end && addr < hi){
+		b = end < hi ? end : hi;
+		if((p = image_get(&j->im, addr - lo, b - addr)) == NULL)
+			return NULL;
+		memcpy(tmp + n - (end - addr), p, b - addr);
+		addr = b;
+	}
+	if(addr < end)
+		memcpy(tmp + n - (end - addr), jn->tail + addr - (jn->block - 1) * SE_BLOCK, end - addr);
+	return tmp;
+}
+
+/* compare new content [first, last) with the chip, sector by sector.
+ * differences are reported to out if not NULL.
+ * return number of differing bytes, -1 on failure */
+static int verify_range(worker *w, journal *jn, int first, int last, FILE *out)
+{
+	char tmp[SE_BLOCK], *data;
+	int i, n, bad, diff = 0, offset_new = w->job->offset_rom & ~0xFFF;
+	for(i = first; i < last; i += n){
+		n = last - i < SE_BLOCK ? last - i : SE_BLOCK;
+		if((data = new_data(w->job, jn, i, n, tmp)) == NULL ||
+		   (bad = verify(w, data, offset_new + i, n, out)) < 0)
+			return -1;
+		diff += bad;
+	}
+	return diff;
+}
+
+/* decide which sectors need erasing and plan the erase
+ * return 0 on success, -1 on failure */
+static int write_plan(worker *w, journal *jn, int offset_new)
+{
+	char tmp[SE_BLOCK], *data;
+	unsigned int crc_blank, *crcs;
+	int i, changed = 0;
+	jn->dirty = malloc(jn->block);
+	jn->plan = malloc(jn->block * sizeof(erase_op));
+	if(jn->dirty == NULL || jn->plan == NULL){
+		fprintf(w->err, "Memory allocation failed.\n");
+		return -1;
+	}
+	memset(jn->dirty, S_ERASE, jn->block);
+	if(w->job->isdiff){
+		if((crcs = sector_crcs(w, offset_new, jn->block, &crc_blank)) == NULL)
+			return -1;
+		for(i = 0; i < jn->block; i++){
+			if((data = new_data(w->job, jn, i * SE_BLOCK, SE_BLOCK, tmp)) == NULL){
+				fprintf(w->err, "failed to read file.\n");
+				free(crcs);
+				return -1;
+			}
+			if(crcs[i] == crc32(0, data, SE_BLOCK))
+				jn->dirty[i] = S_KEEP;
+			else if(crcs[i] == crc_blank)
+				jn->dirty[i] = S_BLANK;
+			changed += jn->dirty[i] != S_KEEP;
+		}
+		free(crcs);
+		fprintf(w->out, "%d of %d sectors changed.\n", changed, jn->block);
+	}
+	jn->nplan = erase_plan(sf_chip(w->ctx), jn->dirty, offset_new, jn->block, jn->plan);
+	return 0;
+}
+
+/* program n bytes of data at addr, with -v each sector is checked
+ * while the next one is sent and repaired if it differs. several chips
+ * are programmed at once and verified one by one afterwards
+ * return 0 on success, -1 on failure */
+static int program(worker *w, char *data, int addr, int n)
+{
+	int result;
+	phase_begin(w, PH_PROGRAM);
+	if(w->job->isverify && !several(w->job->cs))
+		result = sf_program_verify(w->ctx, data, addr, n);
+	else
+		result = sf_program(w->ctx, data, addr, n);
+	phase_end(w, n, 1);
+	if(result < 0){
+		fprintf(w->err, "%s at %X\n", sf_strerror(result), sf_error_addr(w->ctx));
+		return -1;
+	}
+	return 0;
+}
+
+/* program new content [first, last), taken from the kept head,
+ * the image and the kept tail in turn, in place
+ * return 0 on success, -1 on failure */
+static int write_range(worker *w, journal *jn, int offset_new, int first, int last)
+{
+	int lo = w->job->offset_rom & 0xFFF, hi = lo + w->job->size, b;
+	char *data;
+	for(; first < last; first = b){
+		if(first < lo){
+			b = last < lo ? last : lo;
+			data = jn->head + first;
+		}
+		else if(first < hi){
+			b = last < hi ? last : hi;
+			if((data = image_get(&w->job->im, first - lo, b - first)) == NULL){
+				fprintf(w->err, "failed to read file.\n");
+				return -1;
+			}
+		}
+		else{
+			b = last;
+			data = jn->tail + first - (jn->block - 1) * SE_BLOCK;
+		}
+		if(program(w, data, offset_new + first, b - first) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+/* program the changed sectors of new content [first, last)
+ * return 0 on success, -1 on failure */
+static int write_sectors(worker *w, journal *jn, int offset_new, int first, int last)
+{
+	int i, run;
+	for(i = first / SE_BLOCK; i * SE_BLOCK < last; i = run){
+		for(run = i; run * SE_BLOCK < last && jn->dirty[run] != S_KEEP; run++)
+			;
+		if(run > i && write_range(w, jn, offset_new, i * SE_BLOCK, run * SE_BLOCK) < 0)
+			return -1;
+		run++;
+	}
+	return 0;
+}
+
+/* program the image at offset_rom, sectors are erased as planned.
+ * partial sectors at both ends are read first and kept.
+ * every erase and every JOURNAL_UNIT programmed is journaled, on
+ * resume the last unit is checked and the job goes on from there.
+ * with -v everything programmed is checked on the way.
+ * return 0 on success, -1 on failure */
+static int write_rom(worker *w, char *id)
+{
+	job *j = w->job;
+	journal jn, old;
+	erase_op redo[JOURNAL_UNIT / SE_BLOCK];
+	int size_new, offset_new, first, last;
+	int i, n, resumed = 0, result = -1;
+	memset(&jn, 0, sizeof(journal));
+	jn.op = 'w';
+	memcpy(jn.id, id, 3);
+	jn.crc = j->crc;
+	jn.addr = j->offset_rom;
+	jn.size = j->size;
+	fprintf(w->out, "Perfroming programming...\n");
+	offset_new = j->offset_rom & ~0xFFF;
+	if(j->resume && journal_load(&old, w->journal) == 0){
+		if(journal_match(&old, &jn)){
+			jn = old;
+			resumed = 1;
+		}
+		else
+			journal_end(&old, NULL, 0);
+	}
+	if(!resumed)
+		start_over(w);
+	/* check offset boundary, on resume the old content is in the journal */
+	if(!resumed && (j->offset_rom & 0xFFF)){
+		jn.has_head = 1;
+		if(read_block(w, jn.head, j->offset_rom & ~0xFFF, 0x1000) < 0){
+			fprintf(w->err, "RD instruction failed.\n");
+			return -1;
+		}
+	}
+	if(!resumed && ((j->offset_rom + j->size) & 0xFFF)){
+		jn.has_tail = 1;
+		if(read_block(w, jn.tail, (j->offset_rom + j->size) & ~0xFFF, 0x1000) < 0){
+			fprintf(w->err, "RD instruction failed.\n");
+			return -1;
+		}
+	}
+	size_new = ((j->size + (j->offset_rom & 0xFFF)) & ~0xFFF) + (jn.has_tail * 0x1000);
+	fprintf(w->out, "Old size: %X\nNew size: %X\nOld offset: %X\nNew offset: %X\n",
+	        j->size, size_new, j->offset_rom, offset_new);
+	if(!resumed){
+		jn.block = size_new >> 12;
+		if(write_plan(w, &jn, offset_new) < 0)
+			goto Done;
+	}
+	if(jn.block != size_new >> 12){
+		fprintf(w->err, "Journal does not fit the job.\n");
+		goto Done;
+	}
+	if(w->journal && journal_start(&jn, w->journal) < 0){
+		fprintf(w->err, "Cannot write journal %s\n", w->journal);
+		goto Done;
+	}
+	if(resumed)
+		fprintf(w->out, "Resuming after %d erase operations and %X bytes\n",
+		        jn.erased, jn.done);
+	for(i = jn.done / SE_BLOCK; i < jn.block; i++)
+		if(jn.dirty[i] != S_KEEP)
+			w->goal += SE_BLOCK;
+	fprintf(w->out, "Erase plan:\n");
+	erase_print(w->out, sf_chip(w->ctx), jn.plan + jn.erased, jn.nplan - jn.erased);
+	fprintf(w->out, "Erasing block...\n");
+	for(i = jn.erased; i < jn.nplan; i++){
+		if(erase_run(w, jn.plan + i, 1) < 0)
+			goto Done;
+		journal_erased(&jn, i + 1);
+	}
+	/* the last unit journaled may have been cut short, check it
+	 * and erase it again if it does not match */
+	if(jn.done){
+		first = (jn.done - 1) / JOURNAL_UNIT * JOURNAL_UNIT;
+		if(verify_range(w, &jn, first, jn.done, NULL) != 0){
+			fprintf(w->out, "Last unit at %X is bad, erasing it again.\n", offset_new + first);
+			for(i = first / SE_BLOCK, n = 0; i * SE_BLOCK < jn.done; i++)
+				if(jn.dirty[i] != S_KEEP){
+					redo[n].type = E_SE;
+					redo[n++].addr = offset_new + i * SE_BLOCK;
+				}
+			if(erase_run(w, redo, n) < 0)
+				goto Done;
+			journal_done(&jn, first);
+		}
+	}
+	fprintf(w->out, "Writing page...\n");
+	for(first = jn.done; first < size_new; first = last){
+		last = first + JOURNAL_UNIT < size_new ? first + JOURNAL_UNIT : size_new;
+		if(write_sectors(w, &jn, offset_new, first, last) < 0)
+			goto Done;
+		journal_done(&jn, last);
+	}
+	fprintf(w->out, "Operation complete.\n");
+	result = 0;
+Done:
+	journal_end(&jn, w->journal, result == 0);
+	return result;
+}
+
+/* compare the whole image with the chip at offset_rom
+ * return number of differing bytes, -1 on failure */
+static int verify_image(worker *w)
+{
+	job *j = w->job;
+	char *data;
+	int i, n, bad, diff = 0;
+	fprintf(w->out, "Verifying...\n");
+	w->goal += j->size;
+	for(i = 0; i < j->size; i += n){
+		n = j->size - i < IMAGE_KEEP ? j->size - i : IMAGE_KEEP;
+		if((data = image_get(&j->im, i, n)) == NULL ||
+		   (bad = verify(w, data, j->offset_rom + i, n, w->out)) < 0)
+			return -1;
+		diff += bad;
+	}
+	return diff;
+}
+
+/* the run of sectors that regions from i on touch, [*first, *last),
+ * ends before the first sector none of them touches.
+ * return the first region after the run */
+static int region_run(layout *lay, int i, int *first, int *last)
+{
+	int end;
+	*first = *last = lay->r[i].addr & ~(SE_BLOCK - 1);
+	for(; i < lay->n && (lay->r[i].addr & ~(SE_BLOCK - 1)) <= *last; i++){
+		end = (lay->r[i].addr + lay->r[i].size + SE_BLOCK - 1) & ~(SE_BLOCK - 1);
+		if(end > *last)
+			*last = end;
+	}
+	return i;
+}
+
+/* program the sectors [addr, addr + size) touched by the n regions at r.
+ * the bytes they leave out are read from the chip first and written back.
+ * return 0 on success, -1 on failure */
+static int write_run(worker *w, region *r, int n, int addr, int size)
+{
+	int i, k, a, b, nplan, changed = 0, nsec = size / SE_BLOCK, result = -1;
+	char *buf = malloc(size), *dirty = malloc(nsec);
+	int *covered = calloc(nsec, sizeof(int));
+	erase_op *plan = malloc(nsec * sizeof(erase_op));
+	unsigned int crc_blank, *crcs;
+	if(buf == NULL || dirty == NULL || covered == NULL || plan == NULL){
+		fprintf(w->err, "Memory allocation failed.\n");
+		goto Done;
+	}
+	for(k = 0; k < n; k++)
+		for(a = r[k].addr; a < r[k].addr + r[k].size; a = b){
+			b = (a & ~(SE_BLOCK - 1)) + SE_BLOCK;
+			b = b < r[k].addr + r[k].size ? b : r[k].addr + r[k].size;
+			covered[(a - addr) / SE_BLOCK] += b - a;
+		}
+	/* old content of the sectors only partly covered, a run at a time */
+	for(i = 0; i < nsec; i = k){
+		for(k = i; k < nsec && covered[k] < SE_BLOCK; k++)
+			;
+		if(k > i){
+			w->goal += (k - i) * SE_BLOCK;
+			if(read_block(w, buf + i * SE_BLOCK, addr + i * SE_BLOCK, (k - i) * SE_BLOCK) < 0){
+				fprintf(w->err, "RD instruction failed.\n");
+				goto Done;
+			}
+		}
+		k++;
+	}
+	for(k = 0; k < n; k++)
+		memcpy(buf + r[k].addr - addr, r[k].data, r[k].size);
+	memset(dirty, S_ERASE, nsec);
+	if(w->job->isdiff){
+		if((crcs = sector_crcs(w, addr, nsec, &crc_blank)) == NULL)
+			goto Done;
+		for(i = 0; i < nsec; i++){
+			if(crcs[i] == crc32(0, buf + i * SE_BLOCK, SE_BLOCK))
+				dirty[i] = S_KEEP;
+			else if(crcs[i] == crc_blank)
+				dirty[i] = S_BLANK;
+			changed += dirty[i] != S_KEEP;
+		}
+		free(crcs);
+		w->goal -= (long long)(nsec - changed) * SE_BLOCK;
+		fprintf(w->out, "%d of %d sectors changed.\n", changed, nsec);
+	}
+	nplan = erase_plan(sf_chip(w->ctx), dirty, addr, nsec, plan);
+	erase_print(w->out, sf_chip(w->ctx), plan, nplan);
+	if(erase_run(w, plan, nplan) < 0)
+		goto Done;
+	for(i = 0; i < nsec; i = k){
+		for(k = i; k < nsec && dirty[k] != S_KEEP; k++)
+			;
+		if(k > i && program(w, buf + i * SE_BLOCK, addr + i * SE_BLOCK, (k - i) * SE_BLOCK) < 0)
+			goto Done;
+		k++;
+	}
+	result = 0;
+Done:
+	free(buf);
+	free(dirty);
+	free(covered);
+	free(plan);
+	return result;
+}
+
+/* program a sparse image, run by run of the sectors its regions
+ * touch. sectors between the runs are not erased or read.
+ * return 0 on success, -1 on failure */
+static int write_regions(worker *w)
+{
+	layout *lay = &w->job->lay;
+	int i, k, first, last;
+	fprintf(w->out, "Programming %d regions, %X bytes\n", lay->n, lay->size);
+	for(i = 0; i < lay->n; i = region_run(lay, i, &first, &last))
+		w->goal += last - first;
+	for(i = 0; i < lay->n; i = k){
+		k = region_run(lay, i, &first, &last);
+		fprintf(w->out, "Sectors %X-%X\n", first, last - 1);
+		if(write_run(w, lay->r + i, k - i, first, last - first) < 0)
+			return -1;
+	}
+	fprintf(w->out, "Operation complete.\n");
+	return 0;
+}
+
+/* compare the regions of a sparse image with the chip
+ * return number of differing bytes, -1 on failure */
+static int verify_regions(worker *w)
+{
+	layout *lay = &w->job->lay;
+	int i, bad, diff = 0;
+	fprintf(w->out, "Verifying...\n");
+	w->goal += lay->size;
+	for(i = 0; i < lay->n; i++){
+		if((bad = verify(w, lay->r[i].data, lay->r[i].addr, lay->r[i].size, w->out)) < 0)
+			return -1;
+		diff += bad;
+	}
+	return diff;
+}
+
+/* compare the chip with the file
+ * return 0 if they match, -1 if not or on failure */
+static int verify_job(worker *w)
+{
+	job *j = w->job;
+	int n;
+	/* a write to one chip checks what it programs on the way */
+	if(j->iswrite && !several(j->cs))
+		n = 0;
+	else
+		n = j->lay.n ? verify_regions(w) : verify_image(w);
+	if(n){
+		if(n < 0)
+			fprintf(w->err, "Verify failed.\n");
+		else
+			fprintf(w->err, "%d bytes differ.\n", n);
+		return -1;
+	}
+	fprintf(w->out, "Verify OK.\n");
+	return 0;
+}
+
+/* identify each chip of --cs, those without an ID or with another one
+ * than the lowest are left out, then select the others
+ * return 0 on success, -1 if none is left or on failure */
+static int check_chips(worker *w)
+{
+	char id[3], first[3];
+	int i, have = 0;
+	for(i = 0; i < CS_MAX; i++){
+		if(!(w->job->cs & 1 << i))
+			continue;
+		if(select_chips(w, 1 << i) < 0)
+			return -1;
+		if(sf_chip_id(w->ctx, id) < 0){
+			fprintf(w->err, "Chip select %d: no chip.\n", i);
+			w->failed |= 1 << i;
+		}
+		else if(have && memcmp(id, first, 3)){
+			fprintf(w->err, "Chip select %d: chip ID %02X %02X %02X differs.\n", i,
+			        (unsigned char)id[0], (unsigned char)id[1], (unsigned char)id[2]);
+			w->failed |= 1 << i;
+		}
+		else if(!have){
+			memcpy(first, id, 3);
+			have = 1;
+		}
+	}
+	if((w->cs = w->job->cs & ~w->failed) == 0){
+		fprintf(w->err, "No chip left to work on.\n");
+		return -1;
+	}
+	return select_chips(w, w->cs);
+}
+
+/* verify each chip still written on its own
+ * return 0 if all match, -1 otherwise */
+static int verify_chips(worker *w)
+{
+	int i, result = 0;
+	/* learn which chips the write dropped */
+	if(select_chips(w, w->cs) < 0)
+		return -1;
+	for(i = 0; i < CS_MAX; i++){
+		if(!(w->cs & 1 << i))
+			continue;
+		fprintf(w->out, "Chip select %d:\n", i);
+		if(select_chips(w, 1 << i) < 0)
+			return -1;
+		if(verify_job(w) < 0){
+			w->failed |= 1 << i;
+			result = -1;
+		}
+	}
+	return result;
+}
+
+/* print the result of each chip of --cs, all those still written fail
+ * with the job. the chips are selected again for sf_close()
+ * return 0 if all passed, -1 otherwise */
+static int chip_results(worker *w, int result)
+{
+	int i;
+	if(select_chips(w, w->job->cs) < 0)
+		result = -1;
+	if(result)
+		w->failed |= w->cs;
+	for(i = 0; i < CS_MAX; i++)
+		if(w->job->cs & 1 << i)
+			fprintf(w->out, "Chip select %d: %s\n", i, w->failed & 1 << i ? "FAIL" : "PASS");
+	return w->failed ? -1 : result;
+}
+
+/* keep what the report needs and close the port */
+static void close_port(worker *w, char *id)
+{
+	if(w->m)
+		sf_metrics(w->ctx, w->m);
+	w->chip = *sf_chip(w->ctx);
+	memcpy(w->id, id, 3);
+	w->version = sf_version(w->ctx);
+	w->baud = sf_baud(w->ctx);
+	w->zip = sf_compress(w->ctx);
+	sf_close(w->ctx);
+}
+
+/* open the port, identify the chip and do the job on it.
+ * return 0 on success, -1 on failure */
+static int run_port(worker *w)
+{
+	static char *sources[] = {
+		[CHIP_GUESS] = "defaults",
+		[CHIP_TABLE] = "ID table",
+		[CHIP_SFDP] = "SFDP",
+	};
+	job *j = w->job;
+	chip_info *chip;
+	char id[3];
+	int end, result = 0;
+
+	w->start = now_us();
+	phase_begin(w, PH_OPEN);
+	w->ctx = sf_open(w->port, j->max_baud, j->iszip ? SF_ZIP : 0, &result);
+	phase_end(w, 0, 1);
+	if(w->ctx == NULL){
+		fprintf(w->err, "%s: %s\n", w->port, sf_strerror(result));
+		w->failed = j->cs;
+		return -1;
+	}
+	if(w->live)
+		sf_set_progress(w->ctx, live_progress, w);
+	fprintf(w->out, "Protocol version %d\n", sf_version(w->ctx));
+	if(j->max_baud)
+		fprintf(w->out, "Baud rate %d\n", sf_baud(w->ctx));
+	if(j->iszip && !sf_compress(w->ctx))
+		fprintf(w->err, "Programmer does not support compression.\n");
+	
+	memset(id, 0, 3);
+	if(j->cs && check_chips(w) < 0){
+		w->failed = j->cs;
+		result = chip_results(w, -1);
+		close_port(w, id);
+		return result;
+	}
+	if(sf_chip_id(w->ctx, id) == SF_ERR_LINK)
+		fprintf(w->err, "Cannot get chip ID, trying to continue.\n");
+	else
+		fprintf(w->out, "Chip ID: %02X %02X %02X \n", (unsigned char)id[0],
+		        (unsigned char)id[1], (unsigned char)id[2]);
+	chip = sf_chip(w->ctx);
+	fprintf(w->out, "Chip: %s, %d KB, %d byte pages, parameters from %s\n",
+	        chip->name, chip->size / 1024, chip->page, sources[chip->source]);
+	end = j->lay.n ? j->lay.r[j->lay.n - 1].addr + j->lay.r[j->lay.n - 1].size :
+	      j->offset_rom + j->size;
+	if(chip->size && (j->offset_rom >= chip->size || end > chip->size)){
+		fprintf(w->err, "Range exceeds the chip size.\n");
+		w->failed = j->cs;
+		close_port(w, id);
+		return -1;
+	}
+
+	if(j->isce)
+		result = erase_chip(w);
+	if(!result && j->isread)
+		result = read_rom(w, id);
+	if(!result && j->iswrite)
+		result = j->lay.n ? write_regions(w) : write_rom(w, id);
+	if(!result && j->isverify)
+		result = several(j->cs) ? verify_chips(w) : verify_job(w);
+	if(j->cs)
+		result = chip_results(w, result);
+	close_port(w, id);
+	return result;
+}
+
+static void *gang_worker(void *arg)
+{
+	worker *w = arg;
+	long t0 = now_ms();
+	w->result = run_port(w);
+	w->ms = now_ms() - t0;
+	fclose(w->out);
+	return NULL;
+}
+
+/* write s as a JSON string */
+static void json_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for(; *s; s++){
+		if(*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04X", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/* write the metrics report of n ports to path
+ * return 0 on success, -1 on failure */
+static int write_report(char *path, worker *w, int n)
+{
+	static const metrics none;
+	FILE *f = fopen(path, "w");
+	phase *p;
+	int i, k, first;
+	if(f == NULL){
+		fprintf(stderr, "Cannot write report %s, %s\n", path, strerror(errno));
+		return -1;
+	}
+	fprintf(f, "{\n\t\"version\": 1,\n\t\"ports\": [");
+	for(i = 0; i < n; i++){
+		fprintf(f, "%s\n\t\t{\n\t\t\t\"port\": ", i ? "," : "");
+		json_string(f, w[i].port);
+		fprintf(f, ",\n\t\t\t\"result\": \"%s\",\n", w[i].result ? "fail" : "pass");
+		if(w[i].job->cs){
+			fprintf(f, "\t\t\t\"chips\": [");
+			for(k = 0, first = 1; k < CS_MAX; k++){
+				if(!(w[i].job->cs & 1 << k))
+					continue;
+				fprintf(f, "%s{\"cs\": %d, \"result\": \"%s\"}", first ? "" : ", ", k,
+				        w[i].failed & 1 << k ? "fail" : "pass");
+				first = 0;
+			}
+			fprintf(f, "],\n");
+		}
+		fprintf(f, "\t\t\t\"ms\": %ld,\n", w[i].ms);
+		fprintf(f, "\t\t\t\"chip\": {\"id\": \"%02X%02X%02X\", \"name\": ",
+		        (unsigned char)w[i].id[0], (unsigned char)w[i].id[1],
+		        (unsigned char)w[i].id[2]);
+		json_string(f, w[i].chip.name);
+		fprintf(f, ", \"size\": %d, \"addr_bytes\": %d},\n", w[i].chip.size,
+		        w[i].chip.addr_bytes);
+		fprintf(f, "\t\t\t\"link\": {\"protocol\": %d, \"baud\": %d, \"compress\": %d},\n",
+		        w[i].version, w[i].baud, w[i].zip);
+		fprintf(f, "\t\t\t\"phases\": {");
+		for(k = 0, first = 1; k < PH_COUNT; k++){
+			p = w[i].phases + k;
+			if(!p->count)
+				continue;
+			fprintf(f, "%s\n\t\t\t\t\"%s\": {\"ms\": %lld, \"bytes\": %lld, "
+			        "\"count\": %ld, \"kb_per_s\": %.1f}", first ? "" : ",",
+			        phase_names[k], p->us / 1000, p->bytes, p->count,
+			        p->us ? p->bytes * 1000000.0 / 1024 / p->us : 0.0);
+			first = 0;
+		}
+		fprintf(f, "%s},\n", first ? "" : "\n\t\t\t");
+		metrics_json(f, w[i].m ? w[i].m : (metrics *)&none, "\t\t\t");
+		fprintf(f, "\n\t\t}");
+	}
+	fprintf(f, "\n\t]\n}\n");
+	if(fclose(f)){
+		fprintf(stderr, "Cannot write report %s, %s\n", path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* journal of the job on file path, in gang mode each port gets
+ * its own, named after the port.
+ * return a new string, NULL without file */
+static char *journal_path(char *path, char *port)
+{
+	char *name, *base;
+	if(path == NULL || !strcmp(path, "-"))
+		return NULL;
+	base = port ? strrchr(port, '/') : NULL;
+	base = base ? base + 1 : port;
+	name = malloc(strlen(path) + (base ? strlen(base) + 1 : 0) + sizeof(".journal"));
+	if(name == NULL)
+		return NULL;
+	if(base)
+		sprintf(name, "%s.%s.journal", path, base);
+	else
+		sprintf(name, "%s.journal", path);
+	return name;
+}
+
+/* run the job on all ports at once, one thread each.
+ * transcripts are printed as the ports finish, in port order.
+ * return number of failed ports */
+static int gang_run(job *j, char **ports, int n)
+{
+	worker w[PORT_MAX];
+	char *line, *next;
+	int i, failed = 0;
+	long t0 = now_ms(), ms;
+	/* build the crc tables before the workers share them */
+	crc32(0, NULL, 0);
+	for(i = 0; i < n; i++){
+		memset(&w[i], 0, sizeof(worker));
+		w[i].port = ports[i];
+		w[i].journal = journal_path(j->path, ports[i]);
+		w[i].job = j;
+		w[i].result = -1;
+		if(j->report && (w[i].m = calloc(1, sizeof(metrics))) == NULL)
+			fprintf(stderr, "%s: no memory for metrics.\n", ports[i]);
+		w[i].out = w[i].err = open_memstream(&w[i].log, &w[i].log_size);
+		if(w[i].out == NULL ||
+		   pthread_create(&w[i].thread, NULL, gang_worker, &w[i]) != 0){
+			fprintf(stderr, "%s: cannot start worker.\n", ports[i]);
+			if(w[i].out)
+				fclose(w[i].out);
+			w[i].out = NULL;
+		}
+	}
+	for(i = 0; i < n; i++){
+		if(w[i].out == NULL)
+			continue;
+		pthread_join(w[i].thread, NULL);
+		for(line = w[i].log; line && *line; line = next){
+			next = strchr(line, '\n');
+			next = next ? next + 1 : line + strlen(line);
+			printf("%s: %.*s", w[i].port, (int)(next - line), line);
+		}
+		free(w[i].log);
+		free(w[i].journal);
+	}
+	ms = now_ms() - t0;
+	printf("\nPort                Result  Time\n");
+	for(i = 0; i < n; i++){
+		printf("%-20s%-8s%ld.%03ld s\n", w[i].port, w[i].result ? "FAIL" : "PASS",
+		       w[i].ms / 1000, w[i].ms % 1000);
+		failed += w[i].result != 0;
+	}
+	printf("%d of %d passed in %ld.%03ld s", n - failed, n, ms / 1000, ms % 1000);
+	if(j->iswrite && ms > 0)
+		printf(", %ld KB/s aggregate", (long)j->size * (n - failed) / ms);
+	printf("\n");
+	if(j->report)
+		write_report(j->report, w, n);
+	for(i = 0; i < n; i++)
+		free(w[i].m);
+	return failed;
+}
+
+/* chip selects of a list like 0-3,5
+ * return their mask, -1 if malformed */
+static int parse_cs(char *s)
+{
+	char *end;
+	long a, b;
+	int mask = 0;
+	for(;;){
+		a = b = strtol(s, &end, 10);
+		if(end == s)
+			return -1;
+		if(*end == '-'){
+			s = end + 1;
+			b = strtol(s, &end, 10);
+			if(end == s)
+				return -1;
+		}
+		if(a < 0 || b >= CS_MAX || a > b)
+			return -1;
+		for(; a <= b; a++)
+			mask |= 1 << a;
+		if(*end == 0)
+			return mask;
+		if(*end != ',')
+			return -1;
+		s = end + 1;
+	}
+}
 
 void printhelp(char *argv0)
 {
 	printf("Usage: %s [options]\n",argv0);
 	printf("Opions:\n");
 	printf("  -p <port>         Required. Specify serial port device.\n");
+	printf("                    Repeat to program several boards at once.\n");
 	printf("  -f <filename>     Specify a file to read or written.\n");
+	printf("  --format <format> bin, hex (Intel HEX), srec or layout, by default\n");
+	printf("                    taken from the extension of the file, else bin.\n");
+	printf("                    Only the sectors the data touches are written.\n");
 	printf("  -r                Dump rom content into file.\n");
 	printf("  -w                Program rom content from file.\n");
+	printf("  -v                Verify rom content against file, after -w if given.\n");
+	printf("  -d                With -w, read back each sector first and only\n");
+	printf("                    erase and program sectors that differ.\n");
 	printf("  -b <file_offset>  Read file start from offset value.\n");
 	printf("  -B <rom_offset>   Read file start from offset value.\n");
 	printf("  -s <size>         Read or write a given size.\n");
 	printf("                    Prefix 0x for hex value, 00 for octal value\n");
+	printf("  -z                Compress data on the serial link if supported\n");
+	printf("  -S <baud>         Negotiate serial speed up to baud with the programmer\n");
 	printf("  -e                Perform a chip erase, other options are ignored\n");
+	printf("  --cache[=<dir>]   With -r, keep the sectors read in dir and only read\n");
+	printf("                    the ones that changed, ~/.cache/spiflash by default\n");
+	printf("  --resume          Continue an interrupted -w or -r from its journal,\n");
+	printf("                    <filename>.journal\n");
+	printf("  --cs <list>       Chip selects of the programmer to work on, e.g. 0-3\n");
+	printf("                    or 0,2. Writes and erases go to all chips at once,\n");
+	printf("                    -v checks each chip on its own.\n");
+	printf("  --daemon <socket> Keep the ports open and take jobs on a Unix socket\n");
+	printf("  --metrics <file>  Write timings of phases and commands to file as JSON\n");
 	printf("  -h                Print this message\n");
 }
 
 int main(int argc, char **argv)
 {
-	char *port = NULL, *path = NULL;
-	int isread=0, iswrite=0, isce = 0, offset_rom=0,size=0,opt;
-	long offset_file = 0;
+	static const struct option options[] = {
+		{"resume", no_argument, NULL, 'R'},
+		{"daemon", required_argument, NULL, 'D'},
+		{"metrics", required_argument, NULL, 'M'},
+		{"format", required_argument, NULL, 'F'},
+		{"cache", optional_argument, NULL, 'C'},
+		{"cs", required_argument, NULL, 'L'},
+		{NULL, 0, NULL, 0}
+	};
+	char *ports[PORT_MAX], *sock = NULL, *format = NULL;
+	job j = {0};
+	worker w = {0};
+	metrics m;
+	int nports = 0, result, opt;
+	long t0;
+	long offset_file = 0, n;
 	if(argc == 1){
 		printhelp(argv[0]);
 		exit(1);
 	}
-	while((opt = getopt(argc, argv, "p:f:b:B:s:rweh")) != -1){
+	while((opt = getopt_long(argc, argv, "p:f:b:B:s:S:rwvdzeh", options, NULL)) != -1){
 		switch(opt){
+			case 'R':
+				j.resume = 1;
+				break;
+			case 'D':
+				sock = optarg;
+				break;
+			case 'M':
+				j.report = optarg;
+				break;
+			case 'F':
+				format = optarg;
+				break;
+			case 'C':
+				if(optarg && !*optarg){
+					fprintf(stderr,"Empty cache directory, use --cache=<dir>\n");
+					exit(1);
+				}
+				if((j.cache = cache_dir(optarg)) == NULL){
+					fprintf(stderr,"No home for the cache, use --cache=<dir>\n");
+					exit(1);
+				}
+				break;
+			case 'L':
+				if((j.cs = parse_cs(optarg)) <= 0){
+					fprintf(stderr,"Wrong chip selects, expected a list like 0-3,5\n");
+					exit(1);
+				}
+				break;
 			case 'p':
-				port = optarg;
+				if(nports == PORT_MAX){
+					fprintf(stderr,"At most %d ports\n", PORT_MAX);
+					exit(1);
+				}
+				ports[nports++] = optarg;
 				break;
 			case 'f':
-				path = optarg;
+				j.path = optarg;
 				break;
 			case 'b':
 				offset_file = strtol(optarg, NULL, 0);
@@ -50,39 +1394,57 @@ int main(int argc, char **argv)
 				}
 				break;
 			case 'B':
-				offset_rom = (int)strtol(optarg, NULL, 0);
-				if(offset_rom < 0 || offset_rom > 0xFFFFFF){
+				n = strtol(optarg, NULL, 0);
+				if(n < 0 || n >= CHIP_SIZE_MAX){
 					fprintf(stderr,"Wrong rom offset\n");
 					exit(1);
 				}
+				j.offset_rom = n;
 				break;
 			case 's':
-				size = (int)strtol(optarg, NULL, 0);
-				if(size < 0 || size > 0xFFFFFF || size + offset_rom > 0xFFFFFF){
+				n = strtol(optarg, NULL, 0);
+				if(n < 0 || n > CHIP_SIZE_MAX - j.offset_rom){
 					fprintf(stderr,"Wrong size\n");
 					exit(1);
 				}
+				j.size = n;
+				break;
+			case 'z':
+				j.iszip = 1;
+				break;
+			case 'S':
+				j.max_baud = (int)strtol(optarg, NULL, 0);
 				break;
 			case 'r':
-				if(iswrite || isce){
+				if(j.iswrite || j.isverify || j.isce){
 					fprintf(stderr,"Only one action can be specified\n");
 					exit(1);
 				}
-				isread = 1;
+				j.isread = 1;
 				break;
 			case 'w':
-				if(isread || isce){
+				if(j.isread || j.isce){
 					fprintf(stderr,"Only one action can be specified\n");
 					exit(1);
 				}
-				iswrite = 1;
+				j.iswrite = 1;
+				break;
+			case 'v':
+				if(j.isread || j.isce){
+					fprintf(stderr,"Only one action can be specified\n");
+					exit(1);
+				}
+				j.isverify = 1;
+				break;
+			case 'd':
+				j.isdiff = 1;
 				break;
 			case 'e':
-				if(isread || iswrite || offset_file || offset_rom || size){
+				if(j.isread || j.iswrite || j.isverify || offset_file || j.offset_rom || j.size){
 					fprintf(stderr,"Only one action can be specified\n");
 					exit(1);
 				}
-				isce = 1;
+				j.isce = 1;
 				break;
 			case 'h':
 			default:
@@ -91,172 +1453,89 @@ int main(int argc, char **argv)
 		}
 	}
 
-	if(port == NULL){
+	if(nports == 0){
 		fprintf(stderr, "No port specified\n");
 		exit(1);
 	}
-	if(path == NULL && !isce){
+	if(sock){
+		if(j.isread || j.iswrite || j.isverify || j.isce || j.path || j.cs){
+			fprintf(stderr, "Jobs are given to the daemon through its socket\n");
+			exit(1);
+		}
+		exit(daemon_run(sock, ports, nports, j.max_baud, j.iszip) ? 1 : 0);
+	}
+	if(j.path == NULL && !j.isce){
 		fprintf(stderr, "No file specified\n");
 		exit(1);
 	}
-	
-	/* initialize serial port */
-	int fd = serial_open(port);
-	serial_set(fd, BAUD);
-	char *buf = NULL;
-	
-	char id[3];
-	if(RDID(fd, id) < 0)
-		fprintf(stderr, "Cannot get chip ID, trying to continue.\n");
-	else{
-		printf("Chip ID: ");
-		print_array(stdout, id, 3);
-		printf("\n");
+	if((j.format = layout_format(j.path, format)) < 0){
+		fprintf(stderr, "Unknown format %s\n", format);
+		exit(1);
 	}
-
-	if(isce){
-		printf("Performing chip erase...\n");
-		if(WREN(fd) < 0){
-			fprintf(stderr, "Cannot enable write.\n");
-			exit(1);
-		}
-		if(CE(fd) < 0){
-			fprintf(stderr, "Erase failed, please try again.\n");
-			exit(1);
-		}
-		printf("Chip erased!\n");
+	if(j.format != F_BIN && (j.isread || j.size || offset_file || j.resume)){
+		fprintf(stderr, "Options -r, -s, -b and --resume take a binary file.\n");
+		exit(1);
 	}
-
-	FILE *file = NULL;
-	tcflush(fd, TCIOFLUSH);
-	int i, block;
-	if(isread){
-		buf = malloc(size);
-		if(buf == NULL){
-			fprintf(stderr, "Memory allocation failed.\n");
+	if(j.cache && !j.isread){
+		fprintf(stderr,"The cache is for dumps with -r.\n");
+		exit(1);
+	}
+	if(several(j.cs) && (j.isread || j.isdiff || j.resume)){
+		fprintf(stderr,"Several chip selects are written at once, -r, -d and --resume "
+		        "need them one by one.\n");
+		exit(1);
+	}
+	if(j.isread){
+		if(nports > 1){
+			fprintf(stderr,"Only one port can be read at a time.\n");
 			exit(1);
 		}
-		if(!size){
-			fprintf(stderr,"Please specify size for reading.\n");
-			goto Fail;
-		}
 		if(offset_file){
 			fprintf(stderr,"File offset is not allowed for option -r.\n");
-			goto Fail;
-		}
-		file = fopen(path, "w");
-		if(file == NULL){
-			fprintf(stderr,"Failed to create file, %s\n", strerror(errno));
-			goto Fail;
-		}
-		printf("Reading rom content\n");
-		/* get number of  blocks */
-		block = size / RD_BLOCK;
-		for(i = 0; i < block; i++){
-			if(RD(fd, buf + i * RD_BLOCK, offset_rom + i * RD_BLOCK, RD_BLOCK) < 0){
-				fprintf(stderr,"RD instruction failed.\n");
-				goto Fail;
-			}
-		}
-		if((size % RD_BLOCK) &&
-			RD(fd, buf + block * RD_BLOCK, 
-			   offset_rom + block * RD_BLOCK, size % RD_BLOCK) < 0)
-		{
-			fprintf(stderr,"RD instruction failed.\n");
-			goto Fail;
-		}
-		if(fwrite(buf, size, 1, file) < 1){
-			fprintf(stderr,"File write failed\n");
-			goto Fail;
+			exit(1);
 		}
-		printf("Operation complete.\n");
 	}
-
-	if(iswrite){
-		file = fopen(path,"r");
-		if(file == NULL){
-			fprintf(stderr,"Failed to open file, %s\n", strerror(errno));
-			goto Fail;
-		}
-		if(!size){
-			struct stat st;
-			if(stat(path, &st) < 0 || st.st_size > 0x1000000){
-				fprintf(stderr,"Invalid file.\n");
-				goto Fail;
-			}
-			size = (int)st.st_size;
-		}
-		printf("Perfroming programming...\n");
-		/* check offset boundary */
-		char buf_h[0x1000], buf_p[0x1000];
-		int has_h = 0, has_p = 0, size_new, offset_new, block_pp;
-		if(offset_rom & 0xFFF){
-			has_h = 1;
-			if(RD(fd, buf_h, offset_rom & ~0xFFF, 0x1000) < 0){
-				fprintf(stderr,"RD instruction failed.\n");
-				goto Fail;
-			}
-		}
-		if((offset_rom + size) & 0xFFF){
-			has_p = 1;
-			if(RD(fd, buf_p, (offset_rom + size) & ~0xFFF, 0x1000) < 0){
-				fprintf(stderr,"RD instruction failed.\n");
-				goto Fail;
-			}
-		}
-		offset_new = offset_rom & ~0xFFF;
-		size_new = ((size + (offset_rom & 0xFFF)) & ~0xFFF) + (has_p * 0x1000);
-		buf = malloc(size_new);
-		if(buf == NULL){
-			fprintf(stderr, "Memory allocation failed.\n");
-			goto Fail;
-		}
-		block = (size_new & ~0xFFF) >> 12;
-		block_pp = (size_new & ~0xFF) >> 8;
-		printf("Old size: %X\nNew size: %X\nOld offset: %X\nNew offset: %X\n",size,size_new,offset_rom, offset_new);
-		memcpy(buf, buf_h, has_h * 0x1000);
-		memcpy(buf + size_new - 0x1000, buf_p, has_p * 0x1000);
-		/* over write part of first and last block */
-		if(fread(buf + (offset_rom & 0xFFF), size, 1, file) < 1){
-			fprintf(stderr,"failed to read file.\n");
-			goto Fail;
-		}
-		printf("Erasing block...\n");
-		for(i = 0; i < block; i++){
-			if(WREN(fd) < 0){
-				fprintf(stderr,"Cannot enable write.\n");
-				goto Fail;
-			}
-			if(SE(fd, offset_new + i*0x1000)){
-				fprintf(stderr,"Erase failed.\n");
-				goto Fail;
-			}
-		}
-		printf("Writing page...\n");
-		for(i = 0; i < block_pp; i++){
-			if(WREN(fd) < 0){
-				fprintf(stderr,"Cannot enable write.\n");
-				goto Fail;
-			}
-			if(PP(fd, buf + i * 0x100, offset_new + i*0x100, 0x100) < 0){
-				fprintf(stderr,"Page write fail at %X\n", offset_new + i*0x100);
-				goto Fail;
-			}
+	if(j.format == F_BIN && !strcmp(j.path ? j.path : "", "-")){
+		if(nports > 1 || j.resume || j.isdiff){
+			fprintf(stderr,"Options -d, --resume and gang mode need a file.\n");
+			exit(1);
 		}
-		printf("Operation complete.\n");
+		/* stdout carries the dump */
+		if(j.isread)
+			w.out = stderr;
 	}
-	
-	if(file)
-		fclose(file);
-	if(buf)
-		free(buf);
-	close(fd);
-	exit(0);
+	if((j.iswrite || j.isverify) && j.format == F_BIN && image_open(&j.im, j.path, j.size) < 0)
+		exit(1);
+	if((j.iswrite || j.isverify) && j.format != F_BIN &&
+	   layout_load(&j.lay, j.path, j.format, j.offset_rom) < 0)
+		exit(1);
+	j.size = j.im.size ? j.im.size : j.lay.n ? j.lay.size : j.size;
+	if(j.im.map)
+		j.crc = crc32(0, j.im.map, j.size);
 
-Fail:
-	if(!buf)
-		free(buf);
-	close(fd);
-	exit(1);
+	if(nports > 1)
+		result = gang_run(&j, ports, nports);
+	else{
+		w.port = ports[0];
+		w.journal = journal_path(j.path, NULL);
+		w.job = &j;
+		w.out = w.out ? w.out : stdout;
+		w.err = stderr;
+		w.m = j.report ? &m : NULL;
+		memset(&m, 0, sizeof(m));
+		if(isatty(STDERR_FILENO))
+			live_start(&w);
+		t0 = now_ms();
+		result = run_port(&w);
+		w.ms = now_ms() - t0;
+		live_end(&w);
+		w.result = result;
+		if(j.report)
+			write_report(j.report, &w, 1);
+		free(w.journal);
+	}
+	image_close(&j.im);
+	layout_free(&j.lay);
+	free(j.cache);
+	exit(result ? 1 : 0);
 }
-
@@ -14,5 +14,7 @@
 #define SOH 0x01
 #define STX 0x02
 #define ETX 0x03
+#define DC1 0x11 /* start of a version 2 frame */
+#define SYN 0x16 /* version negotiation */
 
 #define BAUD B115200